@@ -0,0 +1,125 @@
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "radix.h"
+#include "fib.h"
+#include "route_entry.h"
+#include "vrf.h"
+#include "engine.h"
+#include "nexthop_group.h"
+
+/* nexthop table */
+struct route_table route_table;
+
+#define BENCH_DEFAULT_LOOKUPS (1ULL << 24)
+
+static void
+usage (const char *prog)
+{
+  int i;
+
+  fprintf (stderr,
+           "usage: %s [-6] [-t threads] [-n lookups] [-e names] "
+           "[-j json_file] <route_file>\n"
+           "       %s -R [-t threads] [-n items]\n"
+           "  -6                  : IPv6 routes\n"
+           "  -t threads          : lookup threads (default: 1)\n"
+           "  -n lookups          : lookups per structure (default: %llu)\n"
+           "  -e names            : comma separated structures to measure "
+           "(default: all)\n"
+           "  -j json_file        : also write the results as JSON\n"
+           "  -R                  : benchmark queue.c and the SPSC/MPMC "
+           "rings (threads producers and consumers) and exit\n"
+           "  <route_file>        : prefixes & nexthops input\n"
+           "structures:",
+           prog, prog, BENCH_DEFAULT_LOOKUPS);
+  for (i = 0; fib_engines[i]; i++)
+    fprintf (stderr, " %s", fib_engines[i]->name);
+  fprintf (stderr, " radix ptree\n");
+}
+
+int
+main (int argc, const char *const argv[])
+{
+  int ret, family;
+  const char *route_file = NULL;
+  const char *json_file = NULL;
+  const char *names = NULL;
+  int nthreads = 1;
+  int ring_bench = 0;
+  uint64_t lookups = BENCH_DEFAULT_LOOKUPS;
+  int arg_idx = 1;
+
+  struct rib_tree *rib_tree = NULL;
+  struct ptree *ptree = NULL;
+
+  /* options (optional) */
+  family = AF_INET;
+  while (arg_idx < argc && argv[arg_idx][0] == '-')
+    {
+      if (strcmp (argv[arg_idx], "-6") == 0)
+        family = AF_INET6;
+      else if (strcmp (argv[arg_idx], "-t") == 0 && arg_idx + 1 < argc)
+        nthreads = atoi (argv[++arg_idx]);
+      else if (strcmp (argv[arg_idx], "-n") == 0 && arg_idx + 1 < argc)
+        lookups = strtoull (argv[++arg_idx], NULL, 0);
+      else if (strcmp (argv[arg_idx], "-e") == 0 && arg_idx + 1 < argc)
+        names = argv[++arg_idx];
+      else if (strcmp (argv[arg_idx], "-j") == 0 && arg_idx + 1 < argc)
+        json_file = argv[++arg_idx];
+      else if (strcmp (argv[arg_idx], "-R") == 0)
+        ring_bench = 1;
+      else
+        {
+          fprintf (stderr, "ERROR: unknown option %s\n", argv[arg_idx]);
+          usage (argv[0]);
+          return -1;
+        }
+      arg_idx++;
+    }
+  if (nthreads < 1)
+    {
+      fprintf (stderr, "ERROR: invalid number of threads %d\n", nthreads);
+      return -1;
+    }
+
+  if (ring_bench)
+    return test_ring_benchmark (nthreads, lookups) < 0 ? -1 : 0;
+
+  /* route file (required) */
+  if (arg_idx >= argc)
+    {
+      fprintf (stderr, "ERROR: missing route_file argument\n");
+      usage (argv[0]);
+      return -1;
+    }
+  route_file = argv[arg_idx];
+
+  /* load routes once, then measure every structure */
+  if (test_load_routes (route_file, family, 0, &rib_tree, &ptree) != 0)
+    {
+      fprintf (stderr, "failed to load routes from %s\n", route_file);
+      vrf_free_all ();
+      if (ptree)
+        ptree_delete (ptree);
+      return -1;
+    }
+
+  ret = test_bench (route_file, rib_tree, ptree, family, names, nthreads,
+                    lookups, json_file);
+  if (ret < 0)
+    fprintf (stderr, "benchmark failed\n");
+
+  /* cleanup */
+  vrf_free_all ();
+  ptree_delete (ptree);
+  nhg_table_free ();
+  route_table_free (&route_table);
+
+  return ret < 0 ? -1 : 0;
+}
@@ -0,0 +1,371 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "dxr.h"
+#include "radix.h"
+#include "nexthop_group.h"
+
+struct dxr *
+dxr_new (struct dxr *t)
+{
+  if (! t)
+    {
+      t = malloc (sizeof (struct dxr));
+      if (! t)
+        return NULL;
+    }
+  memset (t, 0, sizeof (struct dxr));
+  return t;
+}
+
+static void
+_clear (struct dxr *t)
+{
+  uint32_t i;
+
+  for (i = 1; i < t->num_nh; i++)
+    nhg_unref (t->nh[i]);
+  free (t->direct);
+  free (t->range);
+  free (t->nh);
+  memset (t, 0, sizeof (struct dxr));
+}
+
+void
+dxr_free (struct dxr *t)
+{
+  if (t)
+    {
+      _clear (t);
+      free (t);
+    }
+}
+
+uint64_t
+dxr_mem_size (const struct dxr *t)
+{
+  return sizeof (struct dxr) + (1U << DXR_DIRECT_BITS) * sizeof (uint32_t)
+         + (uint64_t) t->num_range * sizeof (uint32_t)
+         + (uint64_t) t->num_nh * sizeof (int);
+}
+
+/*
+ * RIBの区間への展開. pre-order (キー順, 短いプレフィックスが先) で辿り,
+ * 祖先のスタックから各区間の最長一致を決める. 隣り合う同じnexthopの
+ * 区間はまとめる.
+ */
+struct dxr_interval
+{
+  uint32_t start;
+  int id; // nexthop id, then nexthop index
+};
+
+struct _export_arg
+{
+  struct dxr_interval *iv;
+  uint32_t num;
+  uint32_t size;
+  uint64_t cur; // start of the next interval
+  struct
+  {
+    uint32_t end;
+    int id;
+  } stack[33];
+  int sp;
+  uint32_t num_prefixes;
+};
+
+/* the addresses from cur to end go to id */
+static int
+_emit (struct _export_arg *x, uint32_t end, int id)
+{
+  struct dxr_interval *iv;
+
+  if (x->cur > end)
+    return 0;
+  if (x->num == 0 || x->iv[x->num - 1].id != id)
+    {
+      if (x->num == x->size)
+        {
+          iv = realloc (x->iv, x->size * 2 * sizeof (struct dxr_interval));
+          if (! iv)
+            return -1;
+          x->iv = iv;
+          x->size *= 2;
+        }
+      x->iv[x->num++] = (struct dxr_interval){ (uint32_t) x->cur, id };
+    }
+  x->cur = (uint64_t) end + 1;
+  return 0;
+}
+
+static int
+_export (struct rib_node *n, void *arg)
+{
+  struct _export_arg *x = (struct _export_arg *) arg;
+  uint32_t key = 0, mask, start, end;
+
+  memcpy (&key, n->key, KEY_SIZE (n->keylen));
+  mask = n->keylen ? 0xffffffffU << (32 - n->keylen) : 0;
+  start = ntohl (key) & mask;
+  end = start | ~mask;
+
+  /* close the ancestors that end before this prefix */
+  while (x->sp > 0 && x->stack[x->sp - 1].end < start)
+    {
+      if (_emit (x, x->stack[x->sp - 1].end, x->stack[x->sp - 1].id) != 0)
+        return -1;
+      x->sp--;
+    }
+  if (start > 0
+      && _emit (x, start - 1, x->sp > 0 ? x->stack[x->sp - 1].id : -1) != 0)
+    return -1;
+  x->stack[x->sp].end = end;
+  x->stack[x->sp++].id = n->route_idx[0];
+  x->num_prefixes++;
+  return 0;
+}
+
+static int
+_export_rib (struct _export_arg *x, struct rib_tree *rib_tree)
+{
+  memset (x, 0, sizeof (struct _export_arg));
+  x->size = 1024;
+  x->iv = malloc (x->size * sizeof (struct dxr_interval));
+  if (! x->iv || rib_traverse (rib_tree, _export, x) != 0)
+    return -1;
+  for (; x->sp > 0; x->sp--)
+    if (_emit (x, x->stack[x->sp - 1].end, x->stack[x->sp - 1].id) != 0)
+      return -1;
+  return _emit (x, 0xffffffffU, -1);
+}
+
+/* nexthop ids to indexes of t->nh (open addressing) */
+#define NH_MAP_SIZE (DXR_MAX_NH * 2)
+
+static int
+_nh_index (struct dxr *t, int *map, int id)
+{
+  uint32_t h = ((uint32_t) id * 0x9E3779B1u) >> 15;
+
+  if (id < 0)
+    return 0;
+  for (;; h = (h + 1) & (NH_MAP_SIZE - 1))
+    {
+      if (map[h] == 0)
+        break;
+      if (t->nh[map[h]] == id)
+        return map[h];
+    }
+  if (t->num_nh == DXR_MAX_NH)
+    return -1;
+  t->nh[t->num_nh] = id;
+  nhg_ref (id);
+  map[h] = t->num_nh;
+  return t->num_nh++;
+}
+
+/* range lists of the chunks, shared by content */
+struct _build
+{
+  struct dxr *t;
+  uint32_t size;  // capacity of t->range
+  uint32_t *desc; // direct entries of the range lists, 0: empty
+  uint32_t *hash;
+  uint32_t mask;
+  uint32_t *words; // range list of the current chunk
+};
+
+static uint32_t
+_hash_words (const uint32_t *w, uint32_t n, uint32_t desc)
+{
+  uint32_t h = 2166136261u ^ (desc >> 23);
+  uint32_t i;
+
+  for (i = 0; i < n; i++)
+    h = (h ^ w[i]) * 16777619u;
+  return h;
+}
+
+/* store a range list of n words, returns the direct entry or 0 */
+static uint32_t
+_add_range (struct _build *b, uint32_t n, uint32_t count, int is_short)
+{
+  struct dxr *t = b->t;
+  uint32_t h, i, desc, *range;
+
+  desc = DXR_ENTRY (0, count, is_short);
+  h = _hash_words (b->words, n, desc);
+  for (i = h & b->mask; b->desc[i] != 0; i = (i + 1) & b->mask)
+    if (b->hash[i] == h && (b->desc[i] & ~DXR_MAX_BASE) == desc
+        && memcmp (&t->range[DXR_BASE (b->desc[i])], b->words,
+                   n * sizeof (uint32_t))
+               == 0)
+      {
+        t->num_shared++;
+        return b->desc[i];
+      }
+
+  if (t->num_range + n - 1 > DXR_MAX_BASE)
+    return 0;
+  while (t->num_range + n > b->size)
+    {
+      range = realloc (t->range, b->size * 2 * sizeof (uint32_t));
+      if (! range)
+        return 0;
+      t->range = range;
+      b->size *= 2;
+    }
+  memcpy (&t->range[t->num_range], b->words, n * sizeof (uint32_t));
+  desc |= t->num_range;
+  t->num_range += n;
+  b->desc[i] = desc;
+  b->hash[i] = h;
+  return desc;
+}
+
+/* the n ranges of a chunk, iv[0] starts at the chunk start */
+static int
+_build_chunk (struct _build *b, uint32_t c, const struct dxr_interval *iv,
+              uint32_t n)
+{
+  struct dxr *t = b->t;
+  uint32_t i, start, words, count, desc;
+  uint16_t *s;
+  int is_short = 1;
+
+  if (n == 1)
+    {
+      t->direct[c] = DXR_ENTRY (iv[0].id, 0, 0);
+      t->num_leaf++;
+      return 0;
+    }
+
+  for (i = 0; i < n; i++)
+    if ((iv[i].start & 0xff) != 0 || iv[i].id >= 0x100)
+      is_short = 0;
+
+  /* a count that does not fit goes in the first word */
+  count = n < DXR_COUNT_XL ? n : DXR_COUNT_XL;
+  words = 0;
+  if (count == DXR_COUNT_XL)
+    b->words[words++] = n;
+  if (is_short)
+    {
+      b->words[words + (n - 1) / 2] = 0; // padding
+      s = (uint16_t *) &b->words[words];
+      for (i = 0; i < n; i++)
+        {
+          start = iv[i].start & DXR_CHUNK_MASK;
+          s[i] = (uint16_t) ((start >> 8) << 8 | iv[i].id);
+        }
+      words += (n + 1) / 2;
+      t->num_short++;
+    }
+  else
+    {
+      for (i = 0; i < n; i++)
+        {
+          start = iv[i].start & DXR_CHUNK_MASK;
+          b->words[words++] = start << 16 | (uint32_t) iv[i].id;
+        }
+      t->num_long++;
+    }
+  if (count == DXR_COUNT_XL)
+    t->num_xl++;
+  t->sum_ranges += n;
+
+  desc = _add_range (b, words, count, is_short);
+  if (desc == 0)
+    return -1;
+  t->direct[c] = desc;
+  return 0;
+}
+
+int
+dxr_build (struct dxr *t, struct rib_tree *rib_tree)
+{
+  struct _export_arg x;
+  struct _build b;
+  struct dxr_interval first;
+  int *map = NULL;
+  uint32_t c, i, j, k;
+
+  if (rib_tree->family == AF_INET6)
+    {
+      fprintf (stderr, "ERROR: DXR supports IPv4 only\n");
+      return -1;
+    }
+
+  _clear (t);
+  memset (&b, 0, sizeof (b));
+  if (_export_rib (&x, rib_tree) != 0)
+    goto fail;
+  t->num_prefixes = x.num_prefixes;
+  t->num_intervals = x.num;
+
+  /* nexthop indexes instead of ids */
+  t->nh = malloc (DXR_MAX_NH * sizeof (int));
+  map = calloc (NH_MAP_SIZE, sizeof (int));
+  if (! t->nh || ! map)
+    goto fail;
+  t->nh[0] = -1;
+  t->num_nh = 1;
+  for (i = 0; i < x.num; i++)
+    if ((x.iv[i].id = _nh_index (t, map, x.iv[i].id)) < 0)
+      {
+        fprintf (stderr, "ERROR: DXR: more than %d nexthops\n", DXR_MAX_NH);
+        goto fail;
+      }
+
+  b.t = t;
+  b.size = 1024;
+  b.mask = (2U << DXR_DIRECT_BITS) - 1;
+  t->direct = malloc ((1U << DXR_DIRECT_BITS) * sizeof (uint32_t));
+  t->range = malloc (b.size * sizeof (uint32_t));
+  b.desc = calloc (b.mask + 1, sizeof (uint32_t));
+  b.hash = malloc ((b.mask + 1) * sizeof (uint32_t));
+  b.words = malloc ((DXR_CHUNK_MASK + 2) * sizeof (uint32_t));
+  if (! t->direct || ! t->range || ! b.desc || ! b.hash || ! b.words)
+    goto fail;
+
+  /* iv[j]: the interval that contains the start of chunk c */
+  j = 0;
+  for (c = 0; c < (1U << DXR_DIRECT_BITS); c++)
+    {
+      uint32_t end = (c << DXR_CHUNK_BITS) | DXR_CHUNK_MASK;
+
+      while (j + 1 < x.num && x.iv[j + 1].start <= end - DXR_CHUNK_MASK)
+        j++;
+      for (k = j + 1; k < x.num && x.iv[k].start <= end; k++)
+        ;
+      first = x.iv[j];
+      x.iv[j].start = c << DXR_CHUNK_BITS; // clipped to the chunk
+      if (_build_chunk (&b, c, &x.iv[j], k - j) != 0)
+        {
+          fprintf (stderr, "ERROR: DXR range table is full\n");
+          goto fail;
+        }
+      x.iv[j] = first;
+    }
+
+  free (x.iv);
+  free (map);
+  free (b.desc);
+  free (b.hash);
+  free (b.words);
+  return 0;
+
+fail:
+  fprintf (stderr, "ERROR: cannot build DXR\n");
+  free (x.iv);
+  free (map);
+  free (b.desc);
+  free (b.hash);
+  free (b.words);
+  _clear (t);
+  return -1;
+}
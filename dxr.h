@@ -0,0 +1,114 @@
+#ifndef DXR_H
+#define DXR_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "fib.h"
+
+/*
+ * DXR (Zec et al.). IPv4 only.
+ * RIBをアドレス区間 (開始アドレスとnexthop) の列に展開し, 上位
+ * DXR_DIRECT_BITSビットで引く直接表と, 各チャンク内の区間の開始位置の
+ * ソート済み配列 (二分探索) で引く. RIBから一括で構築し, 更新はできない.
+ * - 直接表のエントリは32ビット: base (23) | count (8) | short (1).
+ *   count 0: チャンク全体が1つの区間で, baseがnexthop表の番号.
+ *   それ以外: range表のbase (32ビットワード単位) からcount個の区間.
+ *   count == DXR_COUNT_XL のときは range[base] に個数があり, 区間はその次から.
+ * - 区間はlong (32ビット: 開始の下位ビット << 16 | nexthop番号) か,
+ *   全ての開始が256の倍数でnexthop番号が256未満ならshort
+ *   (16ビット: 開始 >> 8 << 8 | nexthop番号).
+ * - 同じ区間列のチャンクはrange表を共有する.
+ * - nexthop番号はnexthop id の表 (nh, 0: 経路なし) の添字.
+ */
+
+#define DXR_DIRECT_BITS 18 // 16 .. 20
+#define DXR_CHUNK_BITS  (32 - DXR_DIRECT_BITS)
+#define DXR_CHUNK_MASK  ((1U << DXR_CHUNK_BITS) - 1)
+
+#define DXR_BASE(e)   ((e) & 0x7fffff)
+#define DXR_COUNT(e)  (((e) >> 23) & 0xff)
+#define DXR_SHORT     0x80000000U
+#define DXR_ENTRY(base, count, is_short)                                      \
+  ((uint32_t) (base) | ((uint32_t) (count) << 23) | ((is_short) ? DXR_SHORT : 0))
+#define DXR_MAX_BASE  0x7fffff
+#define DXR_COUNT_XL  0xff
+#define DXR_MAX_NH    0x10000
+
+struct dxr
+{
+  uint32_t *direct; // 2^DXR_DIRECT_BITS entries
+  uint32_t *range;
+  uint32_t num_range; // in 32-bit words
+  int *nh;            // nexthop ids, nh[0] = -1
+  uint32_t num_nh;
+  /* statistics */
+  uint32_t num_prefixes;
+  uint32_t num_intervals;  // of the whole address space
+  uint32_t num_leaf;       // chunks of a single interval
+  uint32_t num_long;
+  uint32_t num_short;
+  uint32_t num_xl;
+  uint32_t num_shared;     // chunks that reuse a range list
+  uint64_t sum_ranges;     // over the chunks with a range list
+};
+
+struct dxr *dxr_new (struct dxr *t);
+void dxr_free (struct dxr *t);
+int dxr_build (struct dxr *t, struct rib_tree *rib_tree);
+uint64_t dxr_mem_size (const struct dxr *t);
+
+/* returns the nexthop id, or -1 if there is no route */
+static inline int
+dxr_lookup (const struct dxr *t, const uint8_t *key)
+{
+  uint32_t a, e, base, count, low, lo, hi, mid;
+
+  memcpy (&a, key, 4);
+  a = ntohl (a);
+
+  e = t->direct[a >> DXR_CHUNK_BITS];
+  base = DXR_BASE (e);
+  count = DXR_COUNT (e);
+  if (count == 0)
+    return t->nh[base];
+  if (count == DXR_COUNT_XL)
+    count = t->range[base++];
+
+  /* the last range that starts at or before the address */
+  low = a & DXR_CHUNK_MASK;
+  lo = 0;
+  hi = count - 1;
+  if (e & DXR_SHORT)
+    {
+      const uint16_t *r = (const uint16_t *) &t->range[base];
+
+      low >>= 8;
+      while (lo < hi)
+        {
+          mid = (lo + hi + 1) >> 1;
+          if ((uint32_t) (r[mid] >> 8) <= low)
+            lo = mid;
+          else
+            hi = mid - 1;
+        }
+      return t->nh[r[lo] & 0xff];
+    }
+  else
+    {
+      const uint32_t *r = &t->range[base];
+
+      while (lo < hi)
+        {
+          mid = (lo + hi + 1) >> 1;
+          if ((r[mid] >> 16) <= low)
+            lo = mid;
+          else
+            hi = mid - 1;
+        }
+      return t->nh[r[lo] & 0xffff];
+    }
+}
+
+#endif /* DXR_H */
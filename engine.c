@@ -0,0 +1,469 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "engine.h"
+#include "radix.h"
+#include "treebitmap.h"
+#include "lctrie.h"
+#include "sail.h"
+#include "dxr.h"
+
+/* -------------------------------------------
+ * trie (fib_tree, 16-ary)
+ * ------------------------------------------- */
+static void *
+_trie_build (struct rib_tree *rib_tree)
+{
+  struct fib_tree *t;
+
+  t = fib_new (NULL);
+  if (! t)
+    return NULL;
+  if (rebuild_fib_from_rib (rib_tree, t) != 0)
+    {
+      fib_free (t);
+      return NULL;
+    }
+  return t;
+}
+
+static void
+_trie_free (void *data)
+{
+  fib_free ((struct fib_tree *) data);
+}
+
+static int
+_trie_lookup (void *data, const uint8_t *key)
+{
+  return fib_route_lookup ((struct fib_tree *) data, key);
+}
+
+static void
+_trie_lookup_bulk (void *data, const uint8_t *const *keys, int *ids, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    ids[i] = fib_route_lookup ((struct fib_tree *) data, keys[i]);
+}
+
+struct _trie_count
+{
+  uint64_t nodes;
+  uint64_t leaves;
+};
+
+static int
+_trie_count_callback (fib_slot_t s, const uint8_t *key, int depth, void *arg)
+{
+  struct _trie_count *c = (struct _trie_count *) arg;
+
+  (void) key;
+  (void) depth;
+  if (FIB_SLOT_IS_LEAF (s))
+    c->leaves++;
+  else
+    c->nodes++;
+  return 0;
+}
+
+static uint64_t
+_trie_mem_size (void *data)
+{
+  struct _trie_count c = { 0, 0 };
+
+  fib_traverse ((struct fib_tree *) data, _trie_count_callback, &c);
+  return sizeof (struct fib_tree) + c.nodes * sizeof (struct fib_node);
+}
+
+static void
+_trie_print_stats (void *data)
+{
+  struct _trie_count c = { 0, 0 };
+
+  fib_traverse ((struct fib_tree *) data, _trie_count_callback, &c);
+  printf ("  nodes:      %" PRIu64 " internal, %" PRIu64 " leaf slots\n",
+          c.nodes, c.leaves);
+}
+
+static int
+_trie_update (void *data, struct rib_tree *rib_tree, const uint8_t *key,
+              int keylen)
+{
+  return update_fib_from_rib (rib_tree, (struct fib_tree *) data, key,
+                              keylen);
+}
+
+const struct fib_engine_ops fib_engine_trie = {
+  .name = "trie",
+  .ipv6 = 1,
+  .build = _trie_build,
+  .free = _trie_free,
+  .lookup = _trie_lookup,
+  .lookup_bulk = _trie_lookup_bulk,
+  .mem_size = _trie_mem_size,
+  .print_stats = _trie_print_stats,
+  .update = _trie_update,
+};
+
+/* -------------------------------------------
+ * Tree Bitmap
+ * ------------------------------------------- */
+static void *
+_tbm_build (struct rib_tree *rib_tree)
+{
+  struct tbm_tree *t;
+
+  t = tbm_new (NULL);
+  if (! t)
+    return NULL;
+  if (tbm_build (t, rib_tree) != 0)
+    {
+      tbm_free (t);
+      return NULL;
+    }
+  return t;
+}
+
+static void
+_tbm_free (void *data)
+{
+  tbm_free ((struct tbm_tree *) data);
+}
+
+static int
+_tbm_lookup (void *data, const uint8_t *key)
+{
+  return tbm_route_lookup ((struct tbm_tree *) data, key);
+}
+
+static void
+_tbm_lookup_bulk (void *data, const uint8_t *const *keys, int *ids, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    ids[i] = tbm_route_lookup ((struct tbm_tree *) data, keys[i]);
+}
+
+static uint64_t
+_tbm_mem_size (void *data)
+{
+  return tbm_mem_size ((struct tbm_tree *) data);
+}
+
+static void
+_tbm_print_stats (void *data)
+{
+  struct tbm_tree *t = (struct tbm_tree *) data;
+
+  printf ("  prefixes:   %" PRIu64 ", nodes %" PRIu64 " (stride %d)\n",
+          t->num_prefixes, t->num_nodes + 1, TBM_STRIDE);
+}
+
+static int
+_tbm_update (void *data, struct rib_tree *rib_tree, const uint8_t *key,
+             int keylen)
+{
+  return tbm_update_from_rib ((struct tbm_tree *) data, rib_tree, key,
+                              keylen);
+}
+
+const struct fib_engine_ops fib_engine_treebitmap = {
+  .name = "treebitmap",
+  .ipv6 = 1,
+  .build = _tbm_build,
+  .free = _tbm_free,
+  .lookup = _tbm_lookup,
+  .lookup_bulk = _tbm_lookup_bulk,
+  .mem_size = _tbm_mem_size,
+  .print_stats = _tbm_print_stats,
+  .update = _tbm_update,
+};
+
+/* -------------------------------------------
+ * LC-trie (IPv4, build only)
+ * ------------------------------------------- */
+static void *
+_lctrie_build (struct rib_tree *rib_tree)
+{
+  struct lctrie *t;
+
+  t = lctrie_new (NULL);
+  if (! t)
+    return NULL;
+  if (lctrie_build (t, rib_tree, LCTRIE_FILL_FACTOR) != 0)
+    {
+      lctrie_free (t);
+      return NULL;
+    }
+  return t;
+}
+
+static void
+_lctrie_free (void *data)
+{
+  lctrie_free ((struct lctrie *) data);
+}
+
+static int
+_lctrie_lookup (void *data, const uint8_t *key)
+{
+  return lctrie_lookup ((struct lctrie *) data, key);
+}
+
+static void
+_lctrie_lookup_bulk (void *data, const uint8_t *const *keys, int *ids, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    ids[i] = lctrie_lookup ((struct lctrie *) data, keys[i]);
+}
+
+static uint64_t
+_lctrie_mem_size (void *data)
+{
+  return lctrie_mem_size ((struct lctrie *) data);
+}
+
+static void
+_lctrie_print_stats (void *data)
+{
+  struct lctrie *t = (struct lctrie *) data;
+
+  printf ("  entries:    %u (base %u), nodes %u, max depth %d\n",
+          t->num_entries - 1, t->num_base, t->num_nodes, t->max_depth);
+}
+
+const struct fib_engine_ops fib_engine_lctrie = {
+  .name = "lctrie",
+  .build = _lctrie_build,
+  .free = _lctrie_free,
+  .lookup = _lctrie_lookup,
+  .lookup_bulk = _lctrie_lookup_bulk,
+  .mem_size = _lctrie_mem_size,
+  .print_stats = _lctrie_print_stats,
+};
+
+/* -------------------------------------------
+ * SAIL (IPv4, build only)
+ * ------------------------------------------- */
+static void *
+_sail_build (struct rib_tree *rib_tree)
+{
+  struct sail *t;
+
+  t = sail_new (NULL);
+  if (! t)
+    return NULL;
+  if (sail_build (t, rib_tree) != 0)
+    {
+      sail_free (t);
+      return NULL;
+    }
+  return t;
+}
+
+static void
+_sail_free (void *data)
+{
+  sail_free ((struct sail *) data);
+}
+
+static int
+_sail_lookup (void *data, const uint8_t *key)
+{
+  return sail_lookup ((struct sail *) data, key);
+}
+
+static void
+_sail_lookup_bulk (void *data, const uint8_t *const *keys, int *ids, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    ids[i] = sail_lookup ((struct sail *) data, keys[i]);
+}
+
+static uint64_t
+_sail_mem_size (void *data)
+{
+  return sail_mem_size ((struct sail *) data);
+}
+
+static void
+_sail_print_stats (void *data)
+{
+  struct sail *t = (struct sail *) data;
+
+  printf ("  prefixes:   %u, chunks: level 24 %u, level 32 %u\n",
+          t->num_prefixes, t->num_c24, t->num_c32);
+}
+
+const struct fib_engine_ops fib_engine_sail = {
+  .name = "sail",
+  .build = _sail_build,
+  .free = _sail_free,
+  .lookup = _sail_lookup,
+  .lookup_bulk = _sail_lookup_bulk,
+  .mem_size = _sail_mem_size,
+  .print_stats = _sail_print_stats,
+};
+
+/* -------------------------------------------
+ * DXR (IPv4, build only)
+ * ------------------------------------------- */
+static void *
+_dxr_build (struct rib_tree *rib_tree)
+{
+  struct dxr *t;
+
+  t = dxr_new (NULL);
+  if (! t)
+    return NULL;
+  if (dxr_build (t, rib_tree) != 0)
+    {
+      dxr_free (t);
+      return NULL;
+    }
+  return t;
+}
+
+static void
+_dxr_free (void *data)
+{
+  dxr_free ((struct dxr *) data);
+}
+
+static int
+_dxr_lookup (void *data, const uint8_t *key)
+{
+  return dxr_lookup ((struct dxr *) data, key);
+}
+
+static void
+_dxr_lookup_bulk (void *data, const uint8_t *const *keys, int *ids, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    ids[i] = dxr_lookup ((struct dxr *) data, keys[i]);
+}
+
+static uint64_t
+_dxr_mem_size (void *data)
+{
+  return dxr_mem_size ((struct dxr *) data);
+}
+
+static void
+_dxr_print_stats (void *data)
+{
+  struct dxr *t = (struct dxr *) data;
+
+  printf ("  intervals:  %u, range words %u, nexthops %u (direct %d bits)\n",
+          t->num_intervals, t->num_range, t->num_nh - 1, DXR_DIRECT_BITS);
+}
+
+const struct fib_engine_ops fib_engine_dxr = {
+  .name = "dxr",
+  .build = _dxr_build,
+  .free = _dxr_free,
+  .lookup = _dxr_lookup,
+  .lookup_bulk = _dxr_lookup_bulk,
+  .mem_size = _dxr_mem_size,
+  .print_stats = _dxr_print_stats,
+};
+
+/* -------------------------------------------
+ * engine
+ * ------------------------------------------- */
+const struct fib_engine_ops *const fib_engines[] = {
+  &fib_engine_trie, &fib_engine_treebitmap, &fib_engine_lctrie,
+  &fib_engine_sail, &fib_engine_dxr,        NULL,
+};
+
+const struct fib_engine_ops *
+fib_engine_find (const char *name)
+{
+  int i;
+
+  for (i = 0; fib_engines[i]; i++)
+    if (strcmp (fib_engines[i]->name, name) == 0)
+      return fib_engines[i];
+  return NULL;
+}
+
+int
+fib_engine_build (struct fib_engine *e, const struct fib_engine_ops *ops,
+                  struct rib_tree *rib_tree)
+{
+  memset (e, 0, sizeof (struct fib_engine));
+  if (rib_tree->family == AF_INET6 && ! ops->ipv6)
+    {
+      fprintf (stderr, "ERROR: engine %s supports IPv4 only\n", ops->name);
+      return -1;
+    }
+  e->data = ops->build (rib_tree);
+  if (! e->data)
+    {
+      fprintf (stderr, "ERROR: cannot build engine %s\n", ops->name);
+      return -1;
+    }
+  e->ops = ops;
+  e->family = rib_tree->family;
+  return 0;
+}
+
+/* use an existing FIB as a trie engine */
+void
+fib_engine_attach_trie (struct fib_engine *e, struct fib_tree *fib_tree)
+{
+  e->ops = &fib_engine_trie;
+  e->data = fib_tree;
+  e->family = fib_tree->family;
+  e->attached = 1;
+}
+
+void
+fib_engine_free (struct fib_engine *e)
+{
+  if (e->data && ! e->attached)
+    e->ops->free (e->data);
+  e->data = NULL;
+}
+
+/* engines without update are rebuilt from the RIB */
+int
+fib_engine_update (struct fib_engine *e, struct rib_tree *rib_tree,
+                   const uint8_t *key, int keylen)
+{
+  void *data;
+
+  if (e->ops->update)
+    return e->ops->update (e->data, rib_tree, key, keylen);
+
+  data = e->ops->build (rib_tree);
+  if (! data)
+    return -1;
+  if (! e->attached)
+    e->ops->free (e->data);
+  e->data = data;
+  e->attached = 0;
+  return 0;
+}
+
+void
+fib_engine_print_stats (struct fib_engine *e)
+{
+  printf ("============================================\n");
+  printf ("FIB engine: %s\n", e->ops->name);
+  printf ("  memory:     %" PRIu64 " bytes\n", e->ops->mem_size (e->data));
+  e->ops->print_stats (e->data);
+  printf ("============================================\n");
+}
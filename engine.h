@@ -0,0 +1,82 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdint.h>
+
+#include "fib.h"
+
+/*
+ * FIB engine: ルックアップ構造の共通インタフェース.
+ * 各エンジンはRIBから構築し, 宛先アドレスからnexthop id (経路なしは-1) を
+ * 返す. ベンチマークとルックアップのテストはエンジンを通して引くので,
+ * 構造によらず同じテストが動く.
+ * - update は任意. ないエンジン (一括構築のみ) は fib_engine_update で
+ *   作り直す.
+ * - lookup_bulk は keys[i] の結果を ids[i] に書く. 各エンジンが自分の
+ *   ルックアップをループで呼ぶので, 1回の間接呼び出しで n 個引ける.
+ */
+
+struct fib_engine_ops
+{
+  const char *name;
+  int ipv6; // also supports IPv6
+  void *(*build) (struct rib_tree *rib_tree); // NULL on failure
+  void (*free) (void *data);
+  int (*lookup) (void *data, const uint8_t *key);
+  void (*lookup_bulk) (void *data, const uint8_t *const *keys, int *ids,
+                       int n);
+  uint64_t (*mem_size) (void *data);
+  void (*print_stats) (void *data);
+  /* follow a prefix changed in the RIB, optional */
+  int (*update) (void *data, struct rib_tree *rib_tree, const uint8_t *key,
+                 int keylen);
+};
+
+struct fib_engine
+{
+  const struct fib_engine_ops *ops;
+  void *data;
+  int family;
+  int attached; // data is not owned by the engine (not freed)
+};
+
+extern const struct fib_engine_ops fib_engine_trie;
+extern const struct fib_engine_ops fib_engine_treebitmap;
+extern const struct fib_engine_ops fib_engine_lctrie;
+extern const struct fib_engine_ops fib_engine_sail;
+extern const struct fib_engine_ops fib_engine_dxr;
+
+/* all engines, terminated by NULL */
+extern const struct fib_engine_ops *const fib_engines[];
+
+const struct fib_engine_ops *fib_engine_find (const char *name);
+int fib_engine_build (struct fib_engine *e, const struct fib_engine_ops *ops,
+                      struct rib_tree *rib_tree);
+void fib_engine_attach_trie (struct fib_engine *e, struct fib_tree *fib_tree);
+void fib_engine_free (struct fib_engine *e);
+int fib_engine_update (struct fib_engine *e, struct rib_tree *rib_tree,
+                       const uint8_t *key, int keylen);
+void fib_engine_print_stats (struct fib_engine *e);
+
+/* the trie of a trie engine, NULL for the other engines */
+static inline struct fib_tree *
+fib_engine_fib (struct fib_engine *e)
+{
+  return e->ops == &fib_engine_trie ? (struct fib_tree *) e->data : NULL;
+}
+
+/* returns the nexthop id, or -1 if there is no route */
+static inline int
+fib_engine_lookup (struct fib_engine *e, const uint8_t *key)
+{
+  return e->ops->lookup (e->data, key);
+}
+
+static inline void
+fib_engine_lookup_bulk (struct fib_engine *e, const uint8_t *const *keys,
+                        int *ids, int n)
+{
+  e->ops->lookup_bulk (e->data, keys, ids, n);
+}
+
+#endif /* ENGINE_H */
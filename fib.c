@@ -6,6 +6,8 @@
 #include <sys/socket.h>
 
 #include "fib.h"
+#include "nexthop_group.h"
+#include "memstat.h"
 
 /* key: address, s: start bit, n: number of bits */
 
@@ -93,27 +95,81 @@ fib_new (struct fib_tree *t)
       t = malloc (sizeof (struct fib_tree));
       if (! t)
         return NULL;
+      mem_stat_alloc (MEM_FIB, sizeof (struct fib_tree));
     }
-  t->root = NULL;
+  t->root = 0;
   t->family = 0;
   t->table_id = 0;
+  t->compact = 0;
+  t->compacted = 0;
+  t->generation = 1;
   return t;
 }
 
-/* free FIB node */
-static void
+/*
+ * FIB操作は再帰せず, 明示的なスタックを使う.
+ * 1つの経路上のノード数はFIB_MAX_LEVEL以下なので, スタックサイズは固定.
+ */
+struct fib_frame
+{
+  struct fib_node *node;
+  int idx;   // next child to visit
+  int depth;
+};
+
+/*
+ * 葉はスロットに埋め込まれ, nexthop idの参照を1つ持つ.
+ * 葉のスロットを作る時に参照を取り, 捨てる時に解放する.
+ */
+static inline fib_slot_t
+_leaf_slot (int keylen, const int *route_idx)
+{
+  nhg_ref (route_idx[0]);
+  return FIB_LEAF_SLOT (route_idx[0], keylen);
+}
+
+static inline void
 _free_fib_node (struct fib_node *n)
 {
-  int i;
+  free (n);
+  mem_stat_free (MEM_FIB, sizeof (struct fib_node));
+}
 
-  if (n != NULL)
+/* free the subtrie of the slot, dropping the references of its leaves */
+static void
+_free_slot (fib_slot_t s)
+{
+  struct fib_frame stack[FIB_MAX_LEVEL];
+  fib_slot_t c;
+  int sp = 0;
+
+  if (! s)
+    return;
+  if (FIB_SLOT_IS_LEAF (s))
+    {
+      nhg_unref (FIB_SLOT_ID (s));
+      return;
+    }
+
+  stack[sp++] = (struct fib_frame){ FIB_SLOT_NODE (s), 0, 0 };
+  while (sp > 0)
     {
-      for (i = 0; i < BRANCH_SZ; i++)
+      struct fib_frame *f = &stack[sp - 1];
+
+      if (f->idx == BRANCH_SZ)
         {
-          if (n->child[i] != NULL)
-            _free_fib_node (n->child[i]);
+          _free_fib_node (f->node);
+          sp--;
+          continue;
         }
-      free (n);
+
+      c = f->node->child[f->idx++];
+      if (! c)
+        continue;
+      if (FIB_SLOT_IS_LEAF (c))
+        nhg_unref (FIB_SLOT_ID (c));
+      else
+        stack[sp++] = (struct fib_frame){ FIB_SLOT_NODE (c), 0, 0 };
     }
 }
 
@@ -122,279 +178,490 @@ fib_free (struct fib_tree *t)
 {
   if (t)
     {
-      _free_fib_node (t->root);
+      _free_slot (t->root);
       free (t);
+      mem_stat_free (MEM_FIB, sizeof (struct fib_tree));
     }
 }
 
-static inline int
-_count_nonzero (const int *arr, int len)
+static struct fib_node *
+_create_fib_node (void)
 {
-  int count = 0;
-  for (int i = 0; i < len; i++)
+  struct fib_node *n;
+
+  /* all slots empty */
+  n = calloc (1, sizeof (struct fib_node));
+  if (n)
+    mem_stat_alloc (MEM_FIB, sizeof (struct fib_node));
+  return n;
+}
+
+/* 葉のスロットを子ノードに展開し, 内部ノードにする */
+static int
+_expand_leaf (fib_slot_t *slot)
+{
+  struct fib_node *n;
+  int i;
+
+  n = _create_fib_node ();
+  if (! n)
+    return -1; // failed, not enough memory
+
+  for (i = 0; i < BRANCH_SZ; i++)
     {
-      if (arr[i] != -1)
-        count++;
+      nhg_ref (FIB_SLOT_ID (*slot));
+      n->child[i] = *slot;
     }
-  return count;
+  nhg_unref (FIB_SLOT_ID (*slot));
+  *slot = FIB_NODE_SLOT (n);
+  return 0;
 }
 
-static struct fib_node *
-_create_fib_node (void)
+/* 葉をより長いプレフィックスの場合に更新 */
+static inline void
+_update_leaf (fib_slot_t *slot, int keylen, const int *route_idx)
 {
-  struct fib_node *new;
-  int i;
+  fib_slot_t old = *slot;
 
-  new = malloc (sizeof (struct fib_node));
-  if (! new)
-    return NULL;
+  if (keylen > FIB_SLOT_KEYLEN (old))
+    {
+      *slot = _leaf_slot (keylen, route_idx);
+      nhg_unref (FIB_SLOT_ID (old));
+    }
+}
+
+/*
+ * プレフィックスがスロット全体を覆う場合:
+ * 空なら葉として登録, 葉なら更新, 内部ノードなら
+ * 全ての子孫の葉に新しいプレフィックスを伝播
+ */
+static void
+_fill (fib_slot_t *slot, int keylen, const int *route_idx)
+{
+  struct fib_frame stack[FIB_MAX_LEVEL];
+  fib_slot_t *cslot;
+  int sp = 0;
+
+  if (! *slot)
+    {
+      *slot = _leaf_slot (keylen, route_idx);
+      return;
+    }
+  if (FIB_SLOT_IS_LEAF (*slot))
+    {
+      _update_leaf (slot, keylen, route_idx);
+      return;
+    }
 
-  memset (new, 0, sizeof (struct fib_node));
+  stack[sp++] = (struct fib_frame){ FIB_SLOT_NODE (*slot), 0, 0 };
+  while (sp > 0)
+    {
+      struct fib_frame *f = &stack[sp - 1];
 
-  /* initialize route_idx to -1 to distinguish from valid index 0 */
-  for (i = 0; i < MAX_ECMP_ENTRY; i++)
-    new->route_idx[i] = -1;
+      if (f->idx == BRANCH_SZ)
+        {
+          sp--;
+          continue;
+        }
 
-  return new;
+      cslot = &f->node->child[f->idx++];
+      if (! *cslot)
+        *cslot = _leaf_slot (keylen, route_idx);
+      else if (FIB_SLOT_IS_LEAF (*cslot))
+        _update_leaf (cslot, keylen, route_idx);
+      else
+        stack[sp++] = (struct fib_frame){ FIB_SLOT_NODE (*cslot), 0, 0 };
+    }
 }
 
+/*
+ * make the slot an internal node (creating it, or expanding a leaf) and
+ * return the node. NULL: not enough memory
+ */
 static struct fib_node *
-_add (struct fib_node *n, const uint8_t *key, int keylen, int *route_idx,
-      int depth, int *success)
+_internal_node (fib_slot_t *slot)
 {
-  uint32_t i, bits_in_depth, first, count;
-  uint16_t index, base;
-  int exists = (n != NULL);
+  struct fib_node *n;
 
-  if (! exists)
+  if (! *slot)
     {
       n = _create_fib_node ();
       if (! n)
-        {
-          *success = -1; // failed, not enough memory
-          return n;
-        }
+        return NULL;
+      *slot = FIB_NODE_SLOT (n);
     }
+  else if (FIB_SLOT_IS_LEAF (*slot) && _expand_leaf (slot) != 0)
+    return NULL;
+  return FIB_SLOT_NODE (*slot);
+}
 
-  /* case1: 階層がプレフィックスに到達した場合 */
-  if (keylen <= depth)
+int
+fib_route_add (struct fib_tree *t, const uint8_t *key, int keylen,
+               int *route_idx)
+{
+  fib_slot_t *slot;
+  struct fib_node *n;
+  uint32_t i, bits_in_depth, first, count;
+  int depth;
+  uint8_t key_safe[17]; /* sentinel */
+  memset (key_safe, 0, sizeof (key_safe));
+  memcpy (key_safe, key, KEY_SIZE (keylen));
+  t->generation++;
+
+  slot = &t->root;
+  for (depth = 0;; depth += K)
     {
-      /* 葉ノードではない（=子ノードが存在する）かつ、
-       * 既にノードが存在する（=内部ノード）場合に
-       * 全ての子に新しいプレフィックスを伝播 */
-      if (! n->leaf && exists)
-        {
-          for (i = 0; i < BRANCH_SZ; i++)
-            n->child[i] =
-                _add (n->child[i], key, keylen, route_idx, depth + K, success);
-          return n;
-        }
-      /* 葉ノードの場合 */
-      else if (n->leaf)
+      /* case1: 階層がプレフィックスに到達した場合 */
+      if (keylen <= depth)
         {
-          /* より長いプレフィックスの場合に更新 */
-          if (keylen > n->keylen)
-            {
-              memset (n->key, 0, 16);
-              memcpy (n->key, key, KEY_SIZE (keylen));
-              n->keylen = keylen;
-              memcpy (n->route_idx, route_idx, sizeof (n->route_idx));
-              n->num_routes = _count_nonzero (route_idx, MAX_ECMP_ENTRY);
-            }
-          *success = 0;
-          return n;
+          _fill (slot, keylen, route_idx);
+          return 0;
         }
-      /* 新規葉ノードとして登録 */
-      else
+
+      /* 葉の場合はまず全子スロットに親のデータを展開 (パッチ1) */
+      n = _internal_node (slot);
+      if (! n)
+        return -1; // failed, not enough memory
+
+      /* case2: プレフィックスが次の階層の途中で終わる場合 */
+      if (keylen < depth + K)
         {
-          memset (n->key, 0, 16);
-          memcpy (n->key, key, KEY_SIZE (keylen));
-          n->leaf = 1;
-          n->keylen = keylen;
-          memcpy (n->route_idx, route_idx, sizeof (n->route_idx));
-          n->num_routes = _count_nonzero (route_idx, MAX_ECMP_ENTRY);
-          *success = 0;
-          return n;
+          /*
+           * - Example: K=2 (4-ary)
+           *   - 96.0.0.0/3 (0b011/3)
+           * ------------------------------------------
+           *    v depth=0
+           * root      v depth=2
+           *    |---- 01      v depth=4
+           *           |---- 00
+           *           |---- 01
+           *           |---- 10 <- new leaf: 96.0.0.0/3
+           *           |---- 11 <- new leaf: 96.0.0.0/3
+           * ------------------------------------------
+           * - keylen=3. depth=2 (3 < 2 + 2)
+           *   - bits_in_depth: 3 - 2 = 1 (0b01|1*)
+           *                                    ^
+           *   - base = 0b01|10
+           *               ^x1 = 1
+           *   - first = 1 << (2 - 1) = 0b010 = 2
+           *   - count = 1 << (2 - 1) = 0b010 = 2
+           *   - range: child[2] to child[3]
+           */
+          /* 新しいプレフィックスが登録される子スロットの範囲を計算 */
+          bits_in_depth = keylen - depth; // この階層で決定されるビット数（1〜K-1）
+          first = BIT_INDEX (key_safe, depth, bits_in_depth)
+                  << (K - bits_in_depth); // 範囲の開始インデックス
+          count = 1 << (K - bits_in_depth); // 範囲のサイズ
+
+          /* この範囲には新しい葉を登録 */
+          for (i = first; i < first + count; i++)
+            _fill (&n->child[i], keylen, route_idx);
+          return 0;
         }
+
+      /* case3: さらに深い階層へ */
+      slot = &n->child[BIT_INDEX (key_safe, depth, K)];
     }
+}
 
-  /* case2: プレフィックスが次の階層の途中で終わる場合, もしくは葉ノードの場合
-   */
-  if (keylen < depth + K /* || n->leaf */)
+static int
+_has_children (struct fib_node *n)
+{
+  int i;
+
+  for (i = 0; i < BRANCH_SZ; i++)
+    if (n->child[i])
+      return 1;
+  return 0;
+}
+
+/*
+ * プレフィックスの範囲全体を1つの経路 (route_idx == NULL なら経路なし)
+ * で置き換える. 範囲内のより長いプレフィックスは破棄される.
+ */
+int
+fib_route_replace (struct fib_tree *t, const uint8_t *key, int keylen,
+                   int *route_idx)
+{
+  fib_slot_t *path[FIB_MAX_LEVEL];
+  fib_slot_t *slot;
+  struct fib_node *n;
+  uint32_t i, bits_in_depth, first, count;
+  int depth, npath = 0, success = 0;
+  uint8_t key_safe[17]; /* sentinel */
+  memset (key_safe, 0, sizeof (key_safe));
+  memcpy (key_safe, key, KEY_SIZE (keylen));
+  t->generation++;
+
+  slot = &t->root;
+  for (depth = 0;; depth += K)
     {
-      /*
-       * - Example: K=2 (4-ary)
-       *   - 96.0.0.0/3 (0b011/3)
-       * ------------------------------------------
-       *    v depth=0
-       * root      v depth=2
-       *    |---- 01      v depth=4
-       *           |---- 00
-       *           |---- 01
-       *           |---- 10 <- new node: 96.0.0.0/3
-       *           |---- 11 <- new node: 96.0.0.0/3
-       * ------------------------------------------
-       * - keylen=3. depth=2 (3 < 2 + 2)
-       *   - bits_in_depth: 3 - 2 = 1 (0b01|1*)
-       *                                    ^
-       *   - base = 0b01|10
-       *               ^x1 = 1
-       *   - first = 1 << (2 - 1) = 0b010 = 2
-       *   - count = 1 << (2 - 1) = 0b010 = 2
-       *   - range: child[2] to child[3]
-       */
-      /* 新しいプレフィックスが登録される子ノードの範囲を計算 */
-      bits_in_depth = keylen - depth; // この階層で決定されるビット数（1〜K-1）
-      base = BIT_INDEX (key, depth, bits_in_depth);
-      first = base << (K - bits_in_depth); // 範囲の開始インデックス
-      count = 1 << (K - bits_in_depth);    // 範囲のサイズ
-
-      /* 全ての子ノードに対して */
-      for (i = 0; i < BRANCH_SZ; i++)
+      /* case1: スロット全体が範囲に含まれる */
+      if (keylen <= depth)
         {
-          if (i >= first && i < first + count)
-            {
-              /* この範囲には新しいノードを登録 */
-              n->child[i] = _add (n->child[i], key, keylen, route_idx,
-                                  depth + K, success);
-            }
-          else if (n->leaf)
+          _free_slot (*slot);
+          *slot = route_idx ? _leaf_slot (keylen, route_idx) : 0;
+          break;
+        }
+
+      if (! *slot && ! route_idx)
+        break; // nothing to clear
+
+      /* 範囲を覆う葉は子スロットに展開してから置き換える */
+      n = _internal_node (slot);
+      if (! n)
+        {
+          success = -1; // failed, not enough memory
+          break;
+        }
+      path[npath++] = slot;
+
+      /* case2: プレフィックスが次の階層の途中で終わる場合 */
+      if (keylen < depth + K)
+        {
+          bits_in_depth = keylen - depth;
+          first = BIT_INDEX (key_safe, depth, bits_in_depth)
+                  << (K - bits_in_depth);
+          count = 1 << (K - bits_in_depth);
+          for (i = first; i < first + count; i++)
             {
-              /* 範囲外には親ノードのデータをコピー */
-              n->child[i] = _add (n->child[i], n->key, n->keylen, n->route_idx,
-                                  depth + K, success);
+              _free_slot (n->child[i]);
+              n->child[i] = route_idx ? _leaf_slot (keylen, route_idx) : 0;
             }
+          break;
         }
-      /* 現在のノードはもはや葉ノードではない */
-      n->leaf = 0;
-      n->keylen = 0;
-      for (i = 0; i < MAX_ECMP_ENTRY; i++)
-        n->route_idx[i] = -1;
-      *success = 0;
-      return n;
+
+      /* case3: さらに深い階層へ */
+      slot = &n->child[BIT_INDEX (key_safe, depth, K)];
     }
 
-  /* 葉ノードの場合, かつkeylenが子ノードよりも大きい場合 (パッチ1) */
-  if (n->leaf)
+  /* 子がなくなった内部ノードを下から削除 */
+  while (npath > 0)
     {
-      /* まず全子ノードに親のデータを展開 */
-      for (i = 0; i < BRANCH_SZ; i++)
-        n->child[i] = _add (n->child[i], n->key, n->keylen, n->route_idx,
-                            depth + K, success);
-      /* indexに該当する子ノードのみcase3に遷移（新しいルートで更新） */
-      index = BIT_INDEX (key, depth, K);
-      n->child[index] =
-          _add (n->child[index], key, keylen, route_idx, depth + K, success);
-      /* 現在のノードはもはや葉ノードではない */
-      n->leaf = 0;
-      n->keylen = 0;
-      for (i = 0; i < MAX_ECMP_ENTRY; i++)
-        n->route_idx[i] = -1;
-      *success = 0;
-      return n;
+      slot = path[--npath];
+      if (_has_children (FIB_SLOT_NODE (*slot)))
+        break;
+      _free_fib_node (FIB_SLOT_NODE (*slot));
+      *slot = 0;
     }
-
-  /* case3: さらに深い階層へ再帰 */
-  index = BIT_INDEX (key, depth, K);
-  n->child[index] =
-      _add (n->child[index], key, keylen, route_idx, depth + K, success);
-  return n;
+  return success;
 }
 
-int
-fib_route_add (struct fib_tree *t, const uint8_t *key, int keylen,
-               int *route_idx)
+/* 全ての子が同じ経路の葉であれば, 1つの葉に畳み込む */
+static void
+_fold (fib_slot_t *slot, uint64_t *removed)
 {
-  int success = 0;
-  uint8_t key_safe[17]; /* sentinel */
-  memcpy (key_safe, key, 16);
-  key_safe[16] = 0;
-  t->root = _add (t->root, key_safe, keylen, route_idx, 0, &success);
-  return success; /* error(-1) if root is NULL */
+  struct fib_node *n = FIB_SLOT_NODE (*slot);
+  fib_slot_t c;
+  int i, rep = 0;
+
+  for (i = 0; i < BRANCH_SZ; i++)
+    {
+      c = n->child[i];
+      if (! c || ! FIB_SLOT_IS_LEAF (c)
+          || FIB_SLOT_ID (c) != FIB_SLOT_ID (n->child[0]))
+        return;
+      /* keep the least specific prefix as the representative */
+      if (FIB_SLOT_KEYLEN (c) < FIB_SLOT_KEYLEN (n->child[rep]))
+        rep = i;
+    }
+
+  /* the representative moves up with its reference */
+  *slot = n->child[rep];
+  for (i = 0; i < BRANCH_SZ; i++)
+    if (i != rep)
+      nhg_unref (FIB_SLOT_ID (n->child[i]));
+  _free_fib_node (n);
+  (*removed)++;
 }
 
-/* it is unnecessary as it will be recreated from the RIB */
-#if 0
-static int
-_shrink (struct rib_node *n) {}
+/* compact the subtrie bottom-up (post-order) */
+static void
+_compact (fib_slot_t *slot, uint64_t *removed)
+{
+  struct fib_frame stack[FIB_MAX_LEVEL];
+  fib_slot_t c;
+  int sp = 0;
 
-static struct rib_node *
-_delete (struct rib_node *n, uint8_t *key, int keylen, int depth) {}
+  if (! *slot || FIB_SLOT_IS_LEAF (*slot))
+    return;
 
-int
-rib_route_delete4 (struct rib_tree *t, uint8_t *key, int keylen) {}
-#endif
+  stack[sp++] = (struct fib_frame){ FIB_SLOT_NODE (*slot), 0, 0 };
+  while (sp > 0)
+    {
+      struct fib_frame *f = &stack[sp - 1];
 
-#if 0
-static struct fib_node *
-_lookup (struct fib_node *n, struct fib_node *cand, const uint8_t *key,
-         int depth)
+      if (f->idx == BRANCH_SZ)
+        {
+          /* the slot of the node: the parent's last visited child */
+          sp--;
+          _fold (sp > 0 ? &stack[sp - 1].node->child[stack[sp - 1].idx - 1]
+                        : slot,
+                 removed);
+          continue;
+        }
+
+      c = f->node->child[f->idx++];
+      if (c && ! FIB_SLOT_IS_LEAF (c))
+        stack[sp++] = (struct fib_frame){ FIB_SLOT_NODE (c), 0, 0 };
+    }
+}
+
+uint64_t
+fib_compact (struct fib_tree *t)
 {
-  uint16_t index;
+  uint64_t removed = 0;
 
-  if (! n)
-    return cand;
+  t->generation++;
+  _compact (&t->root, &removed);
+  t->compact = 1;
+  t->compacted += removed;
+  return removed;
+}
+
+/* compact the range of a prefix and fold its ancestors bottom-up */
+uint64_t
+fib_compact_prefix (struct fib_tree *t, const uint8_t *key, int keylen)
+{
+  fib_slot_t *path[FIB_MAX_LEVEL];
+  fib_slot_t *slot;
+  struct fib_node *n;
+  uint32_t i, bits_in_depth, first, count;
+  uint64_t removed = 0;
+  int depth, npath = 0;
+  uint8_t key_safe[17]; /* sentinel */
+  memset (key_safe, 0, sizeof (key_safe));
+  memcpy (key_safe, key, KEY_SIZE (keylen));
+  t->generation++;
+
+  slot = &t->root;
+  for (depth = 0; *slot && ! FIB_SLOT_IS_LEAF (*slot); depth += K)
+    {
+      if (keylen <= depth)
+        {
+          _compact (slot, &removed);
+          break;
+        }
 
-  if (n->leaf)
-    cand = n;
+      n = FIB_SLOT_NODE (*slot);
+      path[npath++] = slot;
+      if (keylen < depth + K)
+        {
+          bits_in_depth = keylen - depth;
+          first = BIT_INDEX (key_safe, depth, bits_in_depth)
+                  << (K - bits_in_depth);
+          count = 1 << (K - bits_in_depth);
+          for (i = first; i < first + count; i++)
+            _compact (&n->child[i], &removed);
+          break;
+        }
+      slot = &n->child[BIT_INDEX (key_safe, depth, K)];
+    }
 
-  index = BIT_INDEX (key, depth, K);
+  while (npath > 0)
+    {
+      slot = path[--npath];
+      if (FIB_SLOT_IS_LEAF (*slot))
+        break; // folded already
+      _fold (slot, &removed);
+    }
 
-  return _lookup (n->child[index], cand, key, depth + K);
+  t->compacted += removed;
+  return removed;
 }
-#endif
 
-#if 1
-static inline struct fib_node *
-_lookup (struct fib_node *n, struct fib_node *cand, const uint8_t *key,
-         int depth)
+/*
+ * 葉はスロットに埋め込まれているので, 葉に到達した時点でnexthop idが
+ * 得られる (葉ノードのロードが不要).
+ */
+static inline int
+_lookup (fib_slot_t s, const uint8_t *key)
 {
-  uint16_t index;
+  int depth = 0;
 
-  while (n)
+  while (s && ! FIB_SLOT_IS_LEAF (s))
     {
-      if (n->leaf)
-        cand = n;
-
-      index = BIT_INDEX (key, depth, K);
-      n = n->child[index];
+      s = FIB_SLOT_NODE (s)->child[BIT_INDEX (key, depth, K)];
       depth += K;
     }
-  return cand;
+  return s ? FIB_SLOT_ID (s) : -1;
 }
-#endif
 
-struct fib_node *
+int
 fib_route_lookup (struct fib_tree *t, const uint8_t *key)
 {
   uint8_t key_safe[17]; /* sentinel */
-  memcpy (key_safe, key, 16);
-  key_safe[16] = 0;
-  return _lookup (t->root, NULL, key_safe, 0);
+  int len = (t->family == AF_INET6) ? 16 : 4;
+
+  memcpy (key_safe, key, len);
+  key_safe[len] = 0;
+  return _lookup (t->root, key_safe);
+}
+
+/* lookup and pick one member of the nexthop group by the flow hash */
+int
+fib_route_lookup_flow (struct fib_tree *t, const uint8_t *key, uint32_t hash)
+{
+  int id;
+
+  id = fib_route_lookup (t, key);
+  return id >= 0 ? nhg_select (id, hash) : -1;
+}
+
+/* set n bits of the key at bit position s */
+static inline void
+_set_bits (uint8_t *key, int s, int n, uint32_t v)
+{
+  int i, bit;
+
+  for (i = 0; i < n; i++)
+    {
+      bit = s + i;
+      if (v & (1 << (n - 1 - i)))
+        key[bit >> 3] |= 0x80 >> (bit & 7);
+      else
+        key[bit >> 3] &= ~(0x80 >> (bit & 7));
+    }
 }
 
 /* traverse FIB tree depth-first in-order */
 static int
-_traverse (struct fib_node *n, fib_traverse_callback callback, void *arg,
-           int depth)
+_traverse (fib_slot_t s, fib_traverse_callback callback, void *arg)
 {
-  int i;
+  struct fib_frame stack[FIB_MAX_LEVEL];
+  uint8_t key[17];
+  fib_slot_t c;
+  int sp = 0, depth;
 
-  if (! n)
+  memset (key, 0, sizeof (key));
+
+  /* process current slot (both leaf and internal node for counting) */
+  if (callback (s, key, 0, arg) != 0)
+    return -1;
+  if (FIB_SLOT_IS_LEAF (s))
     return 0;
 
-  /* process current node (both leaf and non-leaf for counting) */
-  if (callback)
+  stack[sp++] = (struct fib_frame){ FIB_SLOT_NODE (s), 0, 0 };
+  while (sp > 0)
     {
-      if (callback (n, arg) != 0)
-        return -1;
-    }
+      struct fib_frame *f = &stack[sp - 1];
 
-  /* process children in order */
-  for (i = 0; i < BRANCH_SZ; i++)
-    {
-      if (_traverse (n->child[i], callback, arg, depth + K) != 0)
+      if (f->idx == BRANCH_SZ)
+        {
+          sp--;
+          continue;
+        }
+
+      /* process children in order */
+      c = f->node->child[f->idx++];
+      if (! c)
+        continue;
+      depth = f->depth + K;
+      _set_bits (key, f->depth, K, f->idx - 1);
+      if (callback (c, key, depth, arg) != 0)
         return -1;
+      if (! FIB_SLOT_IS_LEAF (c))
+        stack[sp++] = (struct fib_frame){ FIB_SLOT_NODE (c), 0, depth };
     }
 
   return 0;
@@ -405,5 +672,5 @@ fib_traverse (struct fib_tree *t, fib_traverse_callback callback, void *arg)
 {
   if (! t || ! t->root || ! callback)
     return 0;
-  return _traverse (t->root, callback, arg, 0);
+  return _traverse (t->root, callback, arg);
 }
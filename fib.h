@@ -3,54 +3,125 @@
 
 #include <stdint.h>
 
-#define ROUTE_TABLE_SIZE        1048576 // 2^20
-#define ROUTE_TABLE_HASH_MASK   0xFFFFF
-#define MAX_ECMP_ENTRY          1
-#define ROUTE_TREE_SIZE         2 // IPv4 and IPv6
+#define MAX_ECMP_ENTRY          1 // multipath uses a nexthop group id
 #define K                       4
 #define BRANCH_SZ               (1 << K)
+#define FIB_MAX_LEVEL           (128 / K + 2)
 
 #define KEY_SIZE(len) (((len) + 7) / 8)
 
+/* nexthop entry: nexthop is 4 bytes for IPv4, 16 bytes for IPv6 */
 struct route_entry
 {
-  int family;
-  int ref_count;
-  uint32_t oif; // output interface index
-  uint8_t nexthop[16];
+  int ref_count; // 0: free
+  uint32_t oif;  // output interface index
+  uint8_t nexthop[];
+};
+
+/* entries of one family, allocated in chunks so that they never move */
+struct route_pool
+{
+  uint8_t **chunks;
+  int num_chunks;
+  int entry_size;
+  int num_used;   // entries ever allocated
+  int *free_list; // released entries
+  int num_free;
+  int free_size;
+};
+
+struct route_slot
+{
+  uint32_t hash;
+  int idx; // -1: empty
 };
 
+/* nexthop table: Robin Hood hash index over per-family entry pools */
+struct route_table
+{
+  struct route_slot *slots;
+  uint32_t capacity; // power of 2
+  uint32_t count;
+  int hash_type; // enum route_hash_type, 0: chosen at the first entry
+  struct route_pool pool[2]; // IPv4, IPv6
+};
+
+/*
+ * child slot of the FIB: 0 (no route), a pointer to an internal node, or
+ * a leaf encoded in the slot itself (tag bit 0 set): the nexthop id in the
+ * upper 32 bits and the prefix length in bits 1-8. leaves are not
+ * allocated, and a lookup ends with the nexthop id in hand.
+ */
+typedef uint64_t fib_slot_t;
+
+#define FIB_SLOT_IS_LEAF(s)   ((s) & 1)
+#define FIB_SLOT_NODE(s)      ((struct fib_node *) (uintptr_t) (s))
+#define FIB_SLOT_ID(s)        ((int) ((s) >> 32))
+#define FIB_SLOT_KEYLEN(s)    ((int) (((s) >> 1) & 0xff))
+#define FIB_NODE_SLOT(n)      ((fib_slot_t) (uintptr_t) (n))
+#define FIB_LEAF_SLOT(id, keylen)                                             \
+  (((fib_slot_t) (uint32_t) (id) << 32) | ((fib_slot_t) (keylen) << 1) | 1)
+
+/* internal node */
 struct fib_node
 {
-  int leaf; // 0: non-leaf, 1: leaf
-  uint8_t key[16];
-  int keylen;
-  int num_routes;
-  int route_idx[MAX_ECMP_ENTRY];
-  struct fib_node *child[BRANCH_SZ];
+  fib_slot_t child[BRANCH_SZ];
 };
 struct fib_tree
 {
   int family;
   int table_id;
-  struct fib_node *root;
+  int compact;          // fold uniform subtries after updates
+  uint64_t compacted;   // number of nodes removed by compaction
+  uint64_t generation;  // bumped on every change, see flow_cache.h
+  fib_slot_t root;
+};
+
+/* route sources */
+enum rib_source
+{
+  RIB_SOURCE_CONNECTED,
+  RIB_SOURCE_STATIC,
+  RIB_SOURCE_IGP,
+  RIB_SOURCE_BGP,
+  RIB_SOURCE_MAX
+};
+
+/* candidate route of a prefix, identified by (source, peer) */
+struct rib_path
+{
+  struct rib_path *next;
+  int source;       // enum rib_source
+  uint32_t peer;    // e.g. BGP peer address, 0 for local sources
+  int distance;     // administrative distance, lower is preferred
+  uint32_t metric;  // compared when the distance is equal
+  int route_idx;
 };
 
 struct rib_node
 {
-  int valid;
-  uint8_t key[16];
+  struct rib_node *left;
+  struct rib_node *right;
+  int valid; // 0: branching node
   int keylen;
+  /* selected (best) nexthop id, pushed to the FIB */
   int num_routes;
   int route_idx[MAX_ECMP_ENTRY];
-  struct rib_node *left;
-  struct rib_node *right;
+  struct rib_path *paths; // candidates, best first
+  uint8_t key[]; // KEY_SIZE(keylen) bytes
 };
 struct rib_tree
 {
   int family;
   int table_id;
+  uint64_t num_prefixes;
+  uint64_t num_paths;
+  uint64_t num_nodes;
+  uint64_t mem_size; // bytes
   struct rib_node *root;
+  /* nodes and paths of rib_bulk_load, freed with the tree */
+  uint8_t *bulk;
+  size_t bulk_size;
 };
 
 struct fib_tree *fib_new (struct fib_tree *t);
@@ -59,9 +130,30 @@ void fib_free (struct fib_tree *t);
 /* IPv4/v6 */
 int fib_route_add (struct fib_tree *t, const uint8_t *key, int keylen,
                     int *route_idx);
-struct fib_node *fib_route_lookup (struct fib_tree *t, const uint8_t *key);
+int fib_route_replace (struct fib_tree *t, const uint8_t *key, int keylen,
+                       int *route_idx);
+/* returns the nexthop id, or -1 if there is no route */
+int fib_route_lookup (struct fib_tree *t, const uint8_t *key);
+int fib_route_lookup_flow (struct fib_tree *t, const uint8_t *key,
+                           uint32_t hash);
+
+/*
+ * compaction: fold subtries whose leaves all carry the same routes into a
+ * single leaf. after compaction, leaves no longer tell the exact prefix,
+ * so the tree must be changed with fib_route_replace (update_fib_from_rib)
+ * instead of fib_route_add.
+ */
+uint64_t fib_compact (struct fib_tree *t);
+uint64_t fib_compact_prefix (struct fib_tree *t, const uint8_t *key,
+                             int keylen);
 
-typedef int (*fib_traverse_callback) (struct fib_node *n, void *arg);
+/*
+ * called for every non-empty slot (internal nodes before their children).
+ * depth: bit position of the slot (multiple of K), key: the address bits
+ * leading to the slot (only the first depth bits are meaningful)
+ */
+typedef int (*fib_traverse_callback) (fib_slot_t s, const uint8_t *key,
+                                      int depth, void *arg);
 int fib_traverse (struct fib_tree *t, fib_traverse_callback callback,
                   void *arg);
 
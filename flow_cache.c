@@ -0,0 +1,71 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flow_cache.h"
+
+/* num_entries is rounded up to a power of 2 (at least 2 sets) */
+int
+flow_cache_init (struct flow_cache *c, int family, uint32_t num_entries)
+{
+  uint32_t num_sets = 2;
+
+  while (num_sets * FLOW_CACHE_WAYS < num_entries && num_sets < (1U << 24))
+    num_sets <<= 1;
+
+  memset (c, 0, sizeof (struct flow_cache));
+  c->sets = aligned_alloc (64, num_sets * sizeof (struct flow_cache_set));
+  if (! c->sets)
+    {
+      fprintf (stderr, "ERROR: cannot allocate flow cache (%u sets)\n",
+               num_sets);
+      return -1;
+    }
+  memset (c->sets, 0, num_sets * sizeof (struct flow_cache_set));
+  c->num_sets = num_sets;
+  c->shift = 32 - __builtin_ctz (num_sets);
+  c->family = family;
+  return 0;
+}
+
+void
+flow_cache_free (struct flow_cache *c)
+{
+  free (c->sets);
+  memset (c, 0, sizeof (struct flow_cache));
+}
+
+void
+flow_cache_clear_stats (struct flow_cache *c)
+{
+  c->hits = 0;
+  c->misses = 0;
+}
+
+double
+flow_cache_hit_rate (const struct flow_cache *c)
+{
+  uint64_t total = c->hits + c->misses;
+
+  return total ? (double) c->hits / total : 0.0;
+}
+
+/* miss: walk the FIB and insert the result at way 0 of the set */
+int
+flow_cache_fill (struct flow_cache *c, struct flow_cache_set *set,
+                 struct fib_tree *t, const uint8_t *key, const uint64_t *k)
+{
+  int id;
+
+  c->misses++;
+  id = fib_route_lookup (t, key);
+
+  memmove (&set->way[1], &set->way[0],
+           (FLOW_CACHE_WAYS - 1) * sizeof (struct flow_cache_entry));
+  set->way[0].key[0] = k[0];
+  set->way[0].key[1] = k[1];
+  set->way[0].generation = t->generation;
+  set->way[0].id = id;
+  return id;
+}
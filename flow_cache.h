@@ -0,0 +1,91 @@
+#ifndef FLOW_CACHE_H
+#define FLOW_CACHE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "fib.h"
+
+/*
+ * Destination flow cache.
+ * 宛先アドレス -> FIBの検索結果 (nexthop id, 経路なしの-1も含む) の完全一致キャッシュ.
+ * スレッドごとに1つ持ち, FIBの検索の前に引く. ロックは持たない.
+ * - set-associative: FLOW_CACHE_WAYS-way, 1セットは2キャッシュライン.
+ *   セット内はFIFOで置き換える (新しいエントリをway 0に入れる).
+ * - 各エントリは登録時のfib_tree->generationを持ち, FIBが変更されると
+ *   (generationが進むと) 一致しなくなる. 古い結果を返すことはない.
+ */
+
+#define FLOW_CACHE_WAYS            4
+#define FLOW_CACHE_DEFAULT_ENTRIES 4096
+
+struct flow_cache_entry
+{
+  uint64_t key[2];       // destination address, IPv4 uses key[0] only
+  uint64_t generation;   // 0: empty
+  int id;                // result of fib_route_lookup
+};
+
+struct flow_cache_set
+{
+  struct flow_cache_entry way[FLOW_CACHE_WAYS];
+} __attribute__ ((aligned (64)));
+
+struct flow_cache
+{
+  struct flow_cache_set *sets;
+  uint32_t num_sets; // power of 2
+  int shift;         // 32 - log2(num_sets)
+  int family;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+int flow_cache_init (struct flow_cache *c, int family, uint32_t num_entries);
+void flow_cache_free (struct flow_cache *c);
+void flow_cache_clear_stats (struct flow_cache *c);
+double flow_cache_hit_rate (const struct flow_cache *c);
+int flow_cache_fill (struct flow_cache *c, struct flow_cache_set *set,
+                     struct fib_tree *t, const uint8_t *key,
+                     const uint64_t *k);
+
+static inline int
+flow_cache_lookup (struct flow_cache *c, struct fib_tree *t,
+                   const uint8_t *key)
+{
+  struct flow_cache_set *set;
+  uint64_t k[2];
+  uint32_t a, h;
+  int w;
+
+  if (c->family == AF_INET6)
+    {
+      memcpy (&k[0], key, 8);
+      memcpy (&k[1], key + 8, 8);
+    }
+  else
+    {
+      /* a 4-byte load, not a partial store into k (store forwarding) */
+      memcpy (&a, key, 4);
+      k[0] = a;
+      k[1] = 0;
+    }
+
+  /* multiplicative hash, the high bits select the set */
+  h = (uint32_t) ((k[0] ^ k[1] ^ (k[1] >> 32)) * 0x9e3779b97f4a7c15ULL
+                  >> 32);
+  set = &c->sets[h >> c->shift];
+
+  for (w = 0; w < FLOW_CACHE_WAYS; w++)
+    if (set->way[w].generation == t->generation && set->way[w].key[0] == k[0]
+        && set->way[w].key[1] == k[1])
+      {
+        c->hits++;
+        return set->way[w].id;
+      }
+
+  return flow_cache_fill (c, set, t, key, k);
+}
+
+#endif /* FLOW_CACHE_H */
@@ -0,0 +1,346 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "lctrie.h"
+#include "radix.h"
+#include "nexthop_group.h"
+
+struct lctrie *
+lctrie_new (struct lctrie *t)
+{
+  if (! t)
+    {
+      t = malloc (sizeof (struct lctrie));
+      if (! t)
+        return NULL;
+    }
+  memset (t, 0, sizeof (struct lctrie));
+  t->fill_factor = LCTRIE_FILL_FACTOR;
+  return t;
+}
+
+static void
+_clear (struct lctrie *t)
+{
+  uint32_t i;
+
+  for (i = 1; i < t->num_entries; i++)
+    nhg_unref (t->entries[i].id);
+  free (t->entries);
+  free (t->trie);
+  t->entries = NULL;
+  t->trie = NULL;
+  t->num_entries = 0;
+  t->num_nodes = 0;
+}
+
+void
+lctrie_free (struct lctrie *t)
+{
+  if (t)
+    {
+      _clear (t);
+      free (t);
+    }
+}
+
+uint64_t
+lctrie_mem_size (const struct lctrie *t)
+{
+  return sizeof (struct lctrie) + (uint64_t) t->num_nodes * sizeof (uint32_t)
+         + (uint64_t) t->num_entries * sizeof (struct lctrie_entry);
+}
+
+static inline uint32_t
+_netmask (int len)
+{
+  return len ? 0xffffffffU << (32 - len) : 0;
+}
+
+/*
+ * RIBのpre-order (キー順, 短いプレフィックスが先) でエントリを集める.
+ * 祖先のスタックから各エントリのpreを決める.
+ */
+struct _collect_arg
+{
+  struct lctrie *t;
+  uint32_t size;
+  uint32_t stack[33];
+  int sp;
+};
+
+static int
+_collect (struct rib_node *n, void *arg)
+{
+  struct _collect_arg *c = (struct _collect_arg *) arg;
+  struct lctrie *t = c->t;
+  struct lctrie_entry *e;
+  uint32_t key;
+
+  if (t->num_entries == c->size)
+    {
+      c->size *= 2;
+      e = realloc (t->entries, c->size * sizeof (struct lctrie_entry));
+      if (! e)
+        return -1;
+      t->entries = e;
+    }
+
+  key = 0;
+  memcpy (&key, n->key, KEY_SIZE (n->keylen));
+  e = &t->entries[t->num_entries];
+  e->mask = _netmask (n->keylen);
+  e->key = ntohl (key) & e->mask;
+  e->id = n->route_idx[0];
+  nhg_ref (e->id);
+
+  /* pop the ancestors that do not contain this prefix */
+  while (c->sp > 0
+         && ((e->key ^ t->entries[c->stack[c->sp - 1]].key)
+             & t->entries[c->stack[c->sp - 1]].mask))
+    c->sp--;
+  e->pre = c->sp > 0 ? (int) c->stack[c->sp - 1] : 0;
+  c->stack[c->sp++] = t->num_entries++;
+  return 0;
+}
+
+/* per-node state of the breadth-first build */
+struct _task
+{
+  uint32_t first; // first base entry (for an empty child: left neighbour)
+  uint32_t n;     // number of base entries
+  int pos;        // first bit not decided by the ancestors
+  int bits;       // bits consumed by the branches of the ancestors
+  int depth;
+};
+
+struct _build
+{
+  struct lctrie *t;
+  uint32_t *base; // entry index of base prefixes, in key order
+  struct _task *task;
+  uint32_t size;  // capacity of trie and task
+};
+
+#define BASE_KEY(b, i) ((b)->t->entries[(b)->base[i]].key)
+
+static int
+_grow (struct _build *b, uint32_t count)
+{
+  uint32_t *trie;
+  struct _task *task;
+  uint32_t size = b->size;
+
+  while (b->t->num_nodes + count > size)
+    size *= 2;
+  if (size == b->size)
+    return 0;
+
+  trie = realloc (b->t->trie, size * sizeof (uint32_t));
+  if (! trie)
+    return -1;
+  b->t->trie = trie;
+  task = realloc (b->task, size * sizeof (struct _task));
+  if (! task)
+    return -1;
+  b->task = task;
+  b->size = size;
+  return 0;
+}
+
+/* number of non-empty children if the node branches on bits [c, c+branch) */
+static uint32_t
+_count_patterns (struct _build *b, uint32_t first, uint32_t n, int c,
+                 int branch)
+{
+  uint32_t i, p, prev = 0, count = 0;
+
+  for (i = first; i < first + n; i++)
+    {
+      p = BASE_KEY (b, i) << c >> (32 - branch);
+      if (count == 0 || p != prev)
+        count++;
+      prev = p;
+    }
+  return count;
+}
+
+/* the longest prefix in the chain of e that covers the pattern pstr/pmask */
+static uint32_t
+_cover (struct lctrie *t, uint32_t e, uint32_t pstr, uint32_t pmask)
+{
+  for (; e != 0; e = t->entries[e].pre)
+    if ((t->entries[e].mask & ~pmask) == 0
+        && ((pstr ^ t->entries[e].key) & t->entries[e].mask) == 0)
+      return e;
+  return 0;
+}
+
+static int
+_build_node (struct _build *b, uint32_t idx)
+{
+  struct lctrie *t = b->t;
+  struct _task task = b->task[idx];
+  uint32_t k0, p, k, adr, num, left, right, l, r, pstr, pmask;
+  int c, branch, min_branch;
+
+  /* path compression: skip the bits shared by all base prefixes */
+  k0 = BASE_KEY (b, task.first);
+  c = __builtin_clz (k0 ^ BASE_KEY (b, task.first + task.n - 1));
+
+  /* level compression: widest branch that keeps the children filled */
+  branch = 1;
+  while (branch < LCTRIE_MAX_BRANCH && c + branch < 32
+         && _count_patterns (b, task.first, task.n, c, branch + 1)
+                >= t->fill_factor * (1U << (branch + 1)))
+    branch++;
+  if (idx == 0)
+    {
+      min_branch = 31 - __builtin_clz (task.n);
+      if (min_branch > LCTRIE_ROOT_BRANCH)
+        min_branch = LCTRIE_ROOT_BRANCH;
+      if (min_branch > 32 - c)
+        min_branch = 32 - c;
+      if (branch < min_branch)
+        branch = min_branch;
+    }
+
+  num = 1U << branch;
+  adr = t->num_nodes;
+  if (adr + num - 1 > LCTRIE_MAX_ADR || _grow (b, num) != 0)
+    return -1;
+  t->num_nodes += num;
+  t->trie[idx] = LCTRIE_NODE (branch, c - task.pos, adr);
+  t->num_internal++;
+  t->branches[branch]++;
+
+  /* distribute the base prefixes to the children */
+  k = task.first;
+  left = 0;
+  for (p = 0; p < num; p++)
+    {
+      struct _task *child = &b->task[adr + p];
+
+      child->first = k;
+      while (k < task.first + task.n
+             && (BASE_KEY (b, k) << c >> (32 - branch)) == p)
+        k++;
+      child->n = k - child->first;
+      child->pos = c + branch;
+      child->bits = task.bits + branch;
+      child->depth = task.depth + 1;
+
+      if (child->n == 0)
+        child->first = left; // resolved below
+      else
+        left = b->base[k - 1];
+      if (child->n == 1)
+        t->trie[adr + p] = LCTRIE_NODE (0, 0, b->base[child->first]);
+    }
+
+  /*
+   * 空の子は左右の最も近い空でない子のエントリのpreを辿り, 子の範囲全体を
+   * 覆う最長のプレフィックスを葉にする (なければ番兵).
+   */
+  pmask = _netmask (c + branch);
+  right = 0;
+  for (p = num; p-- > 0;)
+    {
+      struct _task *child = &b->task[adr + p];
+
+      if (child->n != 0)
+        {
+          right = b->base[child->first];
+          continue;
+        }
+      pstr = (k0 & _netmask (c)) | (p << (32 - c - branch));
+      l = _cover (t, child->first, pstr, pmask);
+      r = _cover (t, right, pstr, pmask);
+      if (l == 0 || (t->entries[r].mask & ~t->entries[l].mask))
+        l = r;
+      t->trie[adr + p] = LCTRIE_NODE (0, 0, l);
+      t->num_empty++;
+    }
+  return 0;
+}
+
+int
+lctrie_build (struct lctrie *t, struct rib_tree *rib_tree,
+              double fill_factor)
+{
+  struct _collect_arg c;
+  struct _build b;
+  uint32_t i;
+
+  if (rib_tree->family == AF_INET6)
+    {
+      fprintf (stderr, "ERROR: LC-trie supports IPv4 only\n");
+      return -1;
+    }
+
+  _clear (t);
+  memset (t, 0, sizeof (struct lctrie));
+  t->fill_factor = fill_factor;
+
+  /* entries (entry 0: sentinel) */
+  memset (&c, 0, sizeof (c));
+  c.t = t;
+  c.size = 1024;
+  t->entries = malloc (c.size * sizeof (struct lctrie_entry));
+  if (! t->entries)
+    return -1;
+  t->entries[0] = (struct lctrie_entry){ 0, 0, -1, 0 };
+  t->num_entries = 1;
+  if (rib_traverse (rib_tree, _collect, &c) != 0)
+    {
+      fprintf (stderr, "ERROR: cannot allocate LC-trie entries\n");
+      _clear (t);
+      return -1;
+    }
+
+  /* base: not followed by one of its more specifics */
+  memset (&b, 0, sizeof (b));
+  b.t = t;
+  b.base = malloc (t->num_entries * sizeof (uint32_t));
+  b.size = 1024;
+  t->trie = malloc (b.size * sizeof (uint32_t));
+  b.task = malloc (b.size * sizeof (struct _task));
+  if (! b.base || ! t->trie || ! b.task)
+    goto fail;
+  for (i = 1; i < t->num_entries; i++)
+    if (i + 1 == t->num_entries || t->entries[i + 1].pre != (int) i)
+      b.base[t->num_base++] = i;
+
+  /* breadth-first: the children of a node are allocated consecutively */
+  t->num_nodes = 1;
+  b.task[0] = (struct _task){ 0, t->num_base, 0, 0, 0 };
+  t->trie[0] = LCTRIE_NODE (0, 0, t->num_base == 1 ? b.base[0] : 0);
+  for (i = 0; i < t->num_nodes; i++)
+    {
+      if (b.task[i].n >= 2)
+        {
+          if (_build_node (&b, i) != 0)
+            goto fail;
+          continue;
+        }
+      /* leaf */
+      if (b.task[i].depth > t->max_depth)
+        t->max_depth = b.task[i].depth;
+      t->avg_depth += b.task[i].depth * ldexp (1.0, -b.task[i].bits);
+    }
+
+  free (b.base);
+  free (b.task);
+  return 0;
+
+fail:
+  fprintf (stderr, "ERROR: cannot build LC-trie (%u nodes)\n", t->num_nodes);
+  free (b.base);
+  free (b.task);
+  _clear (t);
+  return -1;
+}
@@ -0,0 +1,91 @@
+#ifndef LCTRIE_H
+#define LCTRIE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "fib.h"
+
+/*
+ * LC-trie (level- and path-compressed trie, Nilsson & Karlsson). IPv4 only.
+ * RIBから一括で構築し, 更新はできない (RIBが変わったら作り直す).
+ * - プレフィックスは他のプレフィックスを含まない "base" と, 含む "prefix"
+ *   に分ける. trieはbaseのみから作り, 各エントリは自身を含む最長の
+ *   プレフィックスへのpreを持つ. 葉に着いたらpreを辿って一致を確認する.
+ * - path compression: 全てのbaseが共有するビットは読み飛ばす (skip).
+ * - level compression: 各ノードの分岐数 2^branch は, 空でない子の割合が
+ *   fill factor 以上となる最大のものを選ぶ (密な所は広く, 疎な所は狭く).
+ * - ノードは32ビット: branch (5) | skip (5) | adr (22).
+ *   内部ノードのadrは子の先頭 (2^branch個連続), 葉のadrはエントリ番号.
+ */
+
+#define LCTRIE_FILL_FACTOR 0.5
+#define LCTRIE_ROOT_BRANCH 16 // the root is at least min(16, log2(base))
+#define LCTRIE_MAX_BRANCH  20
+
+#define LCTRIE_BRANCH(n) ((n) >> 27)
+#define LCTRIE_SKIP(n)   (((n) >> 22) & 0x1f)
+#define LCTRIE_ADR(n)    ((n) & 0x3fffff)
+#define LCTRIE_NODE(branch, skip, adr)                                        \
+  (((uint32_t) (branch) << 27) | ((uint32_t) (skip) << 22) | (uint32_t) (adr))
+#define LCTRIE_MAX_ADR   0x3fffff
+
+/* entry 0 is a sentinel: matches any address, no route */
+struct lctrie_entry
+{
+  uint32_t key;  // host order
+  uint32_t mask; // netmask of the prefix length
+  int id;        // nexthop id
+  int pre;       // longest enclosing prefix, 0: none
+};
+
+struct lctrie
+{
+  uint32_t *trie;
+  uint32_t num_nodes;
+  struct lctrie_entry *entries;
+  uint32_t num_entries; // including the sentinel
+  uint32_t num_base;
+  double fill_factor;
+  /* statistics */
+  uint32_t num_internal;
+  uint32_t num_empty;  // leaves of empty children
+  int max_depth;
+  double avg_depth;    // address-weighted
+  uint64_t branches[LCTRIE_MAX_BRANCH + 1]; // internal nodes by branch
+};
+
+struct lctrie *lctrie_new (struct lctrie *t);
+void lctrie_free (struct lctrie *t);
+int lctrie_build (struct lctrie *t, struct rib_tree *rib_tree,
+                  double fill_factor);
+uint64_t lctrie_mem_size (const struct lctrie *t);
+
+/* returns the nexthop id, or -1 if there is no route */
+static inline int
+lctrie_lookup (const struct lctrie *t, const uint8_t *key)
+{
+  const struct lctrie_entry *e;
+  uint32_t a, node;
+  int pos, branch;
+
+  memcpy (&a, key, 4);
+  a = ntohl (a);
+
+  node = t->trie[0];
+  pos = LCTRIE_SKIP (node);
+  while ((branch = LCTRIE_BRANCH (node)) != 0)
+    {
+      node = t->trie[LCTRIE_ADR (node) + (a << pos >> (32 - branch))];
+      pos += branch + LCTRIE_SKIP (node);
+    }
+
+  /* the sentinel ends every chain */
+  for (e = &t->entries[LCTRIE_ADR (node)]; (a ^ e->key) & e->mask;
+       e = &t->entries[e->pre])
+    ;
+  return e->id;
+}
+
+#endif /* LCTRIE_H */
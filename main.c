@@ -1,23 +1,67 @@
 #include <arpa/inet.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "test.h"
 #include "radix.h"
 #include "fib.h"
+#include "route_entry.h"
+#include "vrf.h"
+#include "flow_cache.h"
+#include "engine.h"
+#include "memstat.h"
+#include "nexthop_group.h"
 
-struct route_entry route_table[ROUTE_TABLE_SIZE];
+struct route_table route_table;
 
 static void
 usage (const char *prog)
 {
   fprintf (stderr,
-           "usage: %s <route_file> [(lookup_file|all)]\n"
+           "usage: %s [-6] [-a] [-b] [-c] [-D] [-f] [-H] [-l] [-L] [-m] [-s] [-S] [-j stats_file] "
+           "[-T table_id] [-z alpha [-C entries]] [-u update_file [-t threads]] "
+           "[--engine name] <route_file> "
+           "[(lookup_file|all)]\n"
+           "  -6                  : IPv6 routes\n"
+           "  -a                  : aggregate the RIB (ORTC) before building "
+           "the FIB\n"
+           "  -b                  : also keep a Tree Bitmap next to the FIB, "
+           "verify it and compare lookups and update latency\n"
+           "  -c                  : fold uniform subtries of the FIB after "
+           "build and updates\n"
+           "  -D                  : also build a DXR range table from the "
+           "RIB, verify it and compare it with the FIB\n"
+           "  -f                  : pick an ECMP member by the flow hash in "
+           "the performance test\n"
+           "  -H                  : benchmark the nexthop hash functions on "
+           "the nexthops of route_file and exit\n"
+           "  -l                  : also build an LC-trie from the RIB, verify "
+           "it and compare it with the FIB\n"
+           "  -L                  : also bulk-load the prefixes of the RIB "
+           "and compare it with adding them one by one\n"
+           "  -m                  : report the memory and allocations of "
+           "the RIB, FIB, ptree and route table, and the peak RSS\n"
+           "  -s                  : show detailed FIB statistics\n"
+           "  -S                  : also build a SAIL (levels 16/24/32) from "
+           "the RIB, verify it and compare it with the FIB\n"
+           "  -j stats_file       : also write FIB statistics as JSON\n"
+           "  -T table_id         : routing table to test (default: 0)\n"
+           "  -z alpha            : Zipf-skewed destinations in the "
+           "performance test, with and without the flow cache\n"
+           "  -C entries          : flow cache size (default: %d)\n"
+           "  -u update_file      : replay announce/withdraw updates before "
+           "the test\n"
+           "  -t threads          : lookup threads during the replay "
+           "(default: 1)\n"
+           "  --engine name       : lookup structure of the tests: trie "
+           "(default), treebitmap, lctrie, sail, dxr\n"
            "  <route_file>        : prefixes & nexthops input\n"
            "  [(lookup_file|all)] : run lookups test; if omitted, run "
            "performance test\n",
-           prog);
+           prog, FLOW_CACHE_DEFAULT_ENTRIES);
 }
 
 int
@@ -26,10 +70,31 @@ main (int argc, const char *const argv[])
   int ret, family;
   const char *route_file = NULL;
   const char *lookup_file = NULL;
+  const char *update_file = NULL;
+  const char *stats_file = NULL;
+  int show_stats = 0;
+  int aggregate = 0;
+  int compact = 0;
+  int flow = 0;
+  int hash_bench = 0;
+  int lctrie = 0;
+  int sail = 0;
+  int dxr = 0;
+  int mem_report = 0;
+  int bulk_load = 0;
+  int treebitmap = 0;
+  int nthreads = 1;
+  int table_id = 0;
+  double zipf = 0.0;
+  int cache_entries = FLOW_CACHE_DEFAULT_ENTRIES;
+  const struct fib_engine_ops *engine_ops = &fib_engine_trie;
+  struct fib_engine engine;
   int arg_idx = 1;
 
   struct rib_tree *rib_tree = NULL;
+  struct rib_tree *aggr_tree = NULL;
   struct fib_tree *fib_tree = NULL;
+  struct tbm_tree *tbm = NULL;
   struct ptree *ptree = NULL;
 
   /* parse arguments */
@@ -39,14 +104,74 @@ main (int argc, const char *const argv[])
       return -1;
     }
 
-  /* -6 option (optional) */
-  if (arg_idx < argc && strcmp (argv[arg_idx], "-6") == 0)
+  /* options (optional) */
+  family = AF_INET;
+  while (arg_idx < argc && argv[arg_idx][0] == '-')
     {
-      family = AF_INET6;
+      if (strcmp (argv[arg_idx], "-6") == 0)
+        family = AF_INET6;
+      else if (strcmp (argv[arg_idx], "-a") == 0)
+        aggregate = 1;
+      else if (strcmp (argv[arg_idx], "-b") == 0)
+        treebitmap = 1;
+      else if (strcmp (argv[arg_idx], "-c") == 0)
+        compact = 1;
+      else if (strcmp (argv[arg_idx], "-f") == 0)
+        flow = 1;
+      else if (strcmp (argv[arg_idx], "-H") == 0)
+        hash_bench = 1;
+      else if (strcmp (argv[arg_idx], "-l") == 0)
+        lctrie = 1;
+      else if (strcmp (argv[arg_idx], "-S") == 0)
+        sail = 1;
+      else if (strcmp (argv[arg_idx], "-D") == 0)
+        dxr = 1;
+      else if (strcmp (argv[arg_idx], "-L") == 0)
+        bulk_load = 1;
+      else if (strcmp (argv[arg_idx], "-m") == 0)
+        mem_report = 1;
+      else if (strcmp (argv[arg_idx], "-s") == 0)
+        show_stats = 1;
+      else if (strcmp (argv[arg_idx], "-j") == 0 && arg_idx + 1 < argc)
+        {
+          stats_file = argv[++arg_idx];
+          show_stats = 1;
+        }
+      else if (strcmp (argv[arg_idx], "-T") == 0 && arg_idx + 1 < argc)
+        table_id = atoi (argv[++arg_idx]);
+      else if (strcmp (argv[arg_idx], "-z") == 0 && arg_idx + 1 < argc)
+        zipf = atof (argv[++arg_idx]);
+      else if (strcmp (argv[arg_idx], "-C") == 0 && arg_idx + 1 < argc)
+        cache_entries = atoi (argv[++arg_idx]);
+      else if (strcmp (argv[arg_idx], "-u") == 0 && arg_idx + 1 < argc)
+        update_file = argv[++arg_idx];
+      else if (strcmp (argv[arg_idx], "-t") == 0 && arg_idx + 1 < argc)
+        nthreads = atoi (argv[++arg_idx]);
+      else if (strcmp (argv[arg_idx], "--engine") == 0 && arg_idx + 1 < argc)
+        {
+          engine_ops = fib_engine_find (argv[++arg_idx]);
+          if (! engine_ops)
+            {
+              fprintf (stderr, "ERROR: unknown engine %s\n", argv[arg_idx]);
+              usage (argv[0]);
+              return -1;
+            }
+        }
+      else
+        {
+          fprintf (stderr, "ERROR: unknown option %s\n", argv[arg_idx]);
+          usage (argv[0]);
+          return -1;
+        }
       arg_idx++;
     }
-  else
-    family = AF_INET;
+  if (nthreads < 0)
+    nthreads = 0;
+  if (table_id < 0)
+    {
+      fprintf (stderr, "ERROR: invalid table id %d\n", table_id);
+      return -1;
+    }
 
   /* route file (required) */
   if (arg_idx >= argc)
@@ -65,81 +190,273 @@ main (int argc, const char *const argv[])
       arg_idx++;
     }
 
+  if (hash_bench)
+    return test_hash_benchmark (route_file, family);
+
   /* show configuration */
   fprintf (stdout, "configuration:\n");
   fprintf (stdout, "  IP version: %s\n", family == AF_INET ? "IPv4" : "IPv6");
   fprintf (stdout, "  route file: %s\n", route_file);
+  if (table_id != 0)
+    fprintf (stdout, "  table: %d\n", table_id);
+  fprintf (stdout, "  engine: %s\n", engine_ops->name);
+  if (aggregate)
+    fprintf (stdout, "  aggregation: ORTC\n");
+  if (compact)
+    fprintf (stdout, "  compaction: on\n");
+  if (lctrie)
+    fprintf (stdout, "  LC-trie: on\n");
+  if (sail)
+    fprintf (stdout, "  SAIL: on\n");
+  if (dxr)
+    fprintf (stdout, "  DXR: on\n");
+  if (treebitmap)
+    fprintf (stdout, "  Tree Bitmap: on\n");
+  if (update_file)
+    fprintf (stdout, "  update file: %s (%d lookup threads)\n", update_file,
+             nthreads);
   if (lookup_file)
     fprintf (stdout, "  lookup file: %s\n", lookup_file);
+  else if (zipf > 0.0)
+    fprintf (stdout, "  mode: performance test (Zipf %.2f, flow cache %d)\n",
+             zipf, cache_entries);
   else
-    fprintf (stdout, "  mode: performance test\n");
+    fprintf (stdout, "  mode: performance test%s\n",
+             flow ? " (flow-hash)" : "");
   fprintf (stdout, "\n");
 
   /* load routes */
-  if (test_load_routes (route_file, family, &rib_tree, &ptree) != 0)
+  if (test_load_routes (route_file, family, table_id, &rib_tree, &ptree) != 0)
     {
       fprintf (stderr, "failed to load routes from %s\n", route_file);
-      if (rib_tree)
-        rib_free (rib_tree);
+      vrf_free_all ();
       if (ptree)
         ptree_delete (ptree);
       return -1;
     }
 
+  /* bulk load comparison (optional) */
+  if (bulk_load && test_rib_bulk_load (rib_tree) != 0)
+    {
+      fprintf (stderr, "RIB bulk load test failed\n");
+      vrf_free_all ();
+      ptree_delete (ptree);
+      return -1;
+    }
+
+  /* aggregate RIB (optional) */
+  if (aggregate)
+    {
+      aggr_tree = rib_new (NULL);
+      if (! aggr_tree || test_aggregate (rib_tree, aggr_tree, family) != 0)
+        {
+          fprintf (stderr, "failed to aggregate RIB\n");
+          if (aggr_tree)
+            rib_free (aggr_tree);
+          vrf_free_all ();
+          ptree_delete (ptree);
+          return -1;
+        }
+    }
+
   /* build FIB from RIB */
   fib_tree = fib_new (fib_tree);
-  if (rebuild_fib_from_rib (rib_tree, fib_tree) != 0)
+  if (rebuild_fib_from_rib (aggr_tree ? aggr_tree : rib_tree, fib_tree) != 0)
     {
       fprintf (stderr, "failed to build FIB from RIB\n");
       fib_free (fib_tree);
-      rib_free (rib_tree);
+      if (aggr_tree)
+        rib_free (aggr_tree);
+      vrf_free_all ();
       ptree_delete (ptree);
       return -1;
     }
+  vrf_lookup (family, table_id)->fib = fib_tree;
+
+  /* the other routing tables */
+  if (vrf_count () > 1)
+    {
+      if (vrf_build_fibs () != 0)
+        {
+          fprintf (stderr, "failed to build FIBs of the routing tables\n");
+          if (aggr_tree)
+            rib_free (aggr_tree);
+          vrf_free_all ();
+          ptree_delete (ptree);
+          return -1;
+        }
+      vrf_print_stats ();
+    }
+
+  /* fold uniform subtries (optional) */
+  if (compact)
+    fprintf (stdout, "FIB compaction: %" PRIu64 " nodes removed\n",
+             fib_compact (fib_tree));
 
   /* show FIB node statistics */
-  test_count_fib_nodes (fib_tree);
+  if (show_stats)
+    test_fib_stats (fib_tree, aggr_tree ? aggr_tree : rib_tree,
+                    update_file ? NULL : stats_file);
+  else
+    test_count_fib_nodes (fib_tree);
+
+  /* LC-trie comparison (optional) */
+  if (lctrie
+      && test_lctrie (aggr_tree ? aggr_tree : rib_tree, fib_tree, ptree,
+                      family)
+             != 0)
+    {
+      fprintf (stderr, "LC-trie test failed\n");
+      if (aggr_tree)
+        rib_free (aggr_tree);
+      vrf_free_all ();
+      ptree_delete (ptree);
+      return -1;
+    }
+
+  /* SAIL comparison (optional) */
+  if (sail
+      && test_sail (aggr_tree ? aggr_tree : rib_tree, fib_tree, ptree, family)
+             != 0)
+    {
+      fprintf (stderr, "SAIL test failed\n");
+      if (aggr_tree)
+        rib_free (aggr_tree);
+      vrf_free_all ();
+      ptree_delete (ptree);
+      return -1;
+    }
+
+  /* DXR comparison (optional) */
+  if (dxr
+      && test_dxr (aggr_tree ? aggr_tree : rib_tree, fib_tree, ptree, family)
+             != 0)
+    {
+      fprintf (stderr, "DXR test failed\n");
+      if (aggr_tree)
+        rib_free (aggr_tree);
+      vrf_free_all ();
+      ptree_delete (ptree);
+      return -1;
+    }
+
+  /* Tree Bitmap next to the FIB, follows the updates (optional) */
+  if (treebitmap)
+    {
+      tbm = tbm_new (NULL);
+      if (! tbm || tbm_build (tbm, rib_tree) != 0
+          || test_treebitmap (tbm, rib_tree, fib_tree, ptree, family) != 0)
+        {
+          fprintf (stderr, "Tree Bitmap test failed\n");
+          tbm_free (tbm);
+          if (aggr_tree)
+            rib_free (aggr_tree);
+          vrf_free_all ();
+          ptree_delete (ptree);
+          return -1;
+        }
+    }
+
+  /* replay updates (optional) */
+  if (update_file)
+    {
+      fprintf (stdout, "running update replay...\n");
+      if (test_update_replay (rib_tree, fib_tree, tbm, ptree, update_file,
+                              family, nthreads)
+              != 0
+          || (tbm
+              && test_treebitmap (tbm, rib_tree, fib_tree, ptree, family)
+                     != 0))
+        {
+          fprintf (stderr, "update replay failed\n");
+          tbm_free (tbm);
+          if (aggr_tree)
+            rib_free (aggr_tree);
+          vrf_free_all ();
+          ptree_delete (ptree);
+          return -1;
+        }
+      if (show_stats)
+        test_fib_stats (fib_tree, rib_tree, stats_file);
+      else
+        test_count_fib_nodes (fib_tree);
+    }
+  tbm_free (tbm);
+
+  /* lookup engine of the tests: the FIB itself, or built from the RIB */
+  if (engine_ops == &fib_engine_trie)
+    fib_engine_attach_trie (&engine, fib_tree);
+  else
+    {
+      if (fib_engine_build (&engine, engine_ops,
+                            aggr_tree && ! update_file ? aggr_tree : rib_tree)
+          != 0)
+        {
+          fprintf (stderr, "failed to build engine %s\n", engine_ops->name);
+          if (aggr_tree)
+            rib_free (aggr_tree);
+          vrf_free_all ();
+          ptree_delete (ptree);
+          return -1;
+        }
+      fib_engine_print_stats (&engine);
+    }
+
+  /* memory of the built tables (optional) */
+  if (mem_report)
+    mem_stat_print (rib_tree->num_prefixes);
 
   /* run tests */
   if (! lookup_file)
     {
       /* performance test */
       fprintf (stdout, "running performance test...\n");
-      ret = test_performance (fib_tree, family);
+      if (zipf > 0.0)
+        ret = test_performance_skewed (&engine, family, zipf,
+                                       cache_entries > 0 ? cache_entries
+                                                         : 1);
+      else
+        ret = test_performance (&engine, family, flow);
     }
   else if (strcmp (lookup_file, "all") == 0)
     {
       /*  full inspection lookup test */
       fprintf (stdout, "full inspection lookup test ...\n");
-      ret = test_lookup_all (fib_tree, ptree, family);
+      ret = test_lookup_all (&engine, ptree, family);
     }
   else
     {
       /* basic lookup test */
       fprintf (stdout, "running basic test with lookup file %s...\n",
                lookup_file);
-      ret = test_lookup (fib_tree, lookup_file, family);
+      ret = test_lookup (&engine, lookup_file, family);
     }
 
+  fib_engine_free (&engine);
   if (ret < 0)
     {
       fprintf (stderr, "test failed\n");
-      if (fib_tree)
-        fib_free (fib_tree);
-      if (rib_tree)
-        rib_free (rib_tree);
+      if (aggr_tree)
+        rib_free (aggr_tree);
+      vrf_free_all ();
       if (ptree)
         ptree_delete (ptree);
       return -1;
     }
 
   /* cleanup */
-  if (fib_tree)
-    fib_free (fib_tree);
-  if (rib_tree)
-    rib_free (rib_tree);
+  if (aggr_tree)
+    rib_free (aggr_tree);
+  vrf_free_all ();
   if (ptree)
     ptree_delete (ptree);
+  nhg_table_free ();
+  route_table_free (&route_table);
+
+  /* everything accounted must be back */
+  if (mem_report)
+    fprintf (stdout, "memory after cleanup: %" PRIu64 " bytes live\n",
+             mem_stat_live_total ());
 
   return 0;
 }
\ No newline at end of file
@@ -3,6 +3,6 @@
 
 #include "fib.h"
 
-extern struct route_entry route_table[ROUTE_TABLE_SIZE];
+extern struct route_table route_table;
 
 #endif
@@ -0,0 +1,78 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/resource.h>
+
+#include "memstat.h"
+
+struct mem_stat mem_stats[MEM_SUBSYS_MAX];
+
+static const char *const _subsys_name[MEM_SUBSYS_MAX] = {
+  "rib", "fib", "ptree", "route_table",
+};
+
+const char *
+mem_subsys_name (int sub)
+{
+  if (sub < 0 || sub >= MEM_SUBSYS_MAX)
+    return "unknown";
+  return _subsys_name[sub];
+}
+
+uint64_t
+mem_stat_live_total (void)
+{
+  uint64_t total = 0;
+  int i;
+
+  for (i = 0; i < MEM_SUBSYS_MAX; i++)
+    total += mem_stats[i].live;
+  return total;
+}
+
+uint64_t
+mem_stat_peak_rss (void)
+{
+  struct rusage ru;
+
+  if (getrusage (RUSAGE_SELF, &ru) != 0)
+    return 0;
+  return (uint64_t) ru.ru_maxrss * 1024; // kilobytes on Linux
+}
+
+void
+mem_stat_print (uint64_t num_prefixes)
+{
+  struct mem_stat *s;
+  uint64_t live = 0, peak = 0, allocs = 0, frees = 0;
+  int i;
+
+  printf ("============================================\n");
+  printf ("memory accounting:\n");
+  printf ("  %-12s %14s %14s %12s %12s", "subsystem", "live bytes",
+          "peak bytes", "allocs", "frees");
+  if (num_prefixes)
+    printf (" %10s", "B/prefix");
+  printf ("\n");
+  for (i = 0; i < MEM_SUBSYS_MAX; i++)
+    {
+      s = &mem_stats[i];
+      printf ("  %-12s %14" PRIu64 " %14" PRIu64 " %12" PRIu64
+              " %12" PRIu64,
+              _subsys_name[i], s->live, s->peak, s->allocs, s->frees);
+      if (num_prefixes)
+        printf (" %10.1f", (double) s->live / num_prefixes);
+      printf ("\n");
+      live += s->live;
+      peak += s->peak;
+      allocs += s->allocs;
+      frees += s->frees;
+    }
+  /* the peaks of the subsystems need not coincide: the sum is an upper bound */
+  printf ("  %-12s %14" PRIu64 " %14" PRIu64 " %12" PRIu64 " %12" PRIu64,
+          "total", live, peak, allocs, frees);
+  if (num_prefixes)
+    printf (" %10.1f", (double) live / num_prefixes);
+  printf ("\n");
+  printf ("  peak RSS:    %" PRIu64 " bytes\n", mem_stat_peak_rss ());
+  printf ("============================================\n");
+}
@@ -0,0 +1,70 @@
+#ifndef MEMSTAT_H
+#define MEMSTAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * メモリの使用量とアロケーションの計数 (サブシステムごと).
+ * 各サブシステムは malloc/free の横で確保・解放したバイト数を申告する.
+ * free にはサイズがないので, 解放する側がサイズを計算して渡す.
+ * 1つのサブシステムの更新 (確保・解放) は1スレッドからのみ行う前提で
+ * ロックしない (経路の読み込みではRIBとptreeが別のスレッド).
+ */
+
+enum mem_subsys
+{
+  MEM_RIB = 0,
+  MEM_FIB,
+  MEM_PTREE,
+  MEM_ROUTE_TABLE,
+  MEM_SUBSYS_MAX
+};
+
+struct mem_stat
+{
+  uint64_t live;   // bytes
+  uint64_t peak;   // bytes
+  uint64_t allocs;
+  uint64_t frees;
+};
+
+extern struct mem_stat mem_stats[MEM_SUBSYS_MAX];
+
+static inline void
+mem_stat_alloc (int sub, size_t size)
+{
+  struct mem_stat *s = &mem_stats[sub];
+
+  s->live += size;
+  if (s->live > s->peak)
+    s->peak = s->live;
+  s->allocs++;
+}
+
+static inline void
+mem_stat_free (int sub, size_t size)
+{
+  struct mem_stat *s = &mem_stats[sub];
+
+  s->live -= size;
+  s->frees++;
+}
+
+/* a successful realloc counts as a free of the old block and a new one */
+static inline void
+mem_stat_realloc (int sub, size_t old_size, size_t new_size)
+{
+  if (old_size)
+    mem_stat_free (sub, old_size);
+  mem_stat_alloc (sub, new_size);
+}
+
+const char *mem_subsys_name (int sub);
+uint64_t mem_stat_live_total (void);
+uint64_t mem_stat_peak_rss (void); // bytes, 0 if unknown
+
+/* num_prefixes > 0 adds the live bytes per prefix */
+void mem_stat_print (uint64_t num_prefixes);
+
+#endif /* MEMSTAT_H */
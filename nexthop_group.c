@@ -0,0 +1,392 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "nexthop_group.h"
+#include "route_entry.h"
+#include "main.h"
+#include "memstat.h"
+
+/*
+ * Resilient hashing:
+ * メンバが変わった時, 削除されたメンバのバケットと, 新しい均等割り当て
+ * を超えた分のバケットのみを再割り当てする. それ以外のフローの経路は
+ * 変わらない.
+ */
+
+/*
+ * グループはRIBの経路選択 (RIBのスレッド) でのみ作成されるので,
+ * 表と索引のメモリはRIBとして数える.
+ */
+struct nexthop_group **nhg_chunks = NULL;
+static int _num_chunks = 0;
+
+static int *_hash_head = NULL; // slot + 1, 0: end of the chain
+static int _hash_size = 0;     // power of 2
+static int _free_head = -1;  // list of released slots
+static int _next_unused = 0; // slots never used
+static int _num_groups = 0;
+
+static int
+_member_index (const int *members, int num_members, int route_idx)
+{
+  int i;
+
+  for (i = 0; i < num_members; i++)
+    if (members[i] == route_idx)
+      return i;
+  return -1;
+}
+
+static int
+_check_members (const int *members, int num_members)
+{
+  int i;
+
+  if (num_members < 1 || num_members > NHG_MAX_MEMBERS)
+    return -1;
+  for (i = 0; i < num_members; i++)
+    if (members[i] < 0 || NHG_IS_GROUP (members[i])
+        || _member_index (members, i, members[i]) >= 0)
+      return -1; // invalid or duplicate member
+  return 0;
+}
+
+static inline uint32_t
+_rotl32 (uint32_t x, int r)
+{
+  return (x << r) | (x >> (32 - r));
+}
+
+/* MurmurHash3 (x86_32) の1ワード分の混合 */
+static inline uint32_t
+_mix (uint32_t h, uint32_t k)
+{
+  k *= 0xcc9e2d51;
+  k = _rotl32 (k, 15);
+  k *= 0x1b873593;
+  h ^= k;
+  h = _rotl32 (h, 13);
+  return h * 5 + 0xe6546b64;
+}
+
+/* sort a copy of the member list: the same set gives the same key */
+static void
+_sort_members (int *key, const int *members, int num_members)
+{
+  int i, j, m;
+
+  for (i = 0; i < num_members; i++)
+    {
+      m = members[i];
+      for (j = i; j > 0 && key[j - 1] > m; j--)
+        key[j] = key[j - 1];
+      key[j] = m;
+    }
+}
+
+/* hash of the primary and the sorted member list */
+static uint32_t
+_members_hash (int primary, const int *members, int num_members)
+{
+  uint32_t h = _mix (num_members, primary);
+  int i;
+
+  for (i = 0; i < num_members; i++)
+    h = _mix (h, members[i]);
+  return h;
+}
+
+static int
+_find (int primary, const int *members, int num_members, uint32_t hash)
+{
+  struct nexthop_group *g;
+  int slot;
+
+  if (_hash_size == 0)
+    return -1;
+  for (slot = _hash_head[hash & (_hash_size - 1)] - 1; slot >= 0;
+       slot = g->hash_next - 1)
+    {
+      g = nhg_group (slot);
+      if (g->hash == hash && g->num_members == num_members
+          && g->primary == primary
+          && memcmp (g->members, members, num_members * sizeof (int)) == 0)
+        return slot;
+    }
+  return -1;
+}
+
+/* reassign the buckets to new members, remapping as few as possible */
+static void
+_remap (struct nexthop_group *g, const int *members, int num_members)
+{
+  int count[NHG_MAX_MEMBERS], target[NHG_MAX_MEMBERS];
+  int freed[NHG_BUCKETS];
+  int i, b, m, num_freed = 0;
+
+  /* fair share of the buckets */
+  for (i = 0; i < num_members; i++)
+    {
+      count[i] = 0;
+      target[i] = NHG_BUCKETS / num_members
+                  + (i < NHG_BUCKETS % num_members ? 1 : 0);
+    }
+
+  /* keep the buckets of the remaining members up to their share */
+  for (b = 0; b < NHG_BUCKETS; b++)
+    {
+      m = _member_index (members, num_members, g->buckets[b]);
+      if (m < 0 || count[m] >= target[m])
+        freed[num_freed++] = b;
+      else
+        count[m]++;
+    }
+
+  /* hand out the freed buckets to the members below their share */
+  for (i = 0, m = 0; i < num_freed; i++)
+    {
+      while (count[m] >= target[m])
+        m++;
+      g->buckets[freed[i]] = members[m];
+      count[m]++;
+    }
+}
+
+/* double the hash index (or create it) and relink the live groups */
+static int
+_grow_hash (void)
+{
+  struct nexthop_group *g;
+  int *head, size, slot;
+
+  size = _hash_size ? _hash_size * 2 : NHG_HASH_INIT;
+  head = calloc (size, sizeof (int));
+  if (! head)
+    return -1;
+  mem_stat_alloc (MEM_RIB, size * sizeof (int));
+
+  for (slot = 0; slot < _next_unused; slot++)
+    {
+      g = nhg_group (slot);
+      if (g->num_members == 0)
+        continue; // released
+      g->hash_next = head[g->hash & (size - 1)];
+      head[g->hash & (size - 1)] = slot + 1;
+    }
+
+  if (_hash_head)
+    mem_stat_free (MEM_RIB, _hash_size * sizeof (int));
+  free (_hash_head);
+  _hash_head = head;
+  _hash_size = size;
+  return 0;
+}
+
+/* a slot for a new group, adding a chunk to the table if needed */
+static int
+_alloc_slot (void)
+{
+  struct nexthop_group **chunks;
+  int slot;
+
+  if (_free_head >= 0)
+    {
+      slot = _free_head;
+      _free_head = nhg_group (slot)->next_free;
+      return slot;
+    }
+
+  if (_next_unused >= NHG_MAX_GROUPS)
+    return -1;
+  if ((_next_unused >> NHG_CHUNK_SHIFT) == _num_chunks)
+    {
+      chunks = realloc (nhg_chunks,
+                        (_num_chunks + 1) * sizeof (struct nexthop_group *));
+      if (! chunks)
+        return -1;
+      nhg_chunks = chunks;
+      mem_stat_realloc (MEM_RIB,
+                        _num_chunks * sizeof (struct nexthop_group *),
+                        (_num_chunks + 1) * sizeof (struct nexthop_group *));
+      nhg_chunks[_num_chunks] =
+          calloc (NHG_CHUNK_SIZE, sizeof (struct nexthop_group));
+      if (! nhg_chunks[_num_chunks])
+        return -1;
+      mem_stat_alloc (MEM_RIB,
+                      NHG_CHUNK_SIZE * sizeof (struct nexthop_group));
+      _num_chunks++;
+    }
+  return _next_unused++;
+}
+
+/*
+ * members[0] (最も優先される経路) をprimaryとし, primaryとメンバ集合が
+ * 同じグループがあれば共有し, なければ作成する.
+ * baseがグループなら, そのバケット割り当てを引き継いでメンバの差分のみを
+ * 再割り当てする (resilient). returns the id with a reference taken,
+ * or -1 for invalid members or when the table cannot grow.
+ */
+int
+nhg_get (const int *members, int num_members, int base)
+{
+  struct nexthop_group *g;
+  int key[NHG_MAX_MEMBERS];
+  uint32_t hash;
+  int slot, b, i;
+
+  if (_check_members (members, num_members) != 0)
+    return -1;
+
+  _sort_members (key, members, num_members);
+  hash = _members_hash (members[0], key, num_members);
+  slot = _find (members[0], key, num_members, hash);
+  if (slot >= 0)
+    {
+      nhg_group (slot)->ref_count++;
+      return NHG_ID_FLAG | slot;
+    }
+
+  /* keep the chains short: at most 2 groups per head on average */
+  if (_num_groups >= _hash_size * 2 && _grow_hash () != 0)
+    {
+      fprintf (stderr, "ERROR: cannot grow the nexthop group index\n");
+      return -1;
+    }
+
+  slot = _alloc_slot ();
+  if (slot < 0)
+    {
+      fprintf (stderr, "ERROR: cannot allocate a nexthop group (%d groups)\n",
+               _num_groups);
+      return -1;
+    }
+
+  g = nhg_group (slot);
+  if (NHG_IS_GROUP (base) && nhg_group (base)->num_members > 0)
+    {
+      memcpy (g->buckets, nhg_group (base)->buckets, sizeof (g->buckets));
+      _remap (g, key, num_members);
+    }
+  else
+    for (b = 0; b < NHG_BUCKETS; b++)
+      g->buckets[b] = key[b % num_members];
+
+  g->num_members = num_members;
+  memcpy (g->members, key, num_members * sizeof (int));
+  g->primary = members[0];
+  for (i = 0; i < num_members; i++)
+    route_table_ref (&route_table, members[i]);
+  g->ref_count = 1;
+  g->next_free = -1;
+  g->hash = hash;
+  g->hash_next = _hash_head[hash & (_hash_size - 1)];
+  _hash_head[hash & (_hash_size - 1)] = slot + 1;
+  _num_groups++;
+  return NHG_ID_FLAG | slot;
+}
+
+static void
+_release (int slot)
+{
+  struct nexthop_group *g = nhg_group (slot);
+  int *hp, i;
+
+  /* unlink from the hash chain */
+  for (hp = &_hash_head[g->hash & (_hash_size - 1)]; *hp != slot + 1;
+       hp = &nhg_group (*hp - 1)->hash_next)
+    ;
+  *hp = g->hash_next;
+
+  for (i = 0; i < g->num_members; i++)
+    route_table_unref (&route_table, g->members[i]);
+  g->num_members = 0;
+  g->next_free = _free_head;
+  _free_head = slot;
+  _num_groups--;
+}
+
+/* take/drop a reference of a nexthop id (a group or a route_table entry) */
+void
+nhg_ref (int id)
+{
+  if (NHG_IS_GROUP (id))
+    nhg_group (id)->ref_count++;
+  else
+    route_table_ref (&route_table, id);
+}
+
+void
+nhg_unref (int id)
+{
+  struct nexthop_group *g;
+
+  if (! NHG_IS_GROUP (id))
+    {
+      route_table_unref (&route_table, id);
+      return;
+    }
+  g = nhg_group (id);
+  if (g->num_members > 0 && --g->ref_count == 0)
+    _release (id & NHG_ID_MASK);
+}
+
+int
+nhg_count (void)
+{
+  return _num_groups;
+}
+
+/* free the table and the index; the groups must all be released */
+void
+nhg_table_free (void)
+{
+  int i;
+
+  for (i = 0; i < _num_chunks; i++)
+    free (nhg_chunks[i]);
+  if (_num_chunks > 0)
+    mem_stat_free (MEM_RIB,
+                   _num_chunks * NHG_CHUNK_SIZE * sizeof (struct nexthop_group)
+                       + _num_chunks * sizeof (struct nexthop_group *));
+  free (nhg_chunks);
+  if (_hash_head)
+    mem_stat_free (MEM_RIB, _hash_size * sizeof (int));
+  free (_hash_head);
+
+  nhg_chunks = NULL;
+  _num_chunks = 0;
+  _hash_head = NULL;
+  _hash_size = 0;
+  _free_head = -1;
+  _next_unused = 0;
+  _num_groups = 0;
+}
+
+/* hash of the 5-tuple, the same for every packet of a flow */
+uint32_t
+nhg_flow_hash (int family, const struct nhg_flow *f)
+{
+  int i, words = (family == AF_INET6) ? 4 : 1;
+  uint32_t h = 0, k;
+
+  for (i = 0; i < words; i++)
+    {
+      memcpy (&k, f->src + i * 4, 4);
+      h = _mix (h, k);
+      memcpy (&k, f->dst + i * 4, 4);
+      h = _mix (h, k);
+    }
+  h = _mix (h, ((uint32_t) f->sport << 16) | f->dport);
+  h = _mix (h, f->proto);
+
+  /* finalization */
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
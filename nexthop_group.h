@@ -0,0 +1,98 @@
+#ifndef NEXTHOP_GROUP_H
+#define NEXTHOP_GROUP_H
+
+#include <stdint.h>
+
+/*
+ * Nexthop group (ECMP).
+ * RIB/FIBのroute_idx[0]は "nexthop id" を持つ:
+ * - route_tableのインデックス (単一のnexthop)
+ * - NHG_ID_FLAG | グループ番号 (複数のnexthop)
+ * グループはNHG_BUCKETS個のバケットにメンバのroute_idxを割り当てた
+ * resilient hashテーブルを持ち, フローハッシュでバケットを1つ選ぶ.
+ *
+ * primary (メンバ列の先頭, 最も優先される経路) とメンバ集合が同じ
+ * グループは共有され (残りのメンバの順序は問わない: primaryと整列した
+ * メンバ列をキーとする), RIB (経路, 選択経路) とFIB (葉ノード)
+ * からの参照を数える. 参照がなくなったグループは解放され, メンバの
+ * route_tableエントリの参照も解放される.
+ *
+ * グループ表はNHG_CHUNK_SIZE個ずつのチャンクを必要になった時に確保する
+ * (チャンクは動かないのでグループのアドレスは変わらない). メンバ列の
+ * ハッシュ索引も負荷に応じて伸長する.
+ */
+
+#define NHG_MAX_MEMBERS 64
+#define NHG_BUCKETS     256 // power of 2
+#define NHG_CHUNK_SHIFT 6 // 64 groups per chunk
+#define NHG_CHUNK_SIZE  (1 << NHG_CHUNK_SHIFT)
+#define NHG_CHUNK_MASK  (NHG_CHUNK_SIZE - 1)
+#define NHG_MAX_GROUPS  (1 << 24)
+#define NHG_HASH_INIT   64 // power of 2, chains of groups by member list
+#define NHG_ID_FLAG     0x40000000
+#define NHG_ID_MASK     (NHG_MAX_GROUPS - 1)
+
+/* -1 (no route) is not a group */
+#define NHG_IS_GROUP(id) (((uint32_t) (id) >> 30) == 1)
+
+struct nexthop_group
+{
+  int num_members; // 0: unused
+  int members[NHG_MAX_MEMBERS]; // route_idx, sorted: the key of the group
+  int primary;                  // route_idx preferred, part of the key
+  int buckets[NHG_BUCKETS];     // route_idx of the member of each bucket
+  int ref_count;
+  uint32_t hash;   // hash of the member list
+  int hash_next;   // next slot + 1 in the hash chain, 0: end
+  int next_free;
+};
+
+/* chunks of the group table, allocated on demand */
+extern struct nexthop_group **nhg_chunks;
+
+static inline struct nexthop_group *
+nhg_group (int id)
+{
+  int slot = id & NHG_ID_MASK;
+
+  return &nhg_chunks[slot >> NHG_CHUNK_SHIFT][slot & NHG_CHUNK_MASK];
+}
+
+/* 5-tuple of a flow; addresses in network order */
+struct nhg_flow
+{
+  uint8_t src[16];
+  uint8_t dst[16];
+  uint16_t sport;
+  uint16_t dport;
+  uint8_t proto;
+};
+
+int nhg_get (const int *members, int num_members, int base);
+void nhg_ref (int id);
+void nhg_unref (int id);
+int nhg_count (void);
+void nhg_table_free (void); // after every reference is dropped
+uint32_t nhg_flow_hash (int family, const struct nhg_flow *f);
+
+/*
+ * select the route_idx of a flow. nexthop ids that are not groups are
+ * returned as is. the group table grows, so a single-path id cannot be
+ * used to index it: one branch, the same for every flow of the prefix.
+ */
+static inline int
+nhg_select (int id, uint32_t hash)
+{
+  if (! NHG_IS_GROUP (id))
+    return id;
+  return nhg_group (id)->buckets[hash & (NHG_BUCKETS - 1)];
+}
+
+/* representative route_idx of a nexthop id (the primary of a group) */
+static inline int
+nhg_primary (int id)
+{
+  return NHG_IS_GROUP (id) ? nhg_group (id)->primary : id;
+}
+
+#endif /* NEXTHOP_GROUP_H */
@@ -0,0 +1,256 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ortc.h"
+#include "radix.h"
+
+/*
+ * Optimal Routing Table Constructor (Draves et al., INFOCOM'99).
+ *
+ * pass 1: normalize the binary trie so that every node has 0 or 2
+ *         children, pushing the inherited nexthop down to the leaves.
+ * pass 2: bottom-up, compute the set of candidate nexthops of each node
+ *         (intersection of the children's sets if not empty, else union).
+ * pass 3: top-down, install a prefix only where the inherited nexthop is
+ *         not a candidate.
+ *
+ * "no route" cannot be expressed below a covering prefix in the FIB, so a
+ * subtree containing a region without a route is forced to {ORTC_NONE}
+ * and never gets a prefix. The result is optimal among the prefix sets
+ * without null routes.
+ */
+
+#define ORTC_NONE (-1)
+
+/* key: byte array, b: bit index */
+#define BIT_CHECK(key, b)                                                     \
+  (((uint8_t *) (key))[(b) >> 3] & (0x80 >> ((b) & 0x7)))
+#define BIT_SET(key, b) (((uint8_t *) (key))[(b) >> 3] |= (0x80 >> ((b) & 0x7)))
+#define BIT_CLEAR(key, b)                                                     \
+  (((uint8_t *) (key))[(b) >> 3] &= ~(0x80 >> ((b) & 0x7)))
+
+struct ortc_node
+{
+  int nh; /* nexthop of the prefix at this node, ORTC_NONE if none */
+  int set_size;
+  int *set; /* sorted candidate nexthops */
+  struct ortc_node *child[2];
+};
+
+struct ortc_arg
+{
+  struct ortc_node *root;
+  int failed;
+};
+
+static struct ortc_node *
+_ortc_node_create (int nh)
+{
+  struct ortc_node *n;
+
+  n = calloc (1, sizeof (struct ortc_node));
+  if (n)
+    n->nh = nh;
+  return n;
+}
+
+static void
+_ortc_node_free (struct ortc_node *n)
+{
+  if (! n)
+    return;
+  _ortc_node_free (n->child[0]);
+  _ortc_node_free (n->child[1]);
+  free (n->set);
+  free (n);
+}
+
+/* pass 0: load the RIB prefixes into the binary trie */
+static int
+_ortc_insert (struct rib_node *rn, void *arg)
+{
+  struct ortc_arg *a = (struct ortc_arg *)arg;
+  struct ortc_node **np = &a->root;
+  int depth;
+
+  for (depth = 0;; depth++)
+    {
+      if (! *np)
+        {
+          *np = _ortc_node_create (ORTC_NONE);
+          if (! *np)
+            {
+              a->failed = 1;
+              return -1;
+            }
+        }
+      if (depth == rn->keylen)
+        break;
+      np = &(*np)->child[BIT_CHECK (rn->key, depth) ? 1 : 0];
+    }
+
+  (*np)->nh = rn->route_idx[0];
+  return 0;
+}
+
+static int
+_ortc_set_single (struct ortc_node *n, int nh)
+{
+  n->set = malloc (sizeof (int));
+  if (! n->set)
+    return -1;
+  n->set[0] = nh;
+  n->set_size = 1;
+  return 0;
+}
+
+/* pass 1 and 2 in one post-order walk */
+static int
+_ortc_prepare (struct ortc_node *n, int inherited)
+{
+  const int *a, *b;
+  int i, j, k, na, nb;
+  int nh;
+
+  nh = (n->nh != ORTC_NONE) ? n->nh : inherited;
+
+  /* leaf */
+  if (! n->child[0] && ! n->child[1])
+    return _ortc_set_single (n, nh);
+
+  /* pass 1: complete the missing child with the inherited nexthop */
+  for (i = 0; i < 2; i++)
+    {
+      if (! n->child[i])
+        {
+          n->child[i] = _ortc_node_create (ORTC_NONE);
+          if (! n->child[i])
+            return -1;
+        }
+      if (_ortc_prepare (n->child[i], nh) != 0)
+        return -1;
+    }
+
+  /* pass 2: merge the children's candidate sets */
+  a = n->child[0]->set;
+  na = n->child[0]->set_size;
+  b = n->child[1]->set;
+  nb = n->child[1]->set_size;
+
+  if (a[0] == ORTC_NONE || b[0] == ORTC_NONE)
+    return _ortc_set_single (n, ORTC_NONE);
+
+  n->set = malloc ((na + nb) * sizeof (int));
+  if (! n->set)
+    return -1;
+
+  /* intersection */
+  for (i = j = k = 0; i < na && j < nb;)
+    {
+      if (a[i] < b[j])
+        i++;
+      else if (a[i] > b[j])
+        j++;
+      else
+        {
+          n->set[k++] = a[i];
+          i++;
+          j++;
+        }
+    }
+
+  /* union if the intersection is empty */
+  if (k == 0)
+    {
+      for (i = j = 0; i < na || j < nb;)
+        {
+          if (j >= nb || (i < na && a[i] < b[j]))
+            n->set[k++] = a[i++];
+          else if (i >= na || b[j] < a[i])
+            n->set[k++] = b[j++];
+          else
+            {
+              n->set[k++] = a[i];
+              i++;
+              j++;
+            }
+        }
+    }
+  n->set_size = k;
+  return 0;
+}
+
+static int
+_ortc_contains (const struct ortc_node *n, int nh)
+{
+  int lo = 0, hi = n->set_size - 1, mid;
+
+  while (lo <= hi)
+    {
+      mid = (lo + hi) / 2;
+      if (n->set[mid] == nh)
+        return 1;
+      if (n->set[mid] < nh)
+        lo = mid + 1;
+      else
+        hi = mid - 1;
+    }
+  return 0;
+}
+
+/* pass 3: assign nexthops top-down and emit the prefixes */
+static int
+_ortc_assign (struct ortc_node *n, int inherited, uint8_t *key, int depth,
+              struct rib_tree *dst)
+{
+  int nh, i;
+
+  if (! n)
+    return 0;
+
+  nh = inherited;
+  if (! _ortc_contains (n, inherited))
+    {
+      nh = n->set[0];
+      if (nh != ORTC_NONE && rib_route_add (dst, key, depth, nh) != 0)
+        return -1;
+    }
+
+  for (i = 0; i < 2; i++)
+    {
+      if (i)
+        BIT_SET (key, depth);
+      if (_ortc_assign (n->child[i], nh, key, depth + 1, dst) != 0)
+        return -1;
+      BIT_CLEAR (key, depth);
+    }
+  return 0;
+}
+
+int
+rib_aggregate (struct rib_tree *src, struct rib_tree *dst)
+{
+  struct ortc_arg arg = { NULL, 0 };
+  uint8_t key[17] = { 0 };
+  int ret;
+
+  dst->family = src->family;
+  dst->table_id = src->table_id;
+
+  if (rib_traverse (src, _ortc_insert, &arg) != 0 || arg.failed)
+    {
+      _ortc_node_free (arg.root);
+      return -1;
+    }
+  if (! arg.root)
+    return 0;
+
+  ret = _ortc_prepare (arg.root, ORTC_NONE);
+  if (ret == 0)
+    ret = _ortc_assign (arg.root, ORTC_NONE, key, 0, dst);
+
+  _ortc_node_free (arg.root);
+  return ret;
+}
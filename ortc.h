@@ -0,0 +1,9 @@
+#ifndef ORTC_H
+#define ORTC_H
+
+#include "fib.h"
+
+/* ORTC aggregation: build a forwarding-equivalent RIB with fewer prefixes */
+int rib_aggregate (struct rib_tree *src, struct rib_tree *dst);
+
+#endif /* ORTC_H */
@@ -0,0 +1,163 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf_counter.h"
+
+#define CACHE_EVENT(cache, op, result)                                        \
+  ((cache) | ((op) << 8) | ((result) << 16))
+
+static const struct
+{
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} perf_counter_events[PERF_COUNTER_NUM] = {
+  [PERF_COUNTER_CYCLES] = { "cycles", PERF_TYPE_HARDWARE,
+                            PERF_COUNT_HW_CPU_CYCLES },
+  [PERF_COUNTER_INSTRUCTIONS] = { "instructions", PERF_TYPE_HARDWARE,
+                                  PERF_COUNT_HW_INSTRUCTIONS },
+  [PERF_COUNTER_L1D_MISSES] = { "L1D misses", PERF_TYPE_HW_CACHE,
+                                CACHE_EVENT (PERF_COUNT_HW_CACHE_L1D,
+                                             PERF_COUNT_HW_CACHE_OP_READ,
+                                             PERF_COUNT_HW_CACHE_RESULT_MISS) },
+  [PERF_COUNTER_LLC_MISSES] = { "LLC misses", PERF_TYPE_HW_CACHE,
+                                CACHE_EVENT (PERF_COUNT_HW_CACHE_LL,
+                                             PERF_COUNT_HW_CACHE_OP_READ,
+                                             PERF_COUNT_HW_CACHE_RESULT_MISS) },
+  [PERF_COUNTER_DTLB_MISSES] = { "dTLB misses", PERF_TYPE_HW_CACHE,
+                                 CACHE_EVENT (PERF_COUNT_HW_CACHE_DTLB,
+                                              PERF_COUNT_HW_CACHE_OP_READ,
+                                              PERF_COUNT_HW_CACHE_RESULT_MISS) },
+  [PERF_COUNTER_BRANCH_MISSES] = { "branch misses", PERF_TYPE_HARDWARE,
+                                   PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static int
+_perf_event_open (uint32_t type, uint64_t config)
+{
+  struct perf_event_attr attr;
+
+  memset (&attr, 0, sizeof (attr));
+  attr.size = sizeof (attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1; // allowed with perf_event_paranoid <= 2
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  /* this thread, any cpu */
+  return syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* open the counters of the calling thread. returns the number opened */
+int
+perf_counter_open (struct perf_counter *pc)
+{
+  int i, err = 0;
+
+  memset (pc, 0, sizeof (struct perf_counter));
+  for (i = 0; i < PERF_COUNTER_NUM; i++)
+    {
+      pc->fd[i] = _perf_event_open (perf_counter_events[i].type,
+                                    perf_counter_events[i].config);
+      if (pc->fd[i] >= 0)
+        pc->num_open++;
+      else if (! err)
+        err = errno;
+    }
+
+  if (pc->num_open == 0)
+    printf ("hardware counters unavailable (%s), wall-clock only\n",
+            strerror (err));
+  return pc->num_open;
+}
+
+void
+perf_counter_close (struct perf_counter *pc)
+{
+  int i;
+
+  for (i = 0; i < PERF_COUNTER_NUM; i++)
+    {
+      if (pc->fd[i] >= 0)
+        close (pc->fd[i]);
+      pc->fd[i] = -1;
+    }
+  pc->num_open = 0;
+}
+
+void
+perf_counter_start (struct perf_counter *pc)
+{
+  int i;
+
+  for (i = 0; i < PERF_COUNTER_NUM; i++)
+    {
+      if (pc->fd[i] < 0)
+        continue;
+      ioctl (pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl (pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void
+perf_counter_stop (struct perf_counter *pc)
+{
+  uint64_t buf[3]; /* value, time_enabled, time_running */
+  int i;
+
+  for (i = 0; i < PERF_COUNTER_NUM; i++)
+    {
+      if (pc->fd[i] < 0)
+        continue;
+      ioctl (pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+      if (read (pc->fd[i], buf, sizeof (buf)) != sizeof (buf))
+        {
+          close (pc->fd[i]);
+          pc->fd[i] = -1;
+          pc->num_open--;
+          continue;
+        }
+
+      /* scale up if the counter was multiplexed */
+      if (buf[2] > 0 && buf[2] < buf[1])
+        pc->value[i] = (uint64_t)((double)buf[0] * buf[1] / buf[2]);
+      else
+        pc->value[i] = buf[0];
+    }
+}
+
+/* print each counter as a per-operation figure */
+void
+perf_counter_print (const struct perf_counter *pc, uint64_t ops)
+{
+  int i;
+
+  if (pc->num_open == 0 || ops == 0)
+    return;
+
+  printf ("hardware counters per lookup:\n");
+  for (i = 0; i < PERF_COUNTER_NUM; i++)
+    {
+      if (pc->fd[i] < 0)
+        printf ("  %-14s: n/a\n", perf_counter_events[i].name);
+      else
+        printf ("  %-14s: %.3f\n", perf_counter_events[i].name,
+                (double)pc->value[i] / (double)ops);
+    }
+
+  if (pc->fd[PERF_COUNTER_CYCLES] >= 0 && pc->fd[PERF_COUNTER_INSTRUCTIONS] >= 0
+      && pc->value[PERF_COUNTER_CYCLES] > 0)
+    printf ("  %-14s: %.3f\n", "IPC",
+            (double)pc->value[PERF_COUNTER_INSTRUCTIONS]
+                / (double)pc->value[PERF_COUNTER_CYCLES]);
+}
@@ -0,0 +1,31 @@
+#ifndef PERF_COUNTER_H
+#define PERF_COUNTER_H
+
+#include <stdint.h>
+
+/* hardware events counted around a benchmark loop */
+enum perf_counter_event
+{
+  PERF_COUNTER_CYCLES = 0,
+  PERF_COUNTER_INSTRUCTIONS,
+  PERF_COUNTER_L1D_MISSES,
+  PERF_COUNTER_LLC_MISSES,
+  PERF_COUNTER_DTLB_MISSES,
+  PERF_COUNTER_BRANCH_MISSES,
+  PERF_COUNTER_NUM
+};
+
+struct perf_counter
+{
+  int fd[PERF_COUNTER_NUM]; // -1: unavailable
+  uint64_t value[PERF_COUNTER_NUM];
+  int num_open;
+};
+
+int perf_counter_open (struct perf_counter *pc);
+void perf_counter_close (struct perf_counter *pc);
+void perf_counter_start (struct perf_counter *pc);
+void perf_counter_stop (struct perf_counter *pc);
+void perf_counter_print (const struct perf_counter *pc, uint64_t ops);
+
+#endif /* PERF_COUNTER_H */
@@ -14,6 +14,7 @@
 
 #include "queue.h"
 #include "ptree.h"
+#include "memstat.h"
 
 char mask[] = { 0x00, 0x80, 0xc0, 0xe0, 0xf0, 0xf8, 0xfc, 0xfe, 0xff };
 
@@ -28,6 +29,7 @@ ptree_node_create (char *key, int keylen)
   XRTMALLOC(x, struct ptree_node *, len);
   if (! x)
     return NULL;
+  mem_stat_alloc (MEM_PTREE, len);
 
   x->key = (char *)((caddr_t)x + sizeof (struct ptree_node));
   x->keylen = keylen;
@@ -47,6 +49,8 @@ ptree_node_create (char *key, int keylen)
 static void
 ptree_node_delete (struct ptree_node *x)
 {
+  mem_stat_free (MEM_PTREE,
+                 sizeof (struct ptree_node) + (x->keylen + 7) / 8);
   XRTFREE (x);
 }
 
@@ -453,6 +457,7 @@ ptree_create (void)
   XRTMALLOC(t, struct ptree *, sizeof (struct ptree));
   if (! t)
     return NULL;
+  mem_stat_alloc (MEM_PTREE, sizeof (struct ptree));
 
   t->top = NULL;
   return t;
@@ -484,6 +489,7 @@ ptree_delete (struct ptree *t)
     }
 
   queue_delete (q);
+  mem_stat_free (MEM_PTREE, sizeof (struct ptree));
   XRTFREE (t);
 }
 
@@ -8,11 +8,65 @@
 
 #include "radix.h"
 #include "fib.h"
+#include "nexthop_group.h"
+#include "memstat.h"
+
+/*
+ * Path-compressed (Patricia) RIB.
+ * - 各ノードはプレフィックス (key/keylen) を持ち, keylen番目のビットで
+ *   左右の子ノードに分岐する.
+ * - 経路を持たないノード (valid == 0) は分岐ノードのみ (子ノードが2つ).
+ * - keyはKEY_SIZE(keylen)バイトのみをノードの末尾に格納する.
+ * - 各プレフィックスは経路元 (source, peer) ごとの候補経路 (rib_path) を
+ *   優先度順のリストで持ち, 先頭の経路 (ECMPでは同じ優先度の経路) を
+ *   route_idxに選択する. 選択が変わった時のみFIBを更新すればよい.
+ */
 
 /* key: byte array, b: bit index */
 #define BIT_CHECK(key, b)                                                     \
   (((uint8_t *) (key))[(b) >> 3] & (0x80 >> ((b) & 0x7)))
 
+static const uint8_t _mask[] = { 0x00, 0x80, 0xc0, 0xe0, 0xf0,
+                                 0xf8, 0xfc, 0xfe, 0xff };
+
+#define RIB_NODE_SIZE(keylen) (sizeof (struct rib_node) + KEY_SIZE (keylen))
+
+static inline int
+_addr_bits (const struct rib_tree *t)
+{
+  return (t->family == AF_INET6) ? 128 : 32;
+}
+
+/* 1 iff the first keylen bits of a and b are the same */
+static inline int
+_match (const uint8_t *a, const uint8_t *b, int keylen)
+{
+  int bytes = keylen >> 3;
+  int bits = keylen & 7;
+
+  if (memcmp (a, b, bytes) != 0)
+    return 0;
+  return bits == 0 || ! ((a[bytes] ^ b[bytes]) & _mask[bits]);
+}
+
+/* number of leading bits in which a and b are equal (up to maxlen) */
+static int
+_common_len (const uint8_t *a, const uint8_t *b, int maxlen)
+{
+  int len = 0;
+  uint8_t diff;
+
+  while (len + 8 <= maxlen && a[len >> 3] == b[len >> 3])
+    len += 8;
+  if (len >= maxlen)
+    return maxlen;
+
+  diff = a[len >> 3] ^ b[len >> 3];
+  while (len < maxlen && ! (diff & (0x80 >> (len & 7))))
+    len++;
+  return len;
+}
+
 struct rib_tree *
 rib_new (struct rib_tree *t)
 {
@@ -21,22 +75,73 @@ rib_new (struct rib_tree *t)
       t = malloc (sizeof (struct rib_tree));
       if (! t)
         return NULL;
+      mem_stat_alloc (MEM_RIB, sizeof (struct rib_tree));
     }
   t->root = NULL;
   t->family = 0;
   t->table_id = 0;
+  t->num_prefixes = 0;
+  t->num_paths = 0;
+  t->num_nodes = 0;
+  t->mem_size = 0;
+  t->bulk = NULL;
+  t->bulk_size = 0;
   return t;
 }
 
+static inline int
+_in_bulk (const struct rib_tree *t, const void *p)
+{
+  return (const uint8_t *) p >= t->bulk
+         && (const uint8_t *) p < t->bulk + t->bulk_size;
+}
+
+/* the block of rib_bulk_load is freed with the tree only */
+static inline void
+_release_node (struct rib_tree *t, struct rib_node *n)
+{
+  if (_in_bulk (t, n))
+    return;
+  mem_stat_free (MEM_RIB, RIB_NODE_SIZE (n->keylen));
+  free (n);
+}
+
+static inline void
+_release_path (struct rib_tree *t, struct rib_path *p)
+{
+  if (_in_bulk (t, p))
+    return;
+  free (p);
+  mem_stat_free (MEM_RIB, sizeof (struct rib_path));
+}
+
 /* free RIB node */
 static void
-_free_rib_node (struct rib_node *n)
+_free_rib_node (struct rib_tree *t, struct rib_node *n)
 {
+  struct rib_node *stack[RIB_STACK_SIZE];
+  int sp = 0;
+
   if (n)
+    stack[sp++] = n;
+  while (sp > 0)
     {
-      _free_rib_node (n->left);
-      _free_rib_node (n->right);
-      free (n);
+      struct rib_path *p, *next;
+
+      n = stack[--sp];
+      if (n->right)
+        stack[sp++] = n->right;
+      if (n->left)
+        stack[sp++] = n->left;
+      for (p = n->paths; p; p = next)
+        {
+          next = p->next;
+          nhg_unref (p->route_idx);
+          _release_path (t, p);
+        }
+      if (n->valid)
+        nhg_unref (n->route_idx[0]);
+      _release_node (t, n);
     }
 }
 
@@ -45,229 +150,703 @@ rib_free (struct rib_tree *t)
 {
   if (t)
     {
-      _free_rib_node (t->root);
+      _free_rib_node (t, t->root);
+      if (t->bulk)
+        mem_stat_free (MEM_RIB, t->bulk_size);
+      free (t->bulk);
       free (t);
+      mem_stat_free (MEM_RIB, sizeof (struct rib_tree));
     }
 }
 
-static struct rib_node *
-_create_rib_node (void)
+static void
+_init_rib_node (struct rib_tree *t, struct rib_node *new, const uint8_t *key,
+                int keylen)
 {
-  struct rib_node *new;
   int i;
 
-  new = malloc (sizeof (struct rib_node));
-  if (! new)
-    return NULL;
-
-  memset (new, 0, sizeof (struct rib_node));
+  memset (new, 0, RIB_NODE_SIZE (keylen));
+  new->keylen = keylen;
+  memcpy (new->key, key, KEY_SIZE (keylen));
+  if (keylen & 7)
+    new->key[keylen >> 3] &= _mask[keylen & 7];
 
   /* initialize route_idx to -1 to distinguish from valid index 0 */
   for (i = 0; i < MAX_ECMP_ENTRY; i++)
     new->route_idx[i] = -1;
 
+  t->num_nodes++;
+  t->mem_size += RIB_NODE_SIZE (keylen);
+}
+
+static struct rib_node *
+_create_rib_node (struct rib_tree *t, const uint8_t *key, int keylen)
+{
+  struct rib_node *new;
+
+  new = malloc (RIB_NODE_SIZE (keylen));
+  if (! new)
+    return NULL;
+  mem_stat_alloc (MEM_RIB, RIB_NODE_SIZE (keylen));
+  _init_rib_node (t, new, key, keylen);
   return new;
 }
 
+static void
+_delete_rib_node (struct rib_tree *t, struct rib_node *n)
+{
+  t->num_nodes--;
+  t->mem_size -= RIB_NODE_SIZE (n->keylen);
+  _release_node (t, n);
+}
+
+static inline struct rib_node **
+_child (struct rib_node *n, const uint8_t *key)
+{
+  return BIT_CHECK (key, n->keylen) ? &n->right : &n->left;
+}
+
+/* find the node of the prefix, or insert a new one without routes */
 static struct rib_node *
-_add (struct rib_node *n, const uint8_t *key, int keylen, int idx, int depth,
-      int *success)
+_get_node (struct rib_tree *t, const uint8_t *key, int keylen)
 {
+  struct rib_node **np, *n, *new, *branch;
+  int len;
+
+  np = &t->root;
+  while ((n = *np) && n->keylen <= keylen && _match (n->key, key, n->keylen))
+    {
+      if (n->keylen == keylen)
+        return n;
+      np = _child (n, key);
+    }
+
+  new = _create_rib_node (t, key, keylen);
+  if (! new)
+    return NULL; // failed, not enough memory
+
   if (! n)
     {
-      n = _create_rib_node ();
-      if (! n)
-        {
-          *success = -1; // failed, not enough memory
-          return n;
-        }
+      *np = new;
+      return new;
     }
 
-  if (depth == keylen)
+  /* n diverges from the key or is more specific than the key */
+  len = _common_len (n->key, key, n->keylen < keylen ? n->keylen : keylen);
+  if (len == keylen)
     {
-      if (n->valid)
-        {
-          if (n->num_routes >= MAX_ECMP_ENTRY)
-            {
-              *success = -1; // failed, full ECMP entry
-              return n;
-            }
-          else
-            {
-              /* add to available slots */
-              for (int i = 0; i < MAX_ECMP_ENTRY; i++)
-                {
-                  if (n->route_idx[i] == -1)
-                    {
-                      n->route_idx[i] = idx;
-                      n->num_routes++;
-                      *success = 0; // successed
-                      return n;
-                    }
-                }
-            }
-          *success = -1; // failed, should not be reached
-          return n;
-        }
-      memset (n->key, 0, 16);
-      memcpy (n->key, key, KEY_SIZE (keylen));
-      n->keylen = keylen;
-      n->valid = 1;
-      n->route_idx[0] = idx;
-      n->num_routes++;
-      *success = 0;
-      return n;
+      /* new node becomes the parent of n */
+      *_child (new, n->key) = n;
+      *np = new;
+      return new;
     }
-  else
+
+  /* create a branching node at the first different bit */
+  branch = _create_rib_node (t, key, len);
+  if (! branch)
     {
-      if (BIT_CHECK (key, depth))
-        n->right = _add (n->right, key, keylen, idx, depth + 1, success);
-      else
-        n->left = _add (n->left, key, keylen, idx, depth + 1, success);
-      return n;
+      _delete_rib_node (t, new);
+      return NULL;
     }
+  *_child (branch, key) = new;
+  *_child (branch, n->key) = n;
+  *np = branch;
+  return new;
 }
 
+/* default administrative distance of each route source */
+static const int _default_distance[RIB_SOURCE_MAX] = {
+  [RIB_SOURCE_CONNECTED] = 0,
+  [RIB_SOURCE_STATIC] = 1,
+  [RIB_SOURCE_IGP] = 110,
+  [RIB_SOURCE_BGP] = 20,
+};
+
 int
-rib_route_add (struct rib_tree *t, const uint8_t *key, int keylen, int idx)
+rib_source_distance (int source)
 {
-  int success = 0;
-  t->root = _add (t->root, key, keylen, idx, 0, &success);
-  return success;
+  if (source < 0 || source >= RIB_SOURCE_MAX)
+    return -1;
+  return _default_distance[source];
 }
 
-static struct rib_node *
-_shrink (struct rib_node *n)
+/* compare the preference of two paths: <0 if a is preferred */
+static inline int
+_path_cmp (const struct rib_path *a, const struct rib_path *b)
 {
-  if (! n)
-    return NULL;
+  if (a->distance != b->distance)
+    return a->distance < b->distance ? -1 : 1;
+  if (a->metric != b->metric)
+    return a->metric < b->metric ? -1 : 1;
+  return 0;
+}
+
+static struct rib_path **
+_path_find (struct rib_node *n, int source, uint32_t peer)
+{
+  struct rib_path **pp;
 
-  n->left = _shrink (n->left);
-  n->right = _shrink (n->right);
+  for (pp = &n->paths; *pp; pp = &(*pp)->next)
+    if ((*pp)->source == source && (*pp)->peer == peer)
+      return pp;
+  return NULL;
+}
+
+/* insert behind the paths of the same preference (the older one wins) */
+static void
+_path_insert (struct rib_node *n, struct rib_path *p)
+{
+  struct rib_path **pp;
 
-  if (! n->left && ! n->right && ! n->valid)
+  for (pp = &n->paths; *pp && _path_cmp (*pp, p) <= 0; pp = &(*pp)->next)
+    ;
+  p->next = *pp;
+  *pp = p;
+}
+
+static inline int
+_contains (const int *arr, int len, int v)
+{
+  int i;
+
+  for (i = 0; i < len; i++)
+    if (arr[i] == v)
+      return 1;
+  return 0;
+}
+
+/*
+ * 候補リストの先頭からroute_idxを選択し直す.
+ * リストは常に優先度順なので, 走査は先頭の同じ優先度の経路のみ.
+ * 同じ優先度の経路が複数あればnexthop groupを使う. 新しいグループは
+ * 以前のグループのバケット割り当てを引き継ぐ (resilient).
+ * ノードは選択したnexthop idの参照を1つ持つ.
+ * returns 1 if the selected nexthop id has changed, or -1 if no group
+ * could be made (the node keeps its previous selection).
+ */
+static int
+_select_best (struct rib_tree *t, struct rib_node *n)
+{
+  int members[NHG_MAX_MEMBERS];
+  struct rib_path *p;
+  int id, old, num = 0;
+
+  for (p = n->paths; p && num < NHG_MAX_MEMBERS; p = p->next)
     {
-      free (n);
-      n = NULL;
-      return NULL;
+      if (num > 0 && _path_cmp (n->paths, p) != 0)
+        break;
+      if (NHG_IS_GROUP (p->route_idx))
+        {
+          /* a group from another RIB (ORTC) is used as is */
+          if (num == 0)
+            members[num++] = p->route_idx;
+          break;
+        }
+      if (! _contains (members, num, p->route_idx))
+        members[num++] = p->route_idx;
+    }
+
+  old = n->valid ? n->route_idx[0] : -1;
+  if (num > 1)
+    {
+      id = nhg_get (members, num, old);
+      if (id < 0)
+        return -1; // failed, not enough memory for the group
     }
   else
-    return n;
+    {
+      id = (num > 0) ? members[0] : -1;
+      if (id >= 0)
+        nhg_ref (id);
+    }
+  nhg_unref (old);
+
+  n->route_idx[0] = id;
+  n->num_routes = (id >= 0) ? 1 : 0;
+
+  if (n->num_routes > 0 && ! n->valid)
+    {
+      n->valid = 1;
+      t->num_prefixes++;
+    }
+  else if (n->num_routes == 0 && n->valid)
+    {
+      n->valid = 0;
+      t->num_prefixes--;
+    }
+  return id != old;
 }
 
-static struct rib_node *
-_delete (struct rib_node *n, const uint8_t *key, int keylen, int depth,
-         int idx, int *success)
+int
+rib_path_update (struct rib_tree *t, const uint8_t *key, int keylen,
+                 const struct rib_path *path, int *changed)
 {
+  struct rib_path **pp, *p, old = { NULL };
+  struct rib_node *n;
+  int replaced;
+
+  *changed = 0;
+  if (path->source < 0 || path->source >= RIB_SOURCE_MAX)
+    return -1;
+
+  n = _get_node (t, key, keylen);
   if (! n)
-    return NULL;
+    return -1; // failed, not enough memory
 
-  if (depth == keylen)
+  pp = _path_find (n, path->source, path->peer);
+  replaced = (pp != NULL);
+  if (replaced)
     {
-      if (n->valid)
+      p = *pp;
+      if (p->distance == path->distance && p->metric == path->metric
+          && p->route_idx == path->route_idx)
+        return 0; // duplicate
+      /* implicit withdraw of the previous path, unreferenced on success */
+      old = *p;
+      *pp = p->next;
+    }
+  else
+    {
+      p = malloc (sizeof (struct rib_path));
+      if (! p)
         {
-          /* delete route entry */
-          int found = 0;
-          for (int i = 0; i < n->num_routes; i++)
-            {
-              if (n->route_idx[i] == idx)
-                {
-#if MAX_ECMP_ENTRY > 1
-                  /* shift remaining entries to fill the gap */
-                  for (int j = i; j < n->num_routes - 1; j++)
-                    {
-                      n->route_idx[j] = n->route_idx[j + 1];
-                    }
-#endif
-                  /* clear the last slot */
-                  n->route_idx[n->num_routes - 1] = -1;
-                  n->num_routes--;
-                  *success = 0;
-                  found = 1;
-                  break;
-                }
-            }
+          /* a new leaf without routes must not remain in the tree */
+          if (! n->paths)
+            rib_path_withdraw (t, key, keylen, path, changed);
+          return -1; // failed, not enough memory
+        }
+      t->num_paths++;
+      t->mem_size += sizeof (struct rib_path);
+      mem_stat_alloc (MEM_RIB, sizeof (struct rib_path));
+    }
 
-          if (! found)
-            {
-              *success = -1;
-              return n;
-            }
+  p->source = path->source;
+  p->peer = path->peer;
+  p->distance = path->distance;
+  p->metric = path->metric;
+  p->route_idx = path->route_idx;
+  nhg_ref (p->route_idx);
+  _path_insert (n, p);
 
-          if (n->num_routes == 0)
-            {
-              memset (n->key, 0, sizeof (n->key));
-              n->keylen = 0;
-              n->valid = 0;
-              return _shrink (n);
-            }
-          return n;
+  *changed = _select_best (t, n);
+  if (*changed < 0)
+    {
+      /* no nexthop group for the new selection: undo the update */
+      *changed = 0;
+      pp = _path_find (n, p->source, p->peer);
+      *pp = p->next;
+      nhg_unref (p->route_idx);
+      if (replaced)
+        {
+          p->distance = old.distance;
+          p->metric = old.metric;
+          p->route_idx = old.route_idx;
+          _path_insert (n, p);
         }
       else
         {
-          *success = -1;
-          return NULL;
+          _release_path (t, p);
+          t->num_paths--;
+          t->mem_size -= sizeof (struct rib_path);
+          if (! n->paths)
+            rib_path_withdraw (t, key, keylen, path, changed);
         }
+      return -1; // failed, not enough memory
     }
-  else
+  if (replaced)
+    nhg_unref (old.route_idx);
+  return 0;
+}
+
+int
+rib_route_add (struct rib_tree *t, const uint8_t *key, int keylen, int idx)
+{
+  struct rib_path path = { NULL, RIB_SOURCE_STATIC, 0,
+                           _default_distance[RIB_SOURCE_STATIC], 0, idx };
+  int changed;
+
+  return rib_path_update (t, key, keylen, &path, &changed);
+}
+
+/* remove the node if it no longer has a route nor two children */
+static struct rib_node *
+_shrink (struct rib_tree *t, struct rib_node *n)
+{
+  struct rib_node *child;
+
+  if (n->valid || (n->left && n->right))
+    return n;
+
+  child = n->left ? n->left : n->right;
+  _delete_rib_node (t, n);
+  return child;
+}
+
+/*
+ * withdraw the path of (source, peer). path->route_idx must also match
+ * unless it is negative.
+ */
+int
+rib_path_withdraw (struct rib_tree *t, const uint8_t *key, int keylen,
+                   const struct rib_path *path, int *changed)
+{
+  struct rib_node **nodes[RIB_STACK_SIZE];
+  struct rib_node **slot, *n, *child;
+  struct rib_path **pp, *p;
+  int depth = 0;
+
+  *changed = 0;
+
+  /* 対象ノードまでの経路 (親からのポインタ) を記録 */
+  slot = &t->root;
+  while ((n = *slot) && n->keylen < keylen && _match (n->key, key, n->keylen))
     {
-      if (BIT_CHECK (key, depth))
-        n->right = _delete (n->right, key, keylen, depth + 1, idx, success);
-      else
-        n->left = _delete (n->left, key, keylen, depth + 1, idx, success);
-      return n;
+      nodes[depth++] = slot;
+      slot = _child (n, key);
     }
+
+  if (! n || n->keylen != keylen || ! _match (n->key, key, keylen))
+    return -1;
+
+  pp = _path_find (n, path->source, path->peer);
+  if (pp)
+    {
+      p = *pp;
+      if (path->route_idx >= 0 && p->route_idx != path->route_idx)
+        return -1;
+      *pp = p->next;
+      *changed = _select_best (t, n);
+      if (*changed < 0)
+        {
+          /* keep the path: the selection has not changed */
+          *pp = p;
+          *changed = 0;
+          return -1;
+        }
+      nhg_unref (p->route_idx);
+      _release_path (t, p);
+      t->num_paths--;
+      t->mem_size -= sizeof (struct rib_path);
+    }
+  else if (n->paths)
+    return -1;
+
+  /* 不要になったノードを下から順に取り除く */
+  nodes[depth++] = slot;
+  while (depth > 0)
+    {
+      slot = nodes[--depth];
+      n = *slot;
+      child = _shrink (t, n);
+      if (child == n)
+        break;
+      *slot = child;
+    }
+  return pp ? 0 : -1;
 }
 
 int
 rib_route_delete (struct rib_tree *t, const uint8_t *key, int keylen, int idx)
 {
-  int success = 0;
-  t->root = _delete (t->root, key, keylen, 0, idx, &success);
-  return success;
+  struct rib_path path = { NULL, RIB_SOURCE_STATIC, 0, 0, 0, idx };
+  int changed;
+
+  return rib_path_withdraw (t, key, keylen, &path, &changed);
+}
+
+/*
+ * Bulk load (空のRIBのみ).
+ * 経路を (key, keylen) の辞書順に基数ソートすると, 木のpre-order
+ * (祖先が先) に並ぶ. 順に1回だけ走査し, 木の右端の経路 (直前に追加した
+ * ノードまでのノード) をスタックに持って, 新しいプレフィックスが分岐する
+ * 位置に付け加える. 根から辿り直すことはない.
+ * ノードと経路は1つのブロックから連続して (pre-orderで) 確保し,
+ * ブロックは木と一緒に解放する.
+ */
+#define RIB_BULK_ALIGN(size) (((size) + 7) & ~(size_t) 7)
+
+static inline int
+_bulk_digit (const struct rib_bulk_entry *e, int pass, int key_bytes)
+{
+  return pass == key_bytes ? e->keylen : e->key[pass];
+}
+
+/* stable LSD radix sort by (key, keylen) */
+static int
+_bulk_sort (struct rib_bulk_entry *routes, int num, int key_bytes)
+{
+  struct rib_bulk_entry *tmp, *src = routes, *dst, *swap;
+  uint32_t count[256], sum, c;
+  int pass, i;
+
+  tmp = malloc (num * sizeof (struct rib_bulk_entry));
+  if (! tmp)
+    return -1;
+  dst = tmp;
+
+  /* the least significant digit (keylen) first, then the key bytes */
+  for (pass = key_bytes; pass >= 0; pass--)
+    {
+      memset (count, 0, sizeof (count));
+      for (i = 0; i < num; i++)
+        count[_bulk_digit (&src[i], pass, key_bytes)]++;
+      if (count[_bulk_digit (&src[0], pass, key_bytes)] == (uint32_t) num)
+        continue; // the same digit everywhere
+      for (sum = 0, i = 0; i < 256; i++)
+        {
+          c = count[i];
+          count[i] = sum;
+          sum += c;
+        }
+      for (i = 0; i < num; i++)
+        dst[count[_bulk_digit (&src[i], pass, key_bytes)]++] = src[i];
+      swap = src;
+      src = dst;
+      dst = swap;
+    }
+  if (src != routes)
+    memcpy (routes, src, num * sizeof (struct rib_bulk_entry));
+  free (tmp);
+  return 0;
 }
 
 static struct rib_node *
-_lookup (struct rib_node *n, struct rib_node *cand, const uint8_t *key,
-         int depth)
+_bulk_node (struct rib_tree *t, uint8_t **cur, const uint8_t *key,
+            int keylen)
 {
-  if (! n)
-    return cand;
+  struct rib_node *n = (struct rib_node *) *cur;
 
-  if (n->valid)
-    cand = n;
+  *cur += RIB_BULK_ALIGN (RIB_NODE_SIZE (keylen));
+  _init_rib_node (t, n, key, keylen);
+  return n;
+}
 
-  if (BIT_CHECK (key, depth))
-    return _lookup (n->right, cand, key, depth + 1);
-  else
-    return _lookup (n->left, cand, key, depth + 1);
+/* the static path of the prefix, as rib_route_add selects it */
+static void
+_bulk_route (struct rib_tree *t, uint8_t **cur, struct rib_node *n, int idx)
+{
+  struct rib_path *p = (struct rib_path *) *cur;
+
+  *cur += RIB_BULK_ALIGN (sizeof (struct rib_path));
+  p->next = NULL;
+  p->source = RIB_SOURCE_STATIC;
+  p->peer = 0;
+  p->distance = _default_distance[RIB_SOURCE_STATIC];
+  p->metric = 0;
+  p->route_idx = idx;
+  nhg_ref (idx); // the path
+  nhg_ref (idx); // the selected route
+  n->paths = p;
+  n->valid = 1;
+  n->num_routes = 1;
+  n->route_idx[0] = idx;
+  t->num_prefixes++;
+  t->num_paths++;
+  t->mem_size += sizeof (struct rib_path);
 }
 
-struct rib_node *
-rib_route_lookup (struct rib_tree *t, const uint8_t *key)
+/* bytes of the branching nodes that rib_bulk_load will create */
+static size_t
+_bulk_branch_size (const struct rib_bulk_entry *routes, int num)
 {
-  return _lookup (t->root, NULL, key, 0);
+  int stack[RIB_STACK_SIZE]; // keylens of the right edge
+  const struct rib_bulk_entry *prev, *e;
+  size_t size = 0;
+  int i, sp = 0, len;
+
+  for (i = 0; i < num; i++)
+    {
+      e = &routes[i];
+      prev = (i > 0) ? &routes[i - 1] : NULL;
+      if (prev
+          && ! (prev->keylen < e->keylen
+                && _match (prev->key, e->key, prev->keylen)))
+        {
+          len = _common_len (prev->key, e->key,
+                             prev->keylen < e->keylen ? prev->keylen
+                                                      : e->keylen);
+          while (sp > 0 && stack[sp - 1] > len)
+            sp--;
+          if (sp == 0 || stack[sp - 1] != len)
+            {
+              size += RIB_BULK_ALIGN (RIB_NODE_SIZE (len));
+              stack[sp++] = len;
+            }
+        }
+      stack[sp++] = e->keylen;
+    }
+  return size;
 }
 
-/* traverse RIB tree */
-static int
-_traverse (struct rib_node *n, rib_traverse_callback callback, void *arg)
+int
+rib_bulk_load (struct rib_tree *t, struct rib_bulk_entry *routes, int num)
 {
-  if (! n)
+  struct rib_node *stack[RIB_STACK_SIZE], *n, *new, *branch, *below;
+  struct rib_bulk_entry *e;
+  int maxlen = _addr_bits (t), key_bytes = _addr_bits (t) / 8;
+  int i, j, sp = 0, len;
+  size_t size;
+  uint8_t *cur;
+
+  if (t->root || t->bulk)
+    {
+      fprintf (stderr, "ERROR: rib_bulk_load: the RIB is not empty\n");
+      return -1;
+    }
+  if (num <= 0)
     return 0;
 
-  /* process current node if valid */
-  if (n->valid && n->num_routes != 0 && callback)
+  for (i = 0; i < num; i++)
     {
-      if (callback (n, arg) != 0)
-        return -1;
+      e = &routes[i];
+      if (e->keylen < 0 || e->keylen > maxlen || e->route_idx < 0)
+        {
+          fprintf (stderr, "ERROR: rib_bulk_load: invalid route /%d %d\n",
+                   e->keylen, e->route_idx);
+          return -1;
+        }
+      if (e->keylen & 7)
+        e->key[e->keylen >> 3] &= _mask[e->keylen & 7];
+      if (KEY_SIZE (e->keylen) < (int) sizeof (e->key))
+        memset (&e->key[KEY_SIZE (e->keylen)], 0,
+                sizeof (e->key) - KEY_SIZE (e->keylen));
     }
 
-  if (_traverse (n->left, callback, arg) != 0)
+  if (_bulk_sort (routes, num, key_bytes) != 0)
     return -1;
 
-  if (_traverse (n->right, callback, arg) != 0)
+  /* the same prefix: the last one wins, as with rib_route_add */
+  for (i = 0, j = 0; i < num; i++)
+    {
+      if (j > 0 && routes[j - 1].keylen == routes[i].keylen
+          && memcmp (routes[j - 1].key, routes[i].key, key_bytes) == 0)
+        routes[j - 1] = routes[i];
+      else
+        routes[j++] = routes[i];
+    }
+  num = j;
+
+  /* each prefix, its path and the branching nodes */
+  size = _bulk_branch_size (routes, num);
+  for (i = 0; i < num; i++)
+    size += RIB_BULK_ALIGN (RIB_NODE_SIZE (routes[i].keylen))
+            + RIB_BULK_ALIGN (sizeof (struct rib_path));
+  t->bulk = malloc (size);
+  if (! t->bulk)
     return -1;
+  t->bulk_size = size;
+  mem_stat_alloc (MEM_RIB, size);
+  cur = t->bulk;
+
+  for (i = 0; i < num; i++)
+    {
+      e = &routes[i];
+      new = _bulk_node (t, &cur, e->key, e->keylen);
+      _bulk_route (t, &cur, new, e->route_idx);
+
+      if (sp == 0)
+        {
+          t->root = new;
+          stack[sp++] = new;
+          continue;
+        }
+
+      /* a more specific prefix of the last node */
+      n = stack[sp - 1];
+      if (n->keylen < e->keylen && _match (n->key, e->key, n->keylen))
+        {
+          *_child (n, e->key) = new;
+          stack[sp++] = new;
+          continue;
+        }
+
+      /*
+       * the prefix branches off the right edge at len (it sorts after the
+       * last node, so it is not its ancestor). below: the top of the
+       * finished subtree, n: its parent (at most len bits).
+       */
+      len = _common_len (n->key, e->key,
+                         n->keylen < e->keylen ? n->keylen : e->keylen);
+      below = NULL;
+      while (sp > 0 && stack[sp - 1]->keylen > len)
+        below = stack[--sp];
+      n = sp > 0 ? stack[sp - 1] : NULL;
+
+      if (n && n->keylen == len)
+        *_child (n, e->key) = new;
+      else
+        {
+          branch = _bulk_node (t, &cur, e->key, len);
+          *_child (branch, below->key) = below;
+          *_child (branch, e->key) = new;
+          if (n)
+            *_child (n, e->key) = branch;
+          else
+            t->root = branch;
+          stack[sp++] = branch;
+        }
+      stack[sp++] = new;
+    }
+  return 0;
+}
+
+struct rib_node *
+rib_route_lookup (struct rib_tree *t, const uint8_t *key)
+{
+  struct rib_node *n, *cand = NULL;
+  int maxlen = _addr_bits (t);
+
+  n = t->root;
+  while (n && _match (n->key, key, n->keylen))
+    {
+      if (n->valid)
+        cand = n;
+      if (n->keylen >= maxlen)
+        break;
+      n = *_child (n, key);
+    }
+  return cand;
+}
+
+struct rib_node *
+rib_route_lookup_exact (struct rib_tree *t, const uint8_t *key, int keylen)
+{
+  struct rib_node *n = t->root;
+
+  while (n && n->keylen < keylen && _match (n->key, key, n->keylen))
+    n = *_child (n, key);
+
+  if (n && n->valid && n->keylen == keylen && _match (n->key, key, keylen))
+    return n;
+  return NULL;
+}
+
+/* traverse RIB tree (pre-order: a prefix comes before its more specifics) */
+static int
+_traverse (struct rib_node *n, rib_traverse_callback callback, void *arg)
+{
+  struct rib_node *stack[RIB_STACK_SIZE];
+  int sp = 0;
+
+  /* pre-order: 短いプレフィックスが先に処理される */
+  if (n)
+    stack[sp++] = n;
+  while (sp > 0)
+    {
+      n = stack[--sp];
+
+      /* process current node if valid */
+      if (n->valid && n->num_routes != 0 && callback)
+        {
+          if (callback (n, arg) != 0)
+            return -1;
+        }
+
+      if (n->right)
+        stack[sp++] = n->right;
+      if (n->left)
+        stack[sp++] = n->left;
+    }
 
   return 0;
 }
@@ -299,6 +878,52 @@ rebuild_fib_from_rib (struct rib_tree *rib_tree, struct fib_tree *fib_tree)
   return rib_traverse (rib_tree, _add_to_fib, fib_tree);
 }
 
+/*
+ * update FIB for a prefix changed in the RIB: the prefix's range is
+ * replaced by its own route (or the covering route if it was withdrawn),
+ * then the more specific routes inside the range are added again.
+ */
+int
+update_fib_from_rib (struct rib_tree *rib_tree, struct fib_tree *fib_tree,
+                     const uint8_t *key, int keylen)
+{
+  struct rib_node *n, *cover = NULL;
+  int ret;
+
+  n = rib_tree->root;
+  while (n && n->keylen < keylen && _match (n->key, key, n->keylen))
+    {
+      if (n->valid && n->num_routes != 0)
+        cover = n;
+      n = *_child (n, key);
+    }
+
+  /* n: the top of the subtree inside the prefix, if any */
+  if (n && ! (n->keylen >= keylen && _match (n->key, key, keylen)))
+    n = NULL;
+
+  if (n && n->keylen == keylen && n->valid && n->num_routes != 0)
+    cover = n;
+
+  ret = fib_route_replace (fib_tree, key, keylen,
+                           cover ? cover->route_idx : NULL);
+  if (ret == 0 && n)
+    {
+      if (n->keylen == keylen)
+        {
+          if (_traverse (n->left, _add_to_fib, fib_tree) != 0
+              || _traverse (n->right, _add_to_fib, fib_tree) != 0)
+            ret = -1;
+        }
+      else if (_traverse (n, _add_to_fib, fib_tree) != 0)
+        ret = -1;
+    }
+
+  if (ret == 0 && fib_tree->compact)
+    fib_compact_prefix (fib_tree, key, keylen);
+  return ret;
+}
+
 /* callback for show ip route */
 // int
 // rib_show_route (struct rib_node *n, void *arg)
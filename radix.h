@@ -3,16 +3,51 @@
 
 #include "fib.h"
 
+/*
+ * 経路上のノードはkeylenが単調増加するので, 深さは最大128+1.
+ * 走査・削除はこのサイズの固定スタックで再帰せずに行う.
+ */
+#define RIB_STACK_SIZE (128 + 2)
+
 /* RIB node management */
 struct rib_tree *rib_new (struct rib_tree *t);
 void rib_free (struct rib_tree *t);
 
 /* RIB operations */
+/*
+ * 経路元ごとの候補経路の追加/更新と削除.
+ * *changed は選択された経路 (route_idx) が変わった場合に1となり,
+ * その場合のみFIBを更新 (update_fib_from_rib) すればよい.
+ */
+int rib_path_update (struct rib_tree *t, const uint8_t *key, int keylen,
+                     const struct rib_path *path, int *changed);
+int rib_path_withdraw (struct rib_tree *t, const uint8_t *key, int keylen,
+                       const struct rib_path *path, int *changed);
+int rib_source_distance (int source);
+
+/* the static path of the prefix (source RIB_SOURCE_STATIC, peer 0) */
 int rib_route_add (struct rib_tree *t, const uint8_t *key, int keylen,
                    int idx);
 int rib_route_delete (struct rib_tree *t, const uint8_t *key, int keylen,
                       int idx);
+
+/*
+ * bulk load of an empty RIB: each route becomes the static path of its
+ * prefix, as rib_route_add. the same prefix twice: the later one wins.
+ * routes is sorted (and the keys masked) in place.
+ */
+struct rib_bulk_entry
+{
+  uint8_t key[16];
+  int keylen;
+  int route_idx;
+};
+int rib_bulk_load (struct rib_tree *t, struct rib_bulk_entry *routes,
+                   int num);
+
 struct rib_node *rib_route_lookup (struct rib_tree *t, const uint8_t *key);
+struct rib_node *rib_route_lookup_exact (struct rib_tree *t,
+                                         const uint8_t *key, int keylen);
 
 /* RIB traversal */
 typedef int (*rib_traverse_callback) (struct rib_node *n, void *arg);
@@ -22,6 +57,8 @@ int rib_traverse (struct rib_tree *t, rib_traverse_callback callback,
 /* FIB rebuild from RIB */
 int rebuild_fib_from_rib (struct rib_tree *rib_tree,
                           struct fib_tree *fib_tree);
+int update_fib_from_rib (struct rib_tree *rib_tree, struct fib_tree *fib_tree,
+                         const uint8_t *key, int keylen);
 
 // int rib_show_route (struct rib_node *n, void *arg);
 
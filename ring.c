@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+static uint32_t
+_round_pow2 (uint32_t n)
+{
+  uint32_t size = 1;
+
+  while (size < n)
+    size <<= 1;
+  return size;
+}
+
+static void **
+_alloc_slots (uint32_t capacity, uint32_t *mask)
+{
+  void **slots;
+
+  if (capacity == 0 || capacity > 0x80000000U)
+    {
+      fprintf (stderr, "ERROR: invalid ring capacity %u\n", capacity);
+      return NULL;
+    }
+  capacity = _round_pow2 (capacity);
+  slots = calloc (capacity, sizeof (void *));
+  if (! slots)
+    return NULL;
+  *mask = capacity - 1;
+  return slots;
+}
+
+int
+spsc_ring_init (struct spsc_ring *r, uint32_t capacity)
+{
+  memset (r, 0, sizeof (struct spsc_ring));
+  r->slots = _alloc_slots (capacity, &r->mask);
+  return r->slots ? 0 : -1;
+}
+
+void
+spsc_ring_free (struct spsc_ring *r)
+{
+  free (r->slots);
+  r->slots = NULL;
+}
+
+int
+mpmc_ring_init (struct mpmc_ring *r, uint32_t capacity)
+{
+  memset (r, 0, sizeof (struct mpmc_ring));
+  r->slots = _alloc_slots (capacity, &r->mask);
+  return r->slots ? 0 : -1;
+}
+
+void
+mpmc_ring_free (struct mpmc_ring *r)
+{
+  free (r->slots);
+  r->slots = NULL;
+}
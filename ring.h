@@ -0,0 +1,201 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <sched.h>
+
+/*
+ * 固定長のlock-freeリングバッファ (スレッド間の受け渡し用).
+ * queue.c と違い伸長せず, 満杯ならenqueueが失敗する.
+ * 要素は void * (NULLは入れられない). 容量は2のべき乗に切り上げる.
+ * - spsc_ring: 生産者1スレッド, 消費者1スレッド.
+ *   tailは生産者だけが, headは消費者だけが書く. それぞれ別のキャッシュ
+ *   ラインに置き, 相手の位置は前回読んだ値 (cache) を使って, 足りない
+ *   時だけ読み直す.
+ * - mpmc_ring: 生産者, 消費者とも複数スレッド.
+ *   生産者はprod_headをCASで進めて区間を確保し, 書き込んだ後,
+ *   先に確保した生産者を待ってprod_tailを進める. 消費者も同様.
+ *   確保した区間の書き込み中に止まったスレッドがいると, 後続は
+ *   tailの更新を待つ.
+ * - *_burst は最大n個をまとめて入れる/取り出し, 実際の個数を返す.
+ *   位置の更新 (アトミック操作) が1回で済む.
+ */
+
+#define RING_CACHE_LINE 64
+#define RING_SPIN       64 // spins before yielding the CPU
+
+struct spsc_ring
+{
+  /* producer */
+  uint32_t tail __attribute__ ((aligned (RING_CACHE_LINE)));
+  uint32_t head_cache;
+  /* consumer */
+  uint32_t head __attribute__ ((aligned (RING_CACHE_LINE)));
+  uint32_t tail_cache;
+  /* read only */
+  uint32_t mask __attribute__ ((aligned (RING_CACHE_LINE)));
+  void **slots;
+};
+
+struct mpmc_ring
+{
+  uint32_t prod_head __attribute__ ((aligned (RING_CACHE_LINE)));
+  uint32_t prod_tail;
+  uint32_t cons_head __attribute__ ((aligned (RING_CACHE_LINE)));
+  uint32_t cons_tail;
+  uint32_t mask __attribute__ ((aligned (RING_CACHE_LINE)));
+  void **slots;
+};
+
+int spsc_ring_init (struct spsc_ring *r, uint32_t capacity);
+void spsc_ring_free (struct spsc_ring *r);
+int mpmc_ring_init (struct mpmc_ring *r, uint32_t capacity);
+void mpmc_ring_free (struct mpmc_ring *r);
+
+static inline void
+_ring_pause (int *spin)
+{
+  if ((*spin)++ < RING_SPIN)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause ();
+#endif
+    }
+  else
+    sched_yield ();
+}
+
+/* -------------------------------------------
+ * SPSC
+ * ------------------------------------------- */
+
+/* returns up to n, the number of entries enqueued */
+static inline uint32_t
+spsc_ring_enqueue_burst (struct spsc_ring *r, void *const *data, uint32_t n)
+{
+  uint32_t tail = r->tail, room, i;
+
+  room = r->mask + 1 - (tail - r->head_cache);
+  if (room < n)
+    {
+      r->head_cache = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+      room = r->mask + 1 - (tail - r->head_cache);
+      if (room < n)
+        n = room;
+    }
+  for (i = 0; i < n; i++)
+    r->slots[(tail + i) & r->mask] = data[i];
+  __atomic_store_n (&r->tail, tail + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+/* returns up to n, the number of entries dequeued */
+static inline uint32_t
+spsc_ring_dequeue_burst (struct spsc_ring *r, void **data, uint32_t n)
+{
+  uint32_t head = r->head, used, i;
+
+  used = r->tail_cache - head;
+  if (used < n)
+    {
+      r->tail_cache = __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE);
+      used = r->tail_cache - head;
+      if (used < n)
+        n = used;
+    }
+  for (i = 0; i < n; i++)
+    data[i] = r->slots[(head + i) & r->mask];
+  __atomic_store_n (&r->head, head + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+/* returns 0, or -1 if the ring is full */
+static inline int
+spsc_ring_enqueue (struct spsc_ring *r, void *data)
+{
+  return spsc_ring_enqueue_burst (r, &data, 1) == 1 ? 0 : -1;
+}
+
+/* returns NULL if the ring is empty */
+static inline void *
+spsc_ring_dequeue (struct spsc_ring *r)
+{
+  void *data;
+
+  return spsc_ring_dequeue_burst (r, &data, 1) == 1 ? data : NULL;
+}
+
+/* -------------------------------------------
+ * MPMC
+ * ------------------------------------------- */
+
+/* wait for the threads that reserved before us, then publish */
+static inline void
+_mpmc_publish (uint32_t *tail, uint32_t old, uint32_t new)
+{
+  int spin = 0;
+
+  while (__atomic_load_n (tail, __ATOMIC_RELAXED) != old)
+    _ring_pause (&spin);
+  __atomic_store_n (tail, new, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t
+mpmc_ring_enqueue_burst (struct mpmc_ring *r, void *const *data,
+                         uint32_t max)
+{
+  uint32_t head, room, n, i;
+
+  head = __atomic_load_n (&r->prod_head, __ATOMIC_RELAXED);
+  do
+    {
+      room = r->mask + 1
+             - (head - __atomic_load_n (&r->cons_tail, __ATOMIC_ACQUIRE));
+      n = room < max ? room : max;
+      if (n == 0)
+        return 0;
+    }
+  while (! __atomic_compare_exchange_n (&r->prod_head, &head, head + n, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  for (i = 0; i < n; i++)
+    r->slots[(head + i) & r->mask] = data[i];
+  _mpmc_publish (&r->prod_tail, head, head + n);
+  return n;
+}
+
+static inline uint32_t
+mpmc_ring_dequeue_burst (struct mpmc_ring *r, void **data, uint32_t max)
+{
+  uint32_t head, used, n, i;
+
+  head = __atomic_load_n (&r->cons_head, __ATOMIC_RELAXED);
+  do
+    {
+      used = __atomic_load_n (&r->prod_tail, __ATOMIC_ACQUIRE) - head;
+      n = used < max ? used : max;
+      if (n == 0)
+        return 0;
+    }
+  while (! __atomic_compare_exchange_n (&r->cons_head, &head, head + n, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  for (i = 0; i < n; i++)
+    data[i] = r->slots[(head + i) & r->mask];
+  _mpmc_publish (&r->cons_tail, head, head + n);
+  return n;
+}
+
+static inline int
+mpmc_ring_enqueue (struct mpmc_ring *r, void *data)
+{
+  return mpmc_ring_enqueue_burst (r, &data, 1) == 1 ? 0 : -1;
+}
+
+static inline void *
+mpmc_ring_dequeue (struct mpmc_ring *r)
+{
+  void *data;
+
+  return mpmc_ring_dequeue_burst (r, &data, 1) == 1 ? data : NULL;
+}
+
+#endif /* RING_H */
@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,9 +8,8 @@
 #include <sys/socket.h>
 
 #include "fib.h"
-
-// static struct rib_tree *rib_tree_master = NULL;
-struct rib_tree *rib_tree_master[ROUTE_TREE_SIZE];
+#include "route_entry.h"
+#include "memstat.h"
 
 uint32_t
 jenkins_hash (uint8_t *key, int key_len)
@@ -41,64 +41,508 @@ route_table_jenkins_hash (uint8_t *nexthop, uint32_t oif)
   uint32_t oif_be = htonl (oif); // remove dpdk library
   memcpy (data + 16, &oif_be, sizeof (oif_be));
 
-  return jenkins_hash (data, sizeof (data)) & ROUTE_TABLE_HASH_MASK;
+  return jenkins_hash (data, sizeof (data));
+}
+
+/*
+ * word-at-a-time hashes of the 20-byte key (16-byte nexthop + oif).
+ * the key is read as two 64-bit words and the oif instead of byte by byte,
+ * and the result goes through the MurmurHash3 finalizer so that the low
+ * bits used for the table position depend on every input bit.
+ */
+static inline uint32_t
+_fmix32 (uint32_t h)
+{
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+static inline uint64_t
+_rotl64 (uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint32_t
+_hash_word (const uint8_t *nexthop, uint32_t oif)
+{
+  uint64_t w0, w1, h;
+
+  memcpy (&w0, nexthop, 8);
+  memcpy (&w1, nexthop + 8, 8);
+
+  h = (uint64_t) oif * 0x9e3779b97f4a7c15ULL;
+  h ^= w0 * 0x87c37b91114253d5ULL;
+  h = _rotl64 (h, 31) * 0x4cf5ad432745937fULL;
+  h ^= w1 * 0x87c37b91114253d5ULL;
+  h = _rotl64 (h, 31) * 0x4cf5ad432745937fULL;
+  return _fmix32 ((uint32_t) (h ^ (h >> 32)));
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__ ((target ("sse4.2"))) static uint32_t
+_hash_crc32c (const uint8_t *nexthop, uint32_t oif)
+{
+  uint64_t w0, w1, h;
+
+  memcpy (&w0, nexthop, 8);
+  memcpy (&w1, nexthop + 8, 8);
+
+  h = _mm_crc32_u64 (0xffffffff, w0);
+  h = _mm_crc32_u64 (h, w1);
+  h = _mm_crc32_u32 ((uint32_t) h, oif);
+  return _fmix32 ((uint32_t) h);
+}
+#endif /* __x86_64__ */
+
+int
+route_table_hash_supported (int type)
+{
+  switch (type)
+    {
+    case ROUTE_HASH_DEFAULT:
+    case ROUTE_HASH_JENKINS:
+    case ROUTE_HASH_WORD:
+      return 1;
+#if defined(__x86_64__)
+    case ROUTE_HASH_CRC32C:
+      return __builtin_cpu_supports ("sse4.2") ? 1 : 0;
+#endif
+    default:
+      return 0;
+    }
+}
+
+const char *
+route_table_hash_name (int type)
+{
+  static const char *names[ROUTE_HASH_TYPE_MAX] = {
+    "default", "jenkins", "word", "crc32c",
+  };
+
+  if (type < 0 || type >= ROUTE_HASH_TYPE_MAX)
+    return "unknown";
+  return names[type];
+}
+
+static int
+_default_hash (void)
+{
+  static int type = ROUTE_HASH_DEFAULT;
+
+  if (type == ROUTE_HASH_DEFAULT)
+    type = route_table_hash_supported (ROUTE_HASH_CRC32C) ? ROUTE_HASH_CRC32C
+                                                          : ROUTE_HASH_WORD;
+  return type;
+}
+
+/* nexthop: 16 bytes (IPv4 zero-padded) */
+uint32_t
+route_table_hash (int type, const uint8_t *nexthop, uint32_t oif)
+{
+  switch (type)
+    {
+#if defined(__x86_64__)
+    case ROUTE_HASH_CRC32C:
+      return _hash_crc32c (nexthop, oif);
+#endif
+    case ROUTE_HASH_WORD:
+      return _hash_word (nexthop, oif);
+    case ROUTE_HASH_JENKINS:
+      return route_table_jenkins_hash ((uint8_t *) nexthop, oif);
+    default:
+      return route_table_hash (_default_hash (), nexthop, oif);
+    }
+}
+
+/* choose the hash of an empty table */
+int
+route_table_set_hash (struct route_table *t, int type)
+{
+  if (t->count > 0 || ! route_table_hash_supported (type))
+    return -1;
+  t->hash_type = (type == ROUTE_HASH_DEFAULT) ? _default_hash () : type;
+  return 0;
+}
+
+/*
+ * nexthop table.
+ * - エントリはファミリごとのプールにチャンク単位で確保する. route_idxは
+ *   プール内の番号なので, テーブルが拡張されてもエントリは移動しない.
+ *   IPv4のエントリはnexthopを4バイトのみ持つ.
+ * - 検索はRobin Hood hashingのインデックス (hash, route_idx) で行う.
+ *   負荷率がROUTE_TABLE_MAX_LOADを超えたら倍のサイズで再構築する.
+ * - 参照カウント: route_table_add_entry は参照を1つ持ったエントリを返す.
+ *   参照が0になったエントリはインデックスから削除し (backward shift,
+ *   tombstoneなし), プールで再利用する.
+ */
+
+static inline int
+_family_index (int family)
+{
+  return (family == AF_INET6) ? 1 : 0;
+}
+
+static inline int
+_addr_len (int family)
+{
+  return (family == AF_INET6) ? 16 : 4;
+}
+
+static uint32_t
+_hash (const struct route_table *t, int family, const uint8_t *nexthop,
+       uint32_t oif)
+{
+  uint8_t key[16];
+
+  memset (key, 0, sizeof (key));
+  memcpy (key, nexthop, _addr_len (family));
+  return route_table_hash (t->hash_type, key, oif) ^ (uint32_t) family;
+}
+
+static int
+_match (const struct route_table *t, int idx, int family,
+        const uint8_t *nexthop, uint32_t oif)
+{
+  const struct route_entry *e;
+
+  if (_family_index (family) != ((idx & ROUTE_IDX_INET6) ? 1 : 0))
+    return 0;
+  e = route_table_entry (t, idx);
+  return e->oif == oif && memcmp (e->nexthop, nexthop, _addr_len (family)) == 0;
+}
+
+/* distance of the slot from the home position of its hash */
+static inline uint32_t
+_probe_dist (const struct route_table *t, uint32_t pos)
+{
+  return (pos - (t->slots[pos].hash & (t->capacity - 1))) & (t->capacity - 1);
+}
+
+/* returns the slot position of the entry, or -1 */
+static int64_t
+_find_slot (const struct route_table *t, uint32_t hash, int family,
+            const uint8_t *nexthop, uint32_t oif)
+{
+  uint32_t pos, dist;
+
+  if (t->capacity == 0)
+    return -1;
+
+  pos = hash & (t->capacity - 1);
+  for (dist = 0;; dist++)
+    {
+      if (t->slots[pos].idx < 0 || _probe_dist (t, pos) < dist)
+        return -1; // an entry would have been placed by now
+      if (t->slots[pos].hash == hash
+          && _match (t, t->slots[pos].idx, family, nexthop, oif))
+        return pos;
+      pos = (pos + 1) & (t->capacity - 1);
+    }
+}
+
+/* insert into the index, taking the slot from richer entries */
+static void
+_insert_slot (struct route_table *t, struct route_slot cur)
+{
+  struct route_slot tmp;
+  uint32_t pos, dist, d;
+
+  pos = cur.hash & (t->capacity - 1);
+  for (dist = 0;; dist++)
+    {
+      if (t->slots[pos].idx < 0)
+        {
+          t->slots[pos] = cur;
+          return;
+        }
+      d = _probe_dist (t, pos);
+      if (d < dist)
+        {
+          tmp = t->slots[pos];
+          t->slots[pos] = cur;
+          cur = tmp;
+          dist = d;
+        }
+      pos = (pos + 1) & (t->capacity - 1);
+    }
+}
+
+static int
+_resize (struct route_table *t, uint32_t capacity)
+{
+  struct route_slot *old = t->slots;
+  uint32_t i, old_capacity = t->capacity;
+
+  t->slots = malloc (capacity * sizeof (struct route_slot));
+  if (! t->slots)
+    {
+      t->slots = old;
+      return -1;
+    }
+  mem_stat_alloc (MEM_ROUTE_TABLE, capacity * sizeof (struct route_slot));
+  for (i = 0; i < capacity; i++)
+    t->slots[i].idx = -1;
+  t->capacity = capacity;
+
+  for (i = 0; i < old_capacity; i++)
+    if (old[i].idx >= 0)
+      _insert_slot (t, old[i]);
+  if (old)
+    mem_stat_free (MEM_ROUTE_TABLE, old_capacity * sizeof (struct route_slot));
+  free (old);
+  return 0;
+}
+
+/* remove the slot and shift the following entries back */
+static void
+_delete_slot (struct route_table *t, uint32_t pos)
+{
+  uint32_t next;
+
+  for (;;)
+    {
+      next = (pos + 1) & (t->capacity - 1);
+      if (t->slots[next].idx < 0 || _probe_dist (t, next) == 0)
+        break;
+      t->slots[pos] = t->slots[next];
+      pos = next;
+    }
+  t->slots[pos].idx = -1;
+}
+
+static int
+_pool_alloc (struct route_pool *pool, int family)
+{
+  uint8_t **chunks;
+  int i;
+
+  if (pool->num_free > 0)
+    return pool->free_list[--pool->num_free];
+
+  if (pool->entry_size == 0)
+    pool->entry_size = sizeof (struct route_entry) + _addr_len (family);
+
+  i = pool->num_used;
+  if (i > ROUTE_IDX_MASK)
+    return -1;
+  if ((i >> ROUTE_POOL_CHUNK_SHIFT) == pool->num_chunks)
+    {
+      chunks = realloc (pool->chunks,
+                        (pool->num_chunks + 1) * sizeof (uint8_t *));
+      if (! chunks)
+        return -1;
+      pool->chunks = chunks;
+      mem_stat_realloc (MEM_ROUTE_TABLE,
+                        pool->num_chunks * sizeof (uint8_t *),
+                        (pool->num_chunks + 1) * sizeof (uint8_t *));
+      pool->chunks[pool->num_chunks] =
+          malloc ((size_t) pool->entry_size << ROUTE_POOL_CHUNK_SHIFT);
+      if (! pool->chunks[pool->num_chunks])
+        return -1;
+      mem_stat_alloc (MEM_ROUTE_TABLE,
+                      (size_t) pool->entry_size << ROUTE_POOL_CHUNK_SHIFT);
+      pool->num_chunks++;
+    }
+  pool->num_used++;
+  return i;
+}
+
+static void
+_pool_free (struct route_pool *pool, int i)
+{
+  int *list;
+
+  if (pool->num_free == pool->free_size)
+    {
+      list = realloc (pool->free_list,
+                      (pool->free_size ? pool->free_size * 2 : 64)
+                          * sizeof (int));
+      if (! list)
+        return; // leak the entry rather than fail
+      pool->free_list = list;
+      mem_stat_realloc (MEM_ROUTE_TABLE, pool->free_size * sizeof (int),
+                        (pool->free_size ? pool->free_size * 2 : 64)
+                            * sizeof (int));
+      pool->free_size = pool->free_size ? pool->free_size * 2 : 64;
+    }
+  pool->free_list[pool->num_free++] = i;
 }
 
 int
-route_table_add_entry (struct route_entry *route_table,
+route_table_add_entry (struct route_table *t,
                        int family, uint8_t *nexthop, uint32_t oif)
 {
-  uint32_t hash, offset;
+  struct route_entry *e;
+  struct route_slot slot;
+  uint32_t hash;
+  int64_t pos;
+  int i, idx;
 
-  hash = route_table_jenkins_hash (nexthop, oif);
-  offset = hash;
+  if (t->hash_type == ROUTE_HASH_DEFAULT)
+    t->hash_type = _default_hash ();
+  hash = _hash (t, family, nexthop, oif);
+  pos = _find_slot (t, hash, family, nexthop, oif);
+  if (pos >= 0)
+    {
+      route_table_entry (t, t->slots[pos].idx)->ref_count++;
+      return t->slots[pos].idx;
+    }
 
-  while (route_table[offset].family != 0)
+  /* grow the index before it gets too crowded */
+  if ((uint64_t) (t->count + 1) * 100
+      > (uint64_t) t->capacity * ROUTE_TABLE_MAX_LOAD)
     {
-      /* check if entry already exists */
-      if (route_table[offset].family == family &&
-          route_table[offset].oif == oif &&
-          memcmp (route_table[offset].nexthop, nexthop, 16) == 0)
-        return offset;
-
-      /* linear probing for collision resolution */
-      ++offset;
-      if (offset >= ROUTE_TABLE_SIZE)
-        offset = 0;
-      if (offset == hash)
+      if (_resize (t, t->capacity ? t->capacity * 2 : ROUTE_TABLE_MIN_SIZE)
+          != 0)
         return -1;
     }
 
+  i = _pool_alloc (&t->pool[_family_index (family)], family);
+  if (i < 0)
+    return -1;
+  idx = (family == AF_INET6) ? (ROUTE_IDX_INET6 | i) : i;
+
   /* add new entry */
-  route_table[offset].family = family;
-  route_table[offset].oif = oif;
-  memcpy (route_table[offset].nexthop, nexthop, 16);
+  e = route_table_entry (t, idx);
+  e->ref_count = 1;
+  e->oif = oif;
+  memcpy (e->nexthop, nexthop, _addr_len (family));
+
+  slot.hash = hash;
+  slot.idx = idx;
+  _insert_slot (t, slot);
+  t->count++;
+  return idx;
+}
 
-  return offset;
+void
+route_table_ref (struct route_table *t, int idx)
+{
+  if (idx >= 0)
+    route_table_entry (t, idx)->ref_count++;
+}
+
+void
+route_table_unref (struct route_table *t, int idx)
+{
+  struct route_entry *e;
+  int family;
+  int64_t pos;
+
+  if (idx < 0)
+    return;
+  e = route_table_entry (t, idx);
+  if (e->ref_count <= 0)
+    {
+      /* a double unref: the entry may already be reused */
+      fprintf (stderr, "ERROR: route_table_unref of unreferenced entry %#x\n",
+               idx);
+      return;
+    }
+  if (--e->ref_count > 0)
+    return;
+
+  family = (idx & ROUTE_IDX_INET6) ? AF_INET6 : AF_INET;
+  pos = _find_slot (t, _hash (t, family, e->nexthop, e->oif), family,
+                    e->nexthop, e->oif);
+  if (pos >= 0)
+    _delete_slot (t, pos);
+  _pool_free (&t->pool[_family_index (family)], idx & ROUTE_IDX_MASK);
+  t->count--;
+}
+
+/* number of live entries */
+int
+route_table_count (const struct route_table *t)
+{
+  return t->count;
 }
 
 int
-route_table_lookup_entry (const struct route_entry *route_table,
+route_table_lookup_entry (const struct route_table *t,
                           int family, uint8_t *nexthop, uint32_t oif)
 {
-  uint32_t hash, offset;
+  int64_t pos;
 
-  hash = route_table_jenkins_hash (nexthop, oif);
-  offset = hash;
+  pos = _find_slot (t, _hash (t, family, nexthop, oif), family, nexthop, oif);
+  return (pos >= 0) ? t->slots[pos].idx : -1;
+}
+
+void
+route_table_get_stats (const struct route_table *t,
+                       struct route_table_stats *st)
+{
+  uint64_t total = 0;
+  uint32_t pos, d;
+  int f;
 
-  while (route_table[offset].family != 0)
+  memset (st, 0, sizeof (struct route_table_stats));
+  st->capacity = t->capacity;
+  st->mem_size = (uint64_t) t->capacity * sizeof (struct route_slot);
+  for (f = 0; f < 2; f++)
     {
-      if (route_table[offset].family == family &&
-          route_table[offset].oif == oif &&
-          memcmp (route_table[offset].nexthop, nexthop, 16) == 0)
-        return offset;
-
-      ++offset;
-      if (offset >= ROUTE_TABLE_SIZE)
-        offset = 0;
-      if (offset == hash)
-        break;
+      st->entries[f] = t->pool[f].num_used - t->pool[f].num_free;
+      st->mem_size += (uint64_t) t->pool[f].num_chunks * t->pool[f].entry_size
+                      << ROUTE_POOL_CHUNK_SHIFT;
     }
 
-  return -1;
-}
\ No newline at end of file
+  for (pos = 0; pos < t->capacity; pos++)
+    {
+      if (t->slots[pos].idx < 0)
+        continue;
+      d = _probe_dist (t, pos) + 1;
+      total += d;
+      if (d > st->max_probe)
+        st->max_probe = d;
+    }
+  st->load_factor = t->capacity ? (double) t->count / t->capacity : 0.0;
+  st->avg_probe = t->count ? (double) total / t->count : 0.0;
+}
+
+void
+route_table_print_stats (const struct route_table *t)
+{
+  struct route_table_stats st;
+
+  route_table_get_stats (t, &st);
+  printf ("route table: %u entries (IPv4 %u, IPv6 %u), capacity %u, "
+          "load factor %.2f, probe length avg %.2f max %u, %" PRIu64
+          " bytes, hash %s\n",
+          st.entries[0] + st.entries[1], st.entries[0], st.entries[1],
+          st.capacity, st.load_factor, st.avg_probe, st.max_probe,
+          st.mem_size, route_table_hash_name (t->hash_type));
+}
+
+void
+route_table_free (struct route_table *t)
+{
+  int f, c;
+
+  for (f = 0; f < 2; f++)
+    {
+      for (c = 0; c < t->pool[f].num_chunks; c++)
+        {
+          free (t->pool[f].chunks[c]);
+          mem_stat_free (MEM_ROUTE_TABLE, (size_t) t->pool[f].entry_size
+                                              << ROUTE_POOL_CHUNK_SHIFT);
+        }
+      if (t->pool[f].chunks)
+        mem_stat_free (MEM_ROUTE_TABLE,
+                       t->pool[f].num_chunks * sizeof (uint8_t *));
+      free (t->pool[f].chunks);
+      if (t->pool[f].free_list)
+        mem_stat_free (MEM_ROUTE_TABLE, t->pool[f].free_size * sizeof (int));
+      free (t->pool[f].free_list);
+    }
+  if (t->slots)
+    mem_stat_free (MEM_ROUTE_TABLE, t->capacity * sizeof (struct route_slot));
+  free (t->slots);
+  memset (t, 0, sizeof (struct route_table));
+}
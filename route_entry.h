@@ -3,11 +3,74 @@
 
 #include "fib.h"
 
+/*
+ * route_idx: index of an entry in the pool of its family.
+ * IPv6 entries have ROUTE_IDX_INET6 set (below NHG_ID_FLAG).
+ */
+#define ROUTE_IDX_INET6         0x20000000
+#define ROUTE_IDX_MASK          (ROUTE_IDX_INET6 - 1)
+#define ROUTE_POOL_CHUNK_SHIFT  10 // 1024 entries per chunk
+#define ROUTE_POOL_CHUNK_MASK   ((1 << ROUTE_POOL_CHUNK_SHIFT) - 1)
+#define ROUTE_TABLE_MIN_SIZE    64
+#define ROUTE_TABLE_MAX_LOAD    85 // percent, grow beyond this
+
+/*
+ * hash of the (nexthop, oif) key. the default is CRC32C when the CPU has
+ * SSE4.2, otherwise the portable word-at-a-time hash.
+ */
+enum route_hash_type
+{
+  ROUTE_HASH_DEFAULT = 0,
+  ROUTE_HASH_JENKINS, // byte-wise one-at-a-time (the old hash)
+  ROUTE_HASH_WORD,    // 64-bit words, multiply and rotate
+  ROUTE_HASH_CRC32C,  // SSE4.2 crc32 instruction
+  ROUTE_HASH_TYPE_MAX
+};
+
+struct route_table_stats
+{
+  uint32_t entries[2]; // IPv4, IPv6
+  uint32_t capacity;
+  double load_factor;
+  double avg_probe; // average probe length of the entries
+  uint32_t max_probe;
+  uint64_t mem_size; // bytes
+};
+
 uint32_t jenkins_hash (uint8_t *key, int key_len);
 uint32_t route_table_jenkins_hash (uint8_t *nexthop, uint32_t oif);
-int route_table_add_entry (struct route_entry *entry,
+uint32_t route_table_hash (int type, const uint8_t *nexthop, uint32_t oif);
+int route_table_hash_supported (int type);
+const char *route_table_hash_name (int type);
+int route_table_set_hash (struct route_table *t, int type);
+int route_table_add_entry (struct route_table *t,
                            int family, uint8_t *nexthop, uint32_t oif);
-int route_table_lookup_entry (const struct route_entry *entry,
+void route_table_ref (struct route_table *t, int idx);
+void route_table_unref (struct route_table *t, int idx);
+int route_table_count (const struct route_table *t);
+int route_table_lookup_entry (const struct route_table *t,
                               int family, uint8_t *nexthop, uint32_t oif);
+void route_table_get_stats (const struct route_table *t,
+                            struct route_table_stats *st);
+void route_table_print_stats (const struct route_table *t);
+void route_table_free (struct route_table *t);
+
+static inline struct route_entry *
+route_table_entry (const struct route_table *t, int idx)
+{
+  const struct route_pool *pool = &t->pool[(idx & ROUTE_IDX_INET6) ? 1 : 0];
+  int i = idx & ROUTE_IDX_MASK;
+
+  return (struct route_entry *) (pool->chunks[i >> ROUTE_POOL_CHUNK_SHIFT]
+                                 + (i & ROUTE_POOL_CHUNK_MASK)
+                                       * pool->entry_size);
+}
+
+/* nexthop address of the entry (4 or 16 bytes, network order) */
+static inline uint8_t *
+route_table_nexthop (const struct route_table *t, int idx)
+{
+  return route_table_entry (t, idx)->nexthop;
+}
 
-#endif /* ROUT_ENTRY_H */
\ No newline at end of file
+#endif /* ROUT_ENTRY_H */
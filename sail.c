@@ -0,0 +1,187 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "sail.h"
+#include "radix.h"
+#include "nexthop_group.h"
+
+struct sail *
+sail_new (struct sail *t)
+{
+  if (! t)
+    {
+      t = malloc (sizeof (struct sail));
+      if (! t)
+        return NULL;
+    }
+  memset (t, 0, sizeof (struct sail));
+  return t;
+}
+
+static void
+_clear (struct sail *t)
+{
+  uint32_t i;
+
+  for (i = 0; i < t->num_prefixes; i++)
+    nhg_unref (t->ids[i]);
+  free (t->ids);
+  free (t->l16);
+  free (t->l24);
+  free (t->l32);
+  memset (t, 0, sizeof (struct sail));
+}
+
+void
+sail_free (struct sail *t)
+{
+  if (t)
+    {
+      _clear (t);
+      free (t);
+    }
+}
+
+uint64_t
+sail_mem_size (const struct sail *t)
+{
+  return sizeof (struct sail) + (1 << 16) * sizeof (uint32_t)
+         + ((uint64_t) t->num_c24 + t->num_c32) * SAIL_CHUNK_SZ
+               * sizeof (uint32_t)
+         + (uint64_t) t->num_prefixes * sizeof (int);
+}
+
+/*
+ * エントリ *e を次のレベルのチャンクにする (pivot pushing).
+ * チャンクは元のエントリの値 (pivotを覆うプレフィックス) で埋める.
+ * e は array 以外の配列を指すこと (reallocで動かないように).
+ */
+static int
+_push (uint32_t **array, uint32_t *num, uint32_t *size, uint32_t *e)
+{
+  uint32_t *a, c, i;
+
+  if (*e & SAIL_CHUNK)
+    return 0;
+
+  if (*num == *size)
+    {
+      a = realloc (*array, (uint64_t) *size * 2 * SAIL_CHUNK_SZ
+                               * sizeof (uint32_t));
+      if (! a)
+        return -1;
+      *array = a;
+      *size *= 2;
+    }
+  c = (*num)++;
+  for (i = 0; i < SAIL_CHUNK_SZ; i++)
+    (*array)[c * SAIL_CHUNK_SZ + i] = *e;
+  *e = SAIL_CHUNK | c;
+  return 0;
+}
+
+/* set an entry of level 16 or 24, and every entry of the chunks below it */
+static void
+_fill (struct sail *t, uint32_t *e, uint32_t v, int level)
+{
+  uint32_t i, *chunk;
+
+  if (level == 32 || ! (*e & SAIL_CHUNK))
+    {
+      *e = v;
+      return;
+    }
+  chunk = (level == 16 ? t->l24 : t->l32)
+          + (*e & ~SAIL_CHUNK) * SAIL_CHUNK_SZ;
+  for (i = 0; i < SAIL_CHUNK_SZ; i++)
+    _fill (t, &chunk[i], v, level + 8);
+}
+
+/*
+ * RIBのpre-order (短いプレフィックスが先) で塗るので, 後から来る
+ * より長いプレフィックスが上書きし, pushされたチャンクは覆う
+ * プレフィックスの値を引き継ぐ.
+ */
+static int
+_add_to_sail (struct rib_node *n, void *arg)
+{
+  struct sail *t = (struct sail *) arg;
+  uint32_t key, v, i, first, count, *e, *base;
+  int level, *ids;
+
+  if (t->num_prefixes == t->size_ids)
+    {
+      ids = realloc (t->ids, t->size_ids * 2 * sizeof (int));
+      if (! ids)
+        return -1;
+      t->ids = ids;
+      t->size_ids *= 2;
+    }
+
+  key = 0;
+  memcpy (&key, n->key, KEY_SIZE (n->keylen));
+  key = ntohl (key);
+  v = n->route_idx[0] + 1;
+
+  if (n->keylen <= 16)
+    {
+      level = 16;
+      base = t->l16;
+    }
+  else
+    {
+      e = &t->l16[key >> 16];
+      if (_push (&t->l24, &t->num_c24, &t->size_c24, e) != 0)
+        return -1;
+      base = t->l24 + (*e & ~SAIL_CHUNK) * SAIL_CHUNK_SZ;
+      level = 24;
+      if (n->keylen > 24)
+        {
+          e = &base[(key >> 8) & 0xff];
+          if (_push (&t->l32, &t->num_c32, &t->size_c32, e) != 0)
+            return -1;
+          base = t->l32 + (*e & ~SAIL_CHUNK) * SAIL_CHUNK_SZ;
+          level = 32;
+        }
+    }
+
+  /* the entries of the prefix within its level */
+  first = (key >> (32 - level)) & (level == 16 ? 0xffff : 0xff);
+  count = 1U << (level - n->keylen);
+  for (i = first; i < first + count; i++)
+    _fill (t, &base[i], v, level);
+
+  t->ids[t->num_prefixes++] = n->route_idx[0];
+  nhg_ref (n->route_idx[0]);
+  return 0;
+}
+
+int
+sail_build (struct sail *t, struct rib_tree *rib_tree)
+{
+  if (rib_tree->family == AF_INET6)
+    {
+      fprintf (stderr, "ERROR: SAIL supports IPv4 only\n");
+      return -1;
+    }
+
+  _clear (t);
+  t->l16 = calloc (1 << 16, sizeof (uint32_t));
+  t->size_c24 = t->size_c32 = 64;
+  t->l24 = malloc (t->size_c24 * SAIL_CHUNK_SZ * sizeof (uint32_t));
+  t->l32 = malloc (t->size_c32 * SAIL_CHUNK_SZ * sizeof (uint32_t));
+  t->size_ids = 1024;
+  t->ids = malloc (t->size_ids * sizeof (int));
+  if (! t->l16 || ! t->l24 || ! t->l32 || ! t->ids
+      || rib_traverse (rib_tree, _add_to_sail, t) != 0)
+    {
+      fprintf (stderr, "ERROR: cannot build SAIL (%u + %u chunks)\n",
+               t->num_c24, t->num_c32);
+      _clear (t);
+      return -1;
+    }
+  return 0;
+}
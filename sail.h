@@ -0,0 +1,64 @@
+#ifndef SAIL_H
+#define SAIL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "fib.h"
+
+/*
+ * SAIL (splitting approach to IP lookup, Yang et al.). IPv4 only.
+ * アドレスをレベル16, 24, 32で分割した3段の配列. RIBから一括で構築し,
+ * 更新はできない (RIBが変わったら作り直す).
+ * - レベル16: 2^16 エントリの配列. 上位16ビットで直接引く.
+ * - pivot pushing: /16より長いプレフィックスを含む/16 (pivot) のエントリは
+ *   レベル24のチャンク (256エントリ) を指し, pivotを覆う短いプレフィックスは
+ *   チャンクへ押し下げる. /24とレベル32も同様.
+ * - エントリは32ビット: 0: 経路なし, nexthop id + 1, または
+ *   SAIL_CHUNK | 次のレベルのチャンク番号.
+ * ルックアップは最大3回の配列参照で, 表の大きさによらない.
+ */
+
+#define SAIL_CHUNK    0x80000000U
+#define SAIL_CHUNK_SZ 256
+
+struct sail
+{
+  uint32_t *l16; // 2^16 entries
+  uint32_t *l24; // num_c24 chunks
+  uint32_t *l32; // num_c32 chunks
+  uint32_t num_c24;
+  uint32_t num_c32;
+  uint32_t size_c24; // capacity in chunks
+  uint32_t size_c32;
+  int *ids;          // nexthop id of every prefix (referenced)
+  uint32_t num_prefixes;
+  uint32_t size_ids;
+};
+
+struct sail *sail_new (struct sail *t);
+void sail_free (struct sail *t);
+int sail_build (struct sail *t, struct rib_tree *rib_tree);
+uint64_t sail_mem_size (const struct sail *t);
+
+/* returns the nexthop id, or -1 if there is no route */
+static inline int
+sail_lookup (const struct sail *t, const uint8_t *key)
+{
+  uint32_t a, e;
+
+  memcpy (&a, key, 4);
+  a = ntohl (a);
+
+  e = t->l16[a >> 16];
+  if (e & SAIL_CHUNK)
+    {
+      e = t->l24[((e & ~SAIL_CHUNK) << 8) | ((a >> 8) & 0xff)];
+      if (e & SAIL_CHUNK)
+        e = t->l32[((e & ~SAIL_CHUNK) << 8) | (a & 0xff)];
+    }
+  return (int) e - 1;
+}
+
+#endif /* SAIL_H */
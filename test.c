@@ -1,9 +1,14 @@
+#define _GNU_SOURCE /* pthread_rwlockattr_setkind_np */
 #include <arpa/inet.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/time.h>
 
 #include "radix.h"
@@ -11,6 +16,18 @@
 #include "route_entry.h"
 #include "main.h"
 #include "ptree.h"
+#include "queue.h"
+#include "perf_counter.h"
+#include "ortc.h"
+#include "nexthop_group.h"
+#include "vrf.h"
+#include "flow_cache.h"
+#include "lctrie.h"
+#include "treebitmap.h"
+#include "sail.h"
+#include "dxr.h"
+#include "engine.h"
+#include "ring.h"
 
 #define LINE_BUF_SIZE 4096
 #define IP_BUF_SIZE 64
@@ -41,6 +58,23 @@ now_seconds (void)
   return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
 }
 
+/* Monotonic time in nanoseconds */
+static inline uint64_t
+now_nanoseconds (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int
+_compare_u64 (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
 static inline void
 uint32_to_ipv4_bytes_hton (uint32_t host_ip, uint8_t out[4])
 {
@@ -50,161 +84,733 @@ uint32_to_ipv4_bytes_hton (uint32_t host_ip, uint8_t out[4])
 
 /* -------------------------------------------
  * Route loading
- * ファイル形式: "<cidr> <next-hop-ip>"
+ * ファイル形式: "<cidr> <next-hop-ip> [<next-hop-ip> ...] [table <id>]"
  * 例: "10.0.0.0/8 192.0.2.1"
+ * 複数のnexthopはECMP (static経路, peer 0, 1, ...) として登録
+ * tableを省略した経路はテーブル0に登録する. *rib_treeとptreeは
+ * table_idのテーブルのもの.
+ *
+ * 読み込みは3段のパイプライン:
+ *   parse (スレッド) -> rib (呼び出し元) -> ptree (スレッド)
+ * 段の間はSPSCリングでLOAD_BATCH行ずつのバッチを渡し, ptreeの段が
+ * 使い終わったバッチをparseの段に返す. バッチの数はリングの容量以下なので
+ * enqueueは失敗せず, 各段は入力を待つ間だけ止まる (parseの待ちは下流からの
+ * 背圧). nexthopのinternとRIBはribの段, ptreeはptreeの段だけが触る.
  * ------------------------------------------- */
-static int
-_load_routes (const char *path, int family, struct rib_tree **rib_tree,
-              struct ptree **ptree)
+#define LOAD_BATCH    256
+#define LOAD_BATCH_NH 1024 // nexthops of a batch, >= NHG_MAX_MEMBERS
+#define LOAD_BATCHES  16
+#define LOAD_SPIN     64 // yields before sleeping on an empty ring
+
+struct _load_record
 {
-  FILE *fp = NULL;
+  char cidr[IP_BUF_SIZE]; // for the messages
+  uint8_t prefix[16];
+  int plen;
+  int table_id;
+  int nh;     // first nexthop in the batch
+  int num_nh;
+  void *data; // ptree data (nexthop), NULL if not in the tested table
+};
 
-  char line[LINE_BUF_SIZE];
-  char cidr_buf[IP_BUF_SIZE];
-  char nh_buf[IP_BUF_SIZE];
+struct _load_batch
+{
+  int num;
+  int num_nh;
+  int eof; // the last batch
+  struct _load_record rec[LOAD_BATCH];
+  int peer[LOAD_BATCH_NH];
+  uint8_t nh[LOAD_BATCH_NH][16];
+};
+
+enum
+{
+  LOAD_PARSE = 0,
+  LOAD_RIB,
+  LOAD_PTREE,
+  LOAD_STAGES
+};
 
-  int plen, added, route_idx;
+struct _load_stage
+{
+  uint64_t items;
+  uint64_t start_ns;
+  uint64_t end_ns;
+  uint64_t wait_ns; // stalled on the input ring
+  uint64_t cpu_ns;  // of the thread, while the stage runs
+};
 
-  uint8_t cidr_net_u8[16] = { 0 }; /* CIDR(ネットワークオーダ) */
-  uint8_t nh_net_u8[16] = { 0 };   /* ネクストホップ(ネットワークオーダ) */
+struct _load_pipe
+{
+  FILE *fp;
+  int family;
+  struct ptree *ptree;
+  struct spsc_ring parsed;   // parse -> rib
+  struct spsc_ring inserted; // rib -> ptree
+  struct spsc_ring done;     // ptree -> parse
+  struct _load_batch *batches;
+  int abort;  // a stage failed, the others stop
+  int error;  // of the ptree stage
+  struct _load_stage stage[LOAD_STAGES];
+};
 
-  printf ("Loading routes from file: %s\n", path);
-  fp = fopen (path, "r");
-  if (!fp)
+static inline uint64_t
+_thread_cpu_nanoseconds (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* the rate of a stage comes from its CPU time, not the wall clock, so
+   that it holds when the stages share CPUs */
+static void
+_load_stage_begin (struct _load_stage *s)
+{
+  s->start_ns = now_nanoseconds ();
+  s->cpu_ns = _thread_cpu_nanoseconds ();
+}
+
+static void
+_load_stage_end (struct _load_stage *s)
+{
+  s->end_ns = now_nanoseconds ();
+  s->cpu_ns = _thread_cpu_nanoseconds () - s->cpu_ns;
+}
+
+static const char *const _load_stage_name[LOAD_STAGES] = {
+  "parse", "rib", "ptree",
+};
+
+/* the next batch of the ring, NULL if the pipeline is aborted */
+static struct _load_batch *
+_load_pop (struct _load_pipe *p, struct spsc_ring *r, struct _load_stage *s)
+{
+  struct _load_batch *b;
+  struct timespec nap = { 0, 20000 };
+  uint64_t t = 0;
+  int spin = 0;
+
+  while (! (b = spsc_ring_dequeue (r)))
     {
-      fprintf (stderr, "ERROR: cannot open route file: %s\n", path);
+      /* what was queued before the abort is still handed out */
+      if (__atomic_load_n (&p->abort, __ATOMIC_ACQUIRE))
+        return spsc_ring_dequeue (r);
+      if (! t)
+        t = now_nanoseconds ();
+      /* yield first, then sleep so that a stage on the same CPU runs */
+      if (spin++ < LOAD_SPIN)
+        sched_yield ();
+      else
+        nanosleep (&nap, NULL);
+    }
+  if (t)
+    s->wait_ns += now_nanoseconds () - t;
+  return b;
+}
+
+/* parse a line into the next record of the batch, -1 if skipped */
+static int
+_load_parse_line (struct _load_pipe *p, struct _load_batch *b, char *line)
+{
+  struct _load_record *rec = &b->rec[b->num];
+  char nh_buf[IP_BUF_SIZE];
+  char *table_opt;
+  int pos, len, peer;
+
+  /* routing table of the route (optional trailing "table <id>") */
+  rec->table_id = 0;
+  table_opt = strstr (line, " table ");
+  if (table_opt)
+    {
+      if (sscanf (table_opt + 7, "%d", &rec->table_id) != 1
+          || rec->table_id < 0)
+        {
+          fprintf (stderr, "WARN: invalid table id (skip): %s", line);
+          return -1;
+        }
+      *table_opt = '\0';
+    }
+
+  if (sscanf (line, "%63s %63s%n", rec->cidr, nh_buf, &pos) != 2)
+    {
+      fprintf (stderr,
+               "WARN: skip invalid line (need: \"<cidr> <nexthop>\"): %s",
+               line);
       return -1;
     }
 
-  *rib_tree = rib_new (*rib_tree);
-  if (! *rib_tree)
+  memset (rec->prefix, 0, sizeof (rec->prefix));
+  rec->plen = inet_net_pton (p->family, rec->cidr, rec->prefix,
+                             sizeof (rec->prefix));
+  if (rec->plen < 0)
     {
-      fprintf (stderr, "ERROR: rib_new failed\n");
-      fclose (fp);
+      fprintf (stderr, "WARN: invalid CIDR \"%s\" (skip)\n", rec->cidr);
       return -1;
     }
 
-  *ptree = ptree_create ();
-  if (! *ptree)
+  rec->nh = b->num_nh;
+  rec->num_nh = 0;
+  if (! inet_pton (p->family, nh_buf, b->nh[rec->nh]))
     {
-      fprintf (stderr, "ERROR: ptree_create failed\n");
-      fclose (fp);
-      rib_free (*rib_tree);
+      fprintf (stderr, "WARN: invalid next-hop \"%s\" (skip)\n", nh_buf);
       return -1;
     }
+  b->peer[rec->nh] = 0;
+  rec->num_nh = 1;
 
-  added = 0;
-  while (fgets (line, sizeof (line), fp))
+  /* the other nexthops join the ECMP group */
+  for (peer = 1; sscanf (line + pos, "%63s%n", nh_buf, &len) == 1; peer++)
     {
-      if (sscanf (line, "%63s %63s", cidr_buf, nh_buf) != 2)
+      pos += len;
+      if (peer >= NHG_MAX_MEMBERS)
         {
-          fprintf (stderr,
-                   "WARN: skip invalid line (need: \"<cidr> <nexthop>\"): %s",
-                   line);
+          fprintf (stderr, "WARN: too many nexthops for %s (skip)\n",
+                   rec->cidr);
+          break;
+        }
+      if (! inet_pton (p->family, nh_buf, b->nh[rec->nh + rec->num_nh]))
+        {
+          fprintf (stderr, "WARN: invalid next-hop \"%s\" (skip)\n", nh_buf);
           continue;
         }
+      b->peer[rec->nh + rec->num_nh] = peer;
+      rec->num_nh++;
+    }
 
-      plen = inet_net_pton (family, cidr_buf, &cidr_net_u8,
-                            sizeof (cidr_net_u8));
+  b->num_nh += rec->num_nh;
+  b->num++;
+  return 0;
+}
+
+static void *
+_load_parse_thread (void *arg)
+{
+  struct _load_pipe *p = (struct _load_pipe *) arg;
+  struct _load_stage *s = &p->stage[LOAD_PARSE];
+  struct _load_batch *b;
+  char line[LINE_BUF_SIZE];
+  int eof = 0;
 
-      if (plen < 0)
+  _load_stage_begin (s);
+  while (! eof && (b = _load_pop (p, &p->done, s)))
+    {
+      b->num = 0;
+      b->num_nh = 0;
+      while (b->num < LOAD_BATCH
+             && b->num_nh + NHG_MAX_MEMBERS <= LOAD_BATCH_NH)
         {
-          fprintf (stderr, "WARN: invalid CIDR \"%s\" (skip)\n", cidr_buf);
-          continue;
+          if (! fgets (line, sizeof (line), p->fp))
+            {
+              eof = 1;
+              break;
+            }
+          _load_parse_line (p, b, line);
         }
+      b->eof = eof;
+      s->items += b->num;
+      spsc_ring_enqueue (&p->parsed, b);
+    }
+  _load_stage_end (s);
+  return NULL;
+}
 
-      if (! inet_pton (family, nh_buf, &nh_net_u8))
+static void *
+_load_ptree_thread (void *arg)
+{
+  struct _load_pipe *p = (struct _load_pipe *) arg;
+  struct _load_stage *s = &p->stage[LOAD_PTREE];
+  struct _load_batch *b;
+  struct _load_record *rec;
+  char nh_buf[IP_BUF_SIZE];
+  int i, eof = 0;
+
+  _load_stage_begin (s);
+  while (! eof && (b = _load_pop (p, &p->inserted, s)))
+    {
+      for (i = 0; i < b->num; i++)
         {
-          fprintf (stderr, "WARN: invalid next-hop \"%s\" (skip)\n", nh_buf);
-          continue;
+          rec = &b->rec[i];
+          if (! rec->data)
+            continue; // the oracle follows the tested table only
+
+          /* Use route_table entry address as ptree data (not stack
+             variable!) */
+          if (! ptree_add ((char *)rec->prefix, rec->plen, rec->data,
+                           p->ptree))
+            {
+              inet_ntop (p->family, b->nh[rec->nh], nh_buf, sizeof (nh_buf));
+              fprintf (stderr, "ERROR: ptree_add failed for %s %s\n",
+                       rec->cidr, nh_buf);
+              p->error = -1;
+              __atomic_store_n (&p->abort, 1, __ATOMIC_RELEASE);
+              _load_stage_end (s);
+              return NULL;
+            }
+          s->items++;
         }
+      eof = b->eof;
+      spsc_ring_enqueue (&p->done, b);
+    }
+  _load_stage_end (s);
+  return NULL;
+}
 
-      route_idx = route_table_add_entry (route_table, family, nh_net_u8, 0);
-        if (route_idx < 0)
-          break;
+/* add the routes of a batch to the RIBs, -1 on error, 1 to stop loading */
+static int
+_load_rib_batch (struct _load_pipe *p, struct _load_batch *b,
+                 struct rib_tree *tested, int table_id, int *added,
+                 uint64_t *rib_ns)
+{
+  struct _load_record *rec;
+  struct rib_tree *rib;
+  struct rib_path ecmp;
+  struct vrf *vrf;
+  char nh_buf[IP_BUF_SIZE];
+  int i, j, ret, route_idx, changed;
+  uint64_t t1;
 
-      if (rib_route_add (*rib_tree, cidr_net_u8, plen, route_idx) < 0)
+  for (i = 0; i < b->num; i++)
+    {
+      rec = &b->rec[i];
+      rec->data = NULL;
+      rib = tested;
+      if (rec->table_id != table_id)
         {
-          fprintf (stderr, "ERROR: rib_route_add failed for %s %s\n", cidr_buf,
-                   nh_buf);
-          fclose (fp);
-          return -1;
+          vrf = vrf_get (p->family, rec->table_id);
+          if (! vrf)
+            {
+              fprintf (stderr, "ERROR: cannot create routing table %d\n",
+                       rec->table_id);
+              return -1;
+            }
+          rib = vrf->rib;
         }
 
-      /* Use route_table entry address as ptree data (not stack variable!) */
-      if (! ptree_add ((char *)cidr_net_u8, plen,
-                       route_table[route_idx].nexthop, *ptree))
+      route_idx = route_table_add_entry (&route_table, p->family,
+                                         b->nh[rec->nh], 0);
+      if (route_idx < 0)
         {
-          fprintf (stderr, "ERROR: ptree_add failed for %s %s\n", cidr_buf,
-                   nh_buf);
-          fclose (fp);
+          b->num = i; // the rest is not loaded
+          return 1;
+        }
+
+      t1 = now_nanoseconds ();
+      ret = rib_route_add (rib, rec->prefix, rec->plen, route_idx);
+      *rib_ns += now_nanoseconds () - t1;
+      route_table_unref (&route_table, route_idx); // the RIB holds it now
+      if (ret < 0)
+        {
+          inet_ntop (p->family, b->nh[rec->nh], nh_buf, sizeof (nh_buf));
+          fprintf (stderr, "ERROR: rib_route_add failed for %s %s\n",
+                   rec->cidr, nh_buf);
           return -1;
         }
 
-      added++;
+      /* the other nexthops join the ECMP group */
+      memset (&ecmp, 0, sizeof (ecmp));
+      ecmp.source = RIB_SOURCE_STATIC;
+      ecmp.distance = rib_source_distance (RIB_SOURCE_STATIC);
+      for (j = 1; j < rec->num_nh; j++)
+        {
+          ecmp.peer = b->peer[rec->nh + j];
+          ecmp.route_idx = route_table_add_entry (&route_table, p->family,
+                                                  b->nh[rec->nh + j], 0);
+          if (ecmp.route_idx < 0)
+            break;
+
+          t1 = now_nanoseconds ();
+          ret = rib_path_update (rib, rec->prefix, rec->plen, &ecmp,
+                                 &changed);
+          *rib_ns += now_nanoseconds () - t1;
+          route_table_unref (&route_table, ecmp.route_idx);
+          if (ret < 0)
+            {
+              inet_ntop (p->family, b->nh[rec->nh + j], nh_buf,
+                         sizeof (nh_buf));
+              fprintf (stderr, "ERROR: rib_path_update failed for %s %s\n",
+                       rec->cidr, nh_buf);
+              return -1;
+            }
+        }
+
+      (*added)++;
+      if (rib == tested)
+        rec->data = route_table_nexthop (&route_table, route_idx);
+    }
+  return 0;
+}
+
+static void
+_load_print_stages (struct _load_pipe *p)
+{
+  struct _load_stage *s;
+  double cpu;
+  int i;
+
+  printf ("load pipeline (batches of %d):\n", LOAD_BATCH);
+  for (i = 0; i < LOAD_STAGES; i++)
+    {
+      s = &p->stage[i];
+      cpu = (double) s->cpu_ns / 1e9;
+      printf ("  %-6s %10" PRIu64 " routes, cpu %.3f sec (%.3fM routes/sec)"
+              ", stalled %.3f of %.3f sec\n",
+              _load_stage_name[i], s->items, cpu,
+              cpu > 0 ? (double) s->items / cpu / 1e6 : 0.0,
+              (double) s->wait_ns / 1e9,
+              (double) (s->end_ns - s->start_ns) / 1e9);
+    }
+}
+
+static int
+_load_routes (const char *path, int family, int table_id,
+              struct rib_tree **rib_tree, struct ptree **ptree)
+{
+  struct _load_pipe p;
+  struct _load_stage *s = &p.stage[LOAD_RIB];
+  struct _load_batch *b;
+  struct vrf *vrf;
+  pthread_t parser, inserter;
+  int i, added = 0, ret = 0, eof = 0, started = 0;
+  uint64_t rib_ns = 0;
+
+  printf ("Loading routes from file: %s\n", path);
+  memset (&p, 0, sizeof (p));
+  p.family = family;
+  p.fp = fopen (path, "r");
+  if (! p.fp)
+    {
+      fprintf (stderr, "ERROR: cannot open route file: %s\n", path);
+      return -1;
+    }
+
+  vrf = vrf_get (family, table_id);
+  if (! vrf)
+    {
+      fprintf (stderr, "ERROR: cannot create routing table %d\n", table_id);
+      fclose (p.fp);
+      return -1;
+    }
+  *rib_tree = vrf->rib;
+
+  *ptree = ptree_create ();
+  if (! *ptree)
+    {
+      fprintf (stderr, "ERROR: ptree_create failed\n");
+      fclose (p.fp);
+      return -1;
+    }
+  p.ptree = *ptree;
+
+  /* every batch fits in each ring */
+  p.batches = malloc (LOAD_BATCHES * sizeof (struct _load_batch));
+  if (! p.batches || spsc_ring_init (&p.parsed, LOAD_BATCHES) != 0
+      || spsc_ring_init (&p.inserted, LOAD_BATCHES) != 0
+      || spsc_ring_init (&p.done, LOAD_BATCHES) != 0)
+    {
+      fprintf (stderr, "ERROR: cannot allocate the load pipeline\n");
+      ret = -1;
+      goto out;
+    }
+  for (i = 0; i < LOAD_BATCHES; i++)
+    spsc_ring_enqueue (&p.done, &p.batches[i]);
+
+  if (pthread_create (&parser, NULL, _load_parse_thread, &p) != 0)
+    {
+      fprintf (stderr, "ERROR: cannot create the parser thread\n");
+      ret = -1;
+      goto out;
+    }
+  started++;
+  if (pthread_create (&inserter, NULL, _load_ptree_thread, &p) != 0)
+    {
+      fprintf (stderr, "ERROR: cannot create the ptree thread\n");
+      __atomic_store_n (&p.abort, 1, __ATOMIC_RELEASE);
+      ret = -1;
+      goto join;
+    }
+  started++;
+
+  /* the rib stage runs here */
+  _load_stage_begin (s);
+  while (! eof && (b = _load_pop (&p, &p.parsed, s)))
+    {
+      ret = _load_rib_batch (&p, b, *rib_tree, table_id, &added, &rib_ns);
+      if (ret < 0)
+        {
+          __atomic_store_n (&p.abort, 1, __ATOMIC_RELEASE);
+          break;
+        }
+      s->items += b->num;
+      eof = b->eof;
+      if (ret > 0)
+        b->eof = eof = 1; // the ptree stage ends with this batch
+      spsc_ring_enqueue (&p.inserted, b);
+    }
+  _load_stage_end (s);
+  if (ret > 0)
+    {
+      ret = 0;
+      /* the parser may still wait for a batch */
+      __atomic_store_n (&p.abort, 1, __ATOMIC_RELEASE);
     }
 
+join:
+  if (started > 1)
+    pthread_join (inserter, NULL);
+  if (started > 0)
+    pthread_join (parser, NULL);
+  if (ret == 0 && p.error)
+    ret = p.error;
+  if (ret == 0 && ! eof)
+    ret = -1; // aborted by another stage
+
+out:
+  spsc_ring_free (&p.parsed);
+  spsc_ring_free (&p.inserted);
+  spsc_ring_free (&p.done);
+  free (p.batches);
+  fclose (p.fp);
+  if (ret < 0)
+    return -1;
+
   printf ("Total %d routes added\n", added);
-  fclose (fp);
+  _load_print_stages (&p);
+  if (vrf_count () > 1)
+    printf ("routing tables: %d (table %d is tested)\n", vrf_count (),
+            table_id);
+  printf ("RIB: %" PRIu64 " prefixes, %" PRIu64 " nodes, %" PRIu64
+          " bytes (%.1f bytes/prefix), insert rate %.3fM routes/sec\n",
+          (*rib_tree)->num_prefixes, (*rib_tree)->num_nodes,
+          (*rib_tree)->mem_size,
+          (*rib_tree)->num_prefixes
+              ? (double)(*rib_tree)->mem_size / (*rib_tree)->num_prefixes
+              : 0.0,
+          rib_ns ? (double)added / ((double)rib_ns / 1e9) / 1e6 : 0.0);
+  if (nhg_count () > 0)
+    printf ("ECMP: %d nexthop groups\n", nhg_count ());
+  route_table_print_stats (&route_table);
   return 0;
 }
 
 /* -------------------------------------------
  * Performance benchmark
  * ランダム IPv4 を大量に引いてルックアップ（正否は不問）
+ * エンジンの lookup_bulk で PERF_BATCH 個ずつ引く
  * ------------------------------------------- */
+#define PERF_BATCH 64
+
 int
-_benchmark_lookup_performance (struct fib_tree *t, uint64_t trials)
+_benchmark_lookup_performance (struct fib_engine *e, uint64_t trials,
+                               int flow)
 {
-  struct fib_node *n;
+  struct nhg_flow f;
 
   double t1, t2;
   double elapsed, qps;
 
-  uint8_t rand_net_u8[4]; /* CIDR(ネットワークオーダ) */
+  uint8_t rand_net_u8[PERF_BATCH][4]; /* CIDR(ネットワークオーダ) */
+  const uint8_t *keys[PERF_BATCH];
+  uint32_t hash[PERF_BATCH];
+  int ids[PERF_BATCH];
   uint32_t rand_host_u32; /* CIDR(ホストオーダ) */
+  int j;
 
-  if (!t || trials == 0)
+  struct perf_counter pc;
+
+  if (!e || trials == 0)
     return -1;
 
+  for (j = 0; j < PERF_BATCH; j++)
+    keys[j] = rand_net_u8[j];
+
+  perf_counter_open (&pc);
+
   t1 = now_seconds ();
+  perf_counter_start (&pc);
 
   /* 最適化回避用の集計変数 */
   uintptr_t sink = 0;
 
-  for (uint64_t i = 0; i < trials; i++)
+  for (uint64_t i = 0; i < trials; i += PERF_BATCH)
     {
-      rand_host_u32 = xorshift32 (); /* ホストオーダの乱数 */
-      uint32_to_ipv4_bytes_hton (rand_host_u32, rand_net_u8);
+      for (j = 0; j < PERF_BATCH; j++)
+        {
+          rand_host_u32 = xorshift32 (); /* ホストオーダの乱数 */
+          uint32_to_ipv4_bytes_hton (rand_host_u32, rand_net_u8[j]);
+
+          if (flow)
+            {
+              /* 5-tuple のハッシュでECMPのメンバを選択 */
+              memcpy (f.dst, rand_net_u8[j], 4);
+              uint32_to_ipv4_bytes_hton (xorshift32 (), f.src);
+              f.sport = (uint16_t)rand_host_u32;
+              f.dport = 443;
+              f.proto = 6;
+              hash[j] = nhg_flow_hash (AF_INET, &f);
+            }
+        }
+
+      fib_engine_lookup_bulk (e, keys, ids, PERF_BATCH);
 
-      n = fib_route_lookup (t, rand_net_u8);
-      sink ^= (uintptr_t)n;
+      for (j = 0; j < PERF_BATCH; j++)
+        if (flow)
+          sink ^= (uintptr_t)(ids[j] >= 0 ? nhg_select (ids[j], hash[j])
+                                          : -1);
+        else
+          sink ^= (uintptr_t)ids[j];
     }
 
+  perf_counter_stop (&pc);
   t2 = now_seconds ();
   elapsed = t2 - t1;
   qps = (elapsed > 0.0) ? (double)trials / elapsed : 0.0;
 
+  printf ("FIB engine: %s (bulk lookups of %d)\n", e->ops->name, PERF_BATCH);
+  if (flow)
+    printf ("flow-hash lookups (5-tuple hash + nexthop group member)\n");
   printf ("Elapsed time: %.6f sec for %" PRIu64 " lookups\n", elapsed, trials);
   printf ("Lookup per second: %.6fM lookups/sec\n", qps / 1e6);
+  perf_counter_print (&pc, trials);
+  perf_counter_close (&pc);
 
   (void)sink; /* 未使用警告抑止 */
 
   return 0;
 }
 
+/* -------------------------------------------
+ * Skewed traffic benchmark
+ * 宛先をZipf分布 (順位rの確率 ∝ 1/r^alpha) で選んだトレースを, FIBのみと
+ * flow cache経由で引き比べる. トレースは計測前に作る.
+ * ------------------------------------------- */
+#define SKEW_POPULATION (1 << 20) // distinct destinations
+#define SKEW_TRACE_LEN  (1 << 22) // power of 2
+
+static uint8_t (*_zipf_trace (double alpha))[4]
+{
+  uint8_t (*trace)[4], (*dst)[4];
+  double *cdf, sum = 0.0, u;
+  int i, lo, hi, mid;
+
+  cdf = malloc (SKEW_POPULATION * sizeof (double));
+  dst = malloc (SKEW_POPULATION * sizeof (*dst));
+  trace = malloc (SKEW_TRACE_LEN * sizeof (*trace));
+  if (! cdf || ! dst || ! trace)
+    {
+      fprintf (stderr, "ERROR: cannot allocate the traffic trace\n");
+      free (cdf);
+      free (dst);
+      free (trace);
+      return NULL;
+    }
+
+  for (i = 0; i < SKEW_POPULATION; i++)
+    {
+      sum += 1.0 / pow (i + 1, alpha);
+      cdf[i] = sum;
+      uint32_to_ipv4_bytes_hton (xorshift32 (), dst[i]);
+    }
+  for (i = 0; i < SKEW_TRACE_LEN; i++)
+    {
+      u = (double)xorshift32 () / 4294967296.0 * sum;
+      for (lo = 0, hi = SKEW_POPULATION - 1; lo < hi;)
+        {
+          mid = (lo + hi) / 2;
+          if (cdf[mid] < u)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+      memcpy (trace[i], dst[lo], 4);
+    }
+
+  free (cdf);
+  free (dst);
+  return trace;
+}
+
+int
+_benchmark_skewed_performance (struct fib_engine *e, uint64_t trials,
+                               double alpha, uint32_t cache_entries)
+{
+  struct flow_cache cache;
+  struct fib_tree *t;
+  uint8_t (*trace)[4];
+  uintptr_t sink[2] = { 0, 0 };
+  double t1, elapsed[2], qps[2];
+  uint64_t i;
+
+  if (! e || trials == 0)
+    return -1;
+  trace = _zipf_trace (alpha);
+  if (! trace)
+    return -1;
+
+  /* FIB only */
+  t1 = now_seconds ();
+  for (i = 0; i < trials; i++)
+    sink[0] ^= (uintptr_t)fib_engine_lookup (e,
+                                             trace[i & (SKEW_TRACE_LEN - 1)]);
+  elapsed[0] = now_seconds () - t1;
+
+  printf ("skewed traffic: Zipf alpha %.2f over %d destinations, "
+          "%" PRIu64 " lookups\n",
+          alpha, SKEW_POPULATION, trials);
+  printf ("FIB only:   %.6f sec, %.6fM lookups/sec (engine %s)\n",
+          elapsed[0],
+          elapsed[0] > 0.0 ? (double)trials / elapsed[0] / 1e6 : 0.0,
+          e->ops->name);
+
+  /* the flow cache follows the generation of the trie */
+  t = fib_engine_fib (e);
+  if (! t)
+    {
+      printf ("flow cache: n/a (trie engine only)\n");
+      free (trace);
+      return 0;
+    }
+  if (flow_cache_init (&cache, AF_INET, cache_entries) != 0)
+    {
+      free (trace);
+      return -1;
+    }
+
+  /* flow cache in front of the FIB */
+  t1 = now_seconds ();
+  for (i = 0; i < trials; i++)
+    sink[1] ^= (uintptr_t)flow_cache_lookup (&cache, t,
+                                             trace[i & (SKEW_TRACE_LEN - 1)]);
+  elapsed[1] = now_seconds () - t1;
+
+  for (i = 0; i < 2; i++)
+    qps[i] = (elapsed[i] > 0.0) ? (double)trials / elapsed[i] : 0.0;
+
+  printf ("flow cache: %.6f sec, %.6fM lookups/sec (%u entries, %d-way, "
+          "hit rate %.2f%%)\n",
+          elapsed[1], qps[1] / 1e6, cache.num_sets * FLOW_CACHE_WAYS,
+          FLOW_CACHE_WAYS, flow_cache_hit_rate (&cache) * 100.0);
+  printf ("speedup: x%.3f\n", qps[0] > 0.0 ? qps[1] / qps[0] : 0.0);
+  if (sink[0] != sink[1])
+    printf ("ERROR: results with the flow cache differ from the FIB\n");
+
+  flow_cache_free (&cache);
+  free (trace);
+  return (sink[0] != sink[1]) ? -1 : 0;
+}
+
 /* -------------------------------------------
  * Basic lookup test
  * ファイル形式: "<ip>"
  * 例: "203.0.113.5"
  * ------------------------------------------- */
 int
-_run_lookup (struct fib_tree *tree, const char *path, int family)
+_run_lookup (struct fib_engine *e, const char *path, int family)
 {
   printf ("============================================\n");
 
   FILE *fp;
-  struct fib_node *node;
+  int id;
 
   char line[LINE_BUF_SIZE];
   char ip_addr_buf[IP_BUF_SIZE];
@@ -212,7 +818,7 @@ _run_lookup (struct fib_tree *tree, const char *path, int family)
 
   uint8_t ip_addr_net_u8[16]; /* CIDR(ネットワークオーダ) */
 
-  if (!tree || !path)
+  if (!e || !path)
     return -1;
 
   printf ("Lookup test with file: %s\n", path);
@@ -238,10 +844,12 @@ _run_lookup (struct fib_tree *tree, const char *path, int family)
           continue;
         }
 
-      node = fib_route_lookup (tree, ip_addr_net_u8);
-      if (node)
+      id = fib_engine_lookup (e, ip_addr_net_u8);
+      if (id >= 0)
         {
-          inet_ntop (family, route_table[node->route_idx[0]].nexthop, nh_buf, sizeof (nh_buf));
+          inet_ntop (family,
+                     route_table_nexthop (&route_table, nhg_primary (id)),
+                     nh_buf, sizeof (nh_buf));
           printf ("+ Found route for %-16s: %s\n", ip_addr_buf, nh_buf);
         }
       else
@@ -256,9 +864,9 @@ _run_lookup (struct fib_tree *tree, const char *path, int family)
  * Full IPv4 test using ptree as ground truth
  * ------------------------------------------- */
 int
-_run_lookup_all (struct fib_tree *fib_tree, struct ptree *ptree)
+_run_lookup_all (struct fib_engine *e, struct ptree *ptree)
 {
-  struct fib_node *fib_node;
+  int fib_id;
   struct ptree_node *ptree_node;
   double t1, t2;
   double elapsed, qps;
@@ -283,7 +891,7 @@ _run_lookup_all (struct fib_tree *fib_tree, struct ptree *ptree)
   uint8_t ip_net_u8[4];
   uint32_t ip_host_u32;
 
-  if (! ptree || ! fib_tree)
+  if (! ptree || ! e)
     return -1;
 
   /* full IPv4 lookup test */
@@ -302,16 +910,17 @@ _run_lookup_all (struct fib_tree *fib_tree, struct ptree *ptree)
 
       /* lookup in both ptree and FIB */
       ptree_node = ptree_search ((char *)ip_net_u8, 32, ptree);
-      fib_node = fib_route_lookup (fib_tree, ip_net_u8);
+      fib_id = fib_engine_lookup (e, ip_net_u8);
 
       /* verify FIB result against ptree - handle all 4 cases */
-      if (ptree_node && fib_node)
+      if (ptree_node && fib_id >= 0)
         {
           /* both found - compare nexthops */
           total_ptree_found++;
           fib_found++;
           if (memcmp (ptree_node->data,
-                      route_table[fib_node->route_idx[0]].nexthop, 4) != 0)
+                      route_table_nexthop (&route_table, nhg_primary (fib_id)),
+                      4) != 0)
             {
               error_nexthop_mismatch++;
               /* print first few mismatches for debugging */
@@ -322,14 +931,16 @@ _run_lookup_all (struct fib_tree *fib_tree, struct ptree *ptree)
                   char correct_str[INET_ADDRSTRLEN];
                   inet_ntop (AF_INET, ip_net_u8, ip_str, sizeof (ip_str));
                   inet_ntop (AF_INET, ptree_node->data, expected_str, sizeof (expected_str));
-                  inet_ntop (AF_INET, route_table[fib_node->route_idx[0]].nexthop,
+                  inet_ntop (AF_INET,
+                             route_table_nexthop (&route_table,
+                                                  nhg_primary (fib_id)),
                              correct_str, sizeof (correct_str));
                   printf ("ERROR [NEXTHOP MISMATCH] at %s: expected %s, got %s\n",
                           ip_str, expected_str, correct_str);
                 }
             }
         }
-      else if (ptree_node && !fib_node)
+      else if (ptree_node && fib_id < 0)
         {
           /* ptree found but FIB didn't - FIB error */
           total_ptree_found++;
@@ -344,7 +955,7 @@ _run_lookup_all (struct fib_tree *fib_tree, struct ptree *ptree)
                       ip_str, expected_str);
             }
         }
-      else if (! ptree_node && fib_node)
+      else if (! ptree_node && fib_id >= 0)
         {
           /* FIB found but ptree didn't - FIB error (false positive) */
           fib_found++;
@@ -354,7 +965,9 @@ _run_lookup_all (struct fib_tree *fib_tree, struct ptree *ptree)
               char ip_str[INET_ADDRSTRLEN];
               char correct_str[INET_ADDRSTRLEN];
               inet_ntop (AF_INET, ip_net_u8, ip_str, sizeof (ip_str));
-              inet_ntop (AF_INET, route_table[fib_node->route_idx[0]].nexthop,
+              inet_ntop (AF_INET,
+                         route_table_nexthop (&route_table,
+                                              nhg_primary (fib_id)),
                          correct_str, sizeof (correct_str));
               printf ("ERROR [FALSE POSITIVE] at %s: expected NULL, got %s\n",
                       ip_str, correct_str);
@@ -447,20 +1060,23 @@ _run_lookup_all (struct fib_tree *fib_tree, struct ptree *ptree)
  * ------------------------------------------- */
 struct node_count_arg
 {
-  uint64_t total_nodes;
-  uint64_t leaf_nodes;
+  uint64_t total_slots;
+  uint64_t leaf_slots;
   uint64_t internal_nodes;
 };
 
+/* leaves live in the parent's slot, only internal nodes are allocated */
 static int
-_count_node_callback (struct fib_node *n, void *arg)
+_count_node_callback (fib_slot_t s, const uint8_t *key, int depth, void *arg)
 {
+  (void)key;
+  (void)depth;
   struct node_count_arg *count = (struct node_count_arg *)arg;
 
-  count->total_nodes++;
+  count->total_slots++;
 
-  if (n->leaf)
-    count->leaf_nodes++;
+  if (FIB_SLOT_IS_LEAF (s))
+    count->leaf_slots++;
   else
     count->internal_nodes++;
 
@@ -482,48 +1098,2509 @@ test_count_fib_nodes (struct fib_tree *t)
 
   printf ("============================================\n");
   printf ("FIB node statistics:\n");
-  printf ("  Total nodes:    %'" PRIu64 "\n", count.total_nodes);
-  printf ("  Leaf nodes:     %'" PRIu64 " (%.2f%%)\n",
-          count.leaf_nodes,
-          (double)count.leaf_nodes / (double)count.total_nodes * 100.0);
-  printf ("  Internal nodes: %'" PRIu64 " (%.2f%%)\n",
+  printf ("  Non-empty slots: %'" PRIu64 "\n", count.total_slots);
+  printf ("  Leaf slots:      %'" PRIu64 " (%.2f%%)\n",
+          count.leaf_slots,
+          (double)count.leaf_slots / (double)count.total_slots * 100.0);
+  printf ("  Internal nodes:  %'" PRIu64 " (%.2f%%, %'" PRIu64 " bytes)\n",
           count.internal_nodes,
-          (double)count.internal_nodes / (double)count.total_nodes * 100.0);
+          (double)count.internal_nodes / (double)count.total_slots * 100.0,
+          count.internal_nodes * sizeof (struct fib_node));
   printf ("============================================\n");
 }
 
 /* -------------------------------------------
- * Wrapper functions for test.h
+ * FIB structure statistics
  * ------------------------------------------- */
-int
-test_load_routes (const char *routes_filename, int family, struct rib_tree **rib_tree,
-                  struct ptree **ptree)
+#define STATS_DUP_BUCKETS 24 /* log2 buckets of leaves per RIB prefix */
+
+struct fib_leaf_prefix
+{
+  uint8_t key[16];
+  int keylen;
+};
+
+struct fib_stats_arg
+{
+  int addr_bits;
+  uint64_t level_nodes[FIB_MAX_LEVEL];  /* internal nodes */
+  uint64_t level_leaves[FIB_MAX_LEVEL]; /* leaf slots */
+  uint64_t children[BRANCH_SZ + 1]; /* internal nodes by non-empty slots */
+  uint64_t total_nodes;
+  uint64_t leaf_nodes;
+  int max_level;
+  double leaf_level_sum;
+  double addr_weighted_level; /* expected depth for a uniform address */
+  struct fib_leaf_prefix *leaves;
+  uint64_t num_leaves;
+  uint64_t size_leaves;
+  uint64_t rib_prefixes;
+};
+
+static int
+_count_rib_callback (struct rib_node *n, void *arg)
 {
-  return _load_routes (routes_filename, family, rib_tree, ptree);
+  (void)n;
+  (*(uint64_t *)arg)++;
+  return 0;
 }
 
-int
-test_performance (struct fib_tree *t, int family)
+static int
+_fib_stats_callback (fib_slot_t s, const uint8_t *key, int depth, void *arg)
 {
-  const uint64_t trials = 0x10000000ULL;
+  struct fib_stats_arg *st = (struct fib_stats_arg *)arg;
+  struct fib_leaf_prefix *p;
+  int i, level, keylen, children = 0;
 
-  if (family == AF_INET)
-    return _benchmark_lookup_performance (t, trials);
-  else
-    return -1; // IPv4 only
+  level = depth / K;
+  if (level > st->max_level)
+    st->max_level = level;
+
+  if (! FIB_SLOT_IS_LEAF (s))
+    {
+      st->total_nodes++;
+      st->level_nodes[level]++;
+      for (i = 0; i < BRANCH_SZ; i++)
+        if (FIB_SLOT_NODE (s)->child[i])
+          children++;
+      st->children[children]++;
+      return 0;
+    }
+
+  st->leaf_nodes++;
+  st->level_leaves[level]++;
+  st->leaf_level_sum += level;
+  st->addr_weighted_level += level * ldexp (1.0, -depth);
+
+  if (st->num_leaves == st->size_leaves)
+    {
+      st->size_leaves = st->size_leaves ? st->size_leaves * 2 : 4096;
+      p = realloc (st->leaves,
+                   st->size_leaves * sizeof (struct fib_leaf_prefix));
+      if (! p)
+        return -1;
+      st->leaves = p;
+    }
+  /*
+   * 葉は経路のキーを持たないので, スロットの位置 (keyの先頭depthビット)
+   * をプレフィックス長 (keylen <= depth) でマスクして復元する
+   */
+  keylen = FIB_SLOT_KEYLEN (s);
+  p = &st->leaves[st->num_leaves++];
+  memset (p->key, 0, sizeof (p->key));
+  memcpy (p->key, key, KEY_SIZE (keylen));
+  if (keylen & 7)
+    p->key[keylen >> 3] &= 0xff << (8 - (keylen & 7));
+  p->keylen = keylen;
+  return 0;
 }
 
-int
-test_lookup (struct fib_tree *t, const char *lookup_addrs_filename, int family)
+static int
+_compare_leaf_prefix (const void *a, const void *b)
 {
-  return _run_lookup (t, lookup_addrs_filename, family);
+  const struct fib_leaf_prefix *x = a;
+  const struct fib_leaf_prefix *y = b;
+  int ret = memcmp (x->key, y->key, sizeof (x->key));
+  if (ret != 0)
+    return ret;
+  return x->keylen - y->keylen;
 }
 
-int
-test_lookup_all (struct fib_tree *fib_tree, struct ptree *ptree, int family)
+static int
+_run_fib_stats (struct fib_tree *fib_tree, struct rib_tree *rib_tree,
+                const char *json_path)
 {
-  if (family == AF_INET)
-    return _run_lookup_all (fib_tree, ptree);
-  else
-    return -1; // IPv4 only
+  struct fib_stats_arg *st;
+  uint64_t dup[STATS_DUP_BUCKETS] = { 0 };
+  uint64_t i, j, run, distinct = 0, max_dup = 0;
+  uint64_t bytes, shadowed;
+  double per_prefix;
+  FILE *fp;
+  int b, level;
+
+  st = calloc (1, sizeof (struct fib_stats_arg));
+  if (! st)
+    return -1;
+  st->addr_bits = (fib_tree->family == AF_INET6) ? 128 : 32;
+
+  rib_traverse (rib_tree, _count_rib_callback, &st->rib_prefixes);
+  if (fib_traverse (fib_tree, _fib_stats_callback, st) != 0)
+    {
+      fprintf (stderr, "ERROR: cannot allocate leaf prefix array\n");
+      free (st->leaves);
+      free (st);
+      return -1;
+    }
+
+  /* leaf-pushed copies per RIB prefix */
+  qsort (st->leaves, st->num_leaves, sizeof (struct fib_leaf_prefix),
+         _compare_leaf_prefix);
+  for (i = 0; i < st->num_leaves; i = j)
+    {
+      for (j = i + 1; j < st->num_leaves
+                      && _compare_leaf_prefix (&st->leaves[i],
+                                               &st->leaves[j]) == 0;
+           j++)
+        ;
+      run = j - i;
+      for (b = 0; b < STATS_DUP_BUCKETS - 1 && (run >> (b + 1)); b++)
+        ;
+      dup[b]++;
+      distinct++;
+      if (run > max_dup)
+        max_dup = run;
+    }
+  shadowed = (st->rib_prefixes > distinct) ? st->rib_prefixes - distinct : 0;
+
+  bytes = st->total_nodes * sizeof (struct fib_node);
+  per_prefix = st->rib_prefixes ? (double)bytes / st->rib_prefixes : 0.0;
+
+  printf ("============================================\n");
+  printf ("FIB structure statistics (K=%d, %zu bytes/node):\n", K,
+          sizeof (struct fib_node));
+  printf ("  level  depth      nodes     leaves          bytes\n");
+  for (level = 0; level <= st->max_level; level++)
+    printf ("  %5d  %5d %10" PRIu64 " %10" PRIu64 " %14" PRIu64 "\n", level,
+            level * K, st->level_nodes[level], st->level_leaves[level],
+            st->level_nodes[level] * sizeof (struct fib_node));
+  printf ("  non-NULL children per internal node:\n");
+  for (i = 0; i <= BRANCH_SZ; i++)
+    if (st->children[i])
+      printf ("    %3" PRIu64 ": %" PRIu64 "\n", i, st->children[i]);
+  printf ("  leaves per RIB prefix (leaf pushing duplication):\n");
+  for (b = 0; b < STATS_DUP_BUCKETS; b++)
+    if (dup[b])
+      printf ("    %8" PRIu64 "-%-8" PRIu64 ": %" PRIu64 " prefixes\n",
+              (uint64_t)1 << b, ((uint64_t)2 << b) - 1, dup[b]);
+  printf ("    max: %" PRIu64 ", avg: %.3f, shadowed: %" PRIu64 "\n", max_dup,
+          distinct ? (double)st->num_leaves / distinct : 0.0, shadowed);
+  printf ("  max depth: %d levels\n", st->max_level);
+  printf ("  avg leaf depth: %.3f levels (address-weighted: %.3f)\n",
+          st->leaf_nodes ? st->leaf_level_sum / st->leaf_nodes : 0.0,
+          st->addr_weighted_level);
+  printf ("  RIB prefixes: %" PRIu64 "\n", st->rib_prefixes);
+  printf ("  FIB memory: %" PRIu64 " bytes (%.1f bytes/prefix, "
+          "%.3f nodes/prefix)\n",
+          bytes, per_prefix,
+          st->rib_prefixes ? (double)st->total_nodes / st->rib_prefixes : 0.0);
+  printf ("============================================\n");
+
+  if (json_path)
+    {
+      fp = fopen (json_path, "w");
+      if (! fp)
+        {
+          fprintf (stderr, "ERROR: cannot open stats file: %s\n", json_path);
+          free (st->leaves);
+          free (st);
+          return -1;
+        }
+      fprintf (fp, "{\n  \"k\": %d,\n  \"node_size\": %zu,\n", K,
+               sizeof (struct fib_node));
+      fprintf (fp, "  \"rib_prefixes\": %" PRIu64 ",\n", st->rib_prefixes);
+      fprintf (fp, "  \"total_nodes\": %" PRIu64 ",\n", st->total_nodes);
+      fprintf (fp, "  \"leaf_nodes\": %" PRIu64 ",\n", st->leaf_nodes);
+      fprintf (fp, "  \"total_bytes\": %" PRIu64 ",\n", bytes);
+      fprintf (fp, "  \"bytes_per_prefix\": %.3f,\n", per_prefix);
+      fprintf (fp, "  \"levels\": [");
+      for (level = 0; level <= st->max_level; level++)
+        fprintf (fp, "%s\n    {\"level\": %d, \"nodes\": %" PRIu64
+                     ", \"leaves\": %" PRIu64 ", \"bytes\": %" PRIu64 "}",
+                 level ? "," : "", level, st->level_nodes[level],
+                 st->level_leaves[level],
+                 st->level_nodes[level] * sizeof (struct fib_node));
+      fprintf (fp, "\n  ],\n  \"children_histogram\": [");
+      for (i = 0; i <= BRANCH_SZ; i++)
+        fprintf (fp, "%s%" PRIu64, i ? ", " : "", st->children[i]);
+      fprintf (fp, "],\n  \"leaves_per_prefix_log2_histogram\": [");
+      for (b = 0; b < STATS_DUP_BUCKETS; b++)
+        fprintf (fp, "%s%" PRIu64, b ? ", " : "", dup[b]);
+      fprintf (fp, "],\n  \"leaves_per_prefix_max\": %" PRIu64 ",\n", max_dup);
+      fprintf (fp, "  \"leaves_per_prefix_avg\": %.3f,\n",
+               distinct ? (double)st->num_leaves / distinct : 0.0);
+      fprintf (fp, "  \"shadowed_prefixes\": %" PRIu64 ",\n", shadowed);
+      fprintf (fp, "  \"max_depth\": %d,\n", st->max_level);
+      fprintf (fp, "  \"avg_leaf_depth\": %.3f,\n",
+               st->leaf_nodes ? st->leaf_level_sum / st->leaf_nodes : 0.0);
+      fprintf (fp, "  \"avg_address_depth\": %.3f\n}\n",
+               st->addr_weighted_level);
+      fclose (fp);
+      printf ("FIB statistics written to %s\n", json_path);
+    }
+
+  free (st->leaves);
+  free (st);
+  return 0;
+}
+
+/* -------------------------------------------
+ * ORTC aggregation
+ * 集約前後の経路数, FIBメモリ, ルックアップ性能を比較
+ * ------------------------------------------- */
+#define AGGREGATE_TRIALS 0x1000000ULL
+
+static double
+_lookup_rate (struct fib_tree *t, uint64_t trials)
+{
+  uint32_t s = 0x9E3779B9u; /* same address stream for every FIB */
+  uint8_t rand_net_u8[4];
+  uintptr_t sink = 0;
+  double t1, elapsed;
+
+  t1 = now_seconds ();
+  for (uint64_t i = 0; i < trials; i++)
+    {
+      s ^= s << 13;
+      s ^= s >> 17;
+      s ^= s << 5;
+      uint32_to_ipv4_bytes_hton (s, rand_net_u8);
+      sink ^= (uintptr_t)fib_route_lookup (t, rand_net_u8);
+    }
+  elapsed = now_seconds () - t1;
+
+  (void)sink;
+  return (elapsed > 0.0) ? (double)trials / elapsed : 0.0;
+}
+
+static int
+_run_aggregation (struct rib_tree *rib_tree, struct rib_tree *aggr_tree,
+                  int family)
+{
+  struct fib_tree *fib_tree[2] = { NULL, NULL };
+  struct rib_tree *src[2] = { rib_tree, aggr_tree };
+  struct node_count_arg count[2];
+  uint64_t prefixes[2] = { 0, 0 };
+  double qps[2] = { 0.0, 0.0 };
+  double t1, elapsed;
+  int i, ret = 0;
+
+  t1 = now_seconds ();
+  if (rib_aggregate (rib_tree, aggr_tree) != 0)
+    {
+      fprintf (stderr, "ERROR: rib_aggregate failed\n");
+      return -1;
+    }
+  elapsed = now_seconds () - t1;
+
+  for (i = 0; i < 2; i++)
+    {
+      memset (&count[i], 0, sizeof (count[i]));
+      rib_traverse (src[i], _count_rib_callback, &prefixes[i]);
+
+      fib_tree[i] = fib_new (NULL);
+      if (! fib_tree[i] || rebuild_fib_from_rib (src[i], fib_tree[i]) != 0)
+        {
+          fprintf (stderr, "ERROR: failed to build FIB for comparison\n");
+          ret = -1;
+          break;
+        }
+      fib_traverse (fib_tree[i], _count_node_callback, &count[i]);
+      if (family == AF_INET)
+        qps[i] = _lookup_rate (fib_tree[i], AGGREGATE_TRIALS);
+    }
+
+  if (ret == 0)
+    {
+      printf ("============================================\n");
+      printf ("ORTC aggregation (%.6f sec):\n", elapsed);
+      printf ("  prefixes:   %" PRIu64 " -> %" PRIu64 " (%.2f%%)\n",
+              prefixes[0], prefixes[1],
+              prefixes[0] ? (double)prefixes[1] / prefixes[0] * 100.0 : 0.0);
+      printf ("  FIB nodes:  %" PRIu64 " -> %" PRIu64 " (%.2f%%)\n",
+              count[0].internal_nodes, count[1].internal_nodes,
+              count[0].internal_nodes
+                  ? (double)count[1].internal_nodes / count[0].internal_nodes
+                        * 100.0
+                  : 0.0);
+      printf ("  FIB memory: %" PRIu64 " -> %" PRIu64 " bytes\n",
+              count[0].internal_nodes * sizeof (struct fib_node),
+              count[1].internal_nodes * sizeof (struct fib_node));
+      if (family == AF_INET)
+        printf ("  lookup:     %.6fM -> %.6fM lookups/sec (x%.3f)\n",
+                qps[0] / 1e6, qps[1] / 1e6, qps[0] > 0.0 ? qps[1] / qps[0] : 0.0);
+      printf ("============================================\n");
+    }
+
+  for (i = 0; i < 2; i++)
+    if (fib_tree[i])
+      fib_free (fib_tree[i]);
+  return ret;
+}
+
+/* -------------------------------------------
+ * ptreeとの照合
+ * RIBから構築したルックアップ構造 (LC-trie, Tree Bitmap, SAIL, DXR) を,
+ * 各プレフィックスの両端とその隣, 続いて乱数のアドレスでptreeと比べる.
+ * lookupはfib_engine_opsのlookupと同じ形 (nexthop id, 経路なしは-1).
+ * ------------------------------------------- */
+#define VERIFY_PRINT_ERRORS 10
+
+struct verify_arg
+{
+  const char *name; // label of the error messages
+  int (*lookup) (void *data, const uint8_t *key);
+  void *data;
+  struct ptree *ptree;
+  uint64_t checks;
+  uint64_t errors;
+};
+
+/* compare the structure with ptree at an address */
+static void
+_verify_check (struct verify_arg *v, uint32_t ip_host_u32)
+{
+  struct ptree_node *ptree_node;
+  uint8_t key[16] = { 0 }; // ptree_match reads past the last byte of the key
+  char ip_str[INET_ADDRSTRLEN], want[INET_ADDRSTRLEN], got[INET_ADDRSTRLEN];
+  int id;
+
+  uint32_to_ipv4_bytes_hton (ip_host_u32, key);
+  ptree_node = ptree_search ((char *)key, 32, v->ptree);
+  id = v->lookup (v->data, key);
+  v->checks++;
+
+  if (ptree_node && id >= 0
+      && memcmp (ptree_node->data,
+                 route_table_nexthop (&route_table, nhg_primary (id)), 4)
+             == 0)
+    return;
+  if (! ptree_node && id < 0)
+    return;
+
+  /* the nexthops of both sides, NULL for no route */
+  if (v->errors++ < VERIFY_PRINT_ERRORS)
+    {
+      inet_ntop (AF_INET, key, ip_str, sizeof (ip_str));
+      strcpy (want, "NULL");
+      strcpy (got, "NULL");
+      if (ptree_node)
+        inet_ntop (AF_INET, ptree_node->data, want, sizeof (want));
+      if (id >= 0)
+        inet_ntop (AF_INET,
+                   route_table_nexthop (&route_table, nhg_primary (id)), got,
+                   sizeof (got));
+      printf ("ERROR [%s] at %s: ptree %s, %s %s\n", v->name, ip_str, want,
+              v->name, got);
+    }
+}
+
+/* the ends of a RIB prefix and their neighbours */
+static int
+_verify_callback (struct rib_node *n, void *arg)
+{
+  struct verify_arg *v = (struct verify_arg *)arg;
+  uint32_t key = 0, mask, first, last;
+
+  memcpy (&key, n->key, KEY_SIZE (n->keylen));
+  mask = n->keylen ? 0xffffffffU << (32 - n->keylen) : 0;
+  first = ntohl (key) & mask;
+  last = first | ~mask;
+  _verify_check (v, first);
+  _verify_check (v, last);
+  _verify_check (v, first - 1);
+  _verify_check (v, last + 1);
+  return 0;
+}
+
+/*
+ * verify the structure (data, looked up by lookup) built from rib_tree.
+ * prints the first errors, returns the number of errors.
+ */
+static uint64_t
+_verify_lookup (const char *name, int (*lookup) (void *, const uint8_t *),
+                void *data, struct rib_tree *rib_tree, struct ptree *ptree,
+                uint64_t trials, uint64_t *checks)
+{
+  struct verify_arg v = { name, lookup, data, ptree, 0, 0 };
+  uint32_t s = 12345;
+  uint64_t i;
+
+  rib_traverse (rib_tree, _verify_callback, &v);
+  for (i = 0; i < trials; i++)
+    {
+      s ^= s << 13;
+      s ^= s >> 17;
+      s ^= s << 5;
+      _verify_check (&v, s);
+    }
+  *checks = v.checks;
+  return v.errors;
+}
+
+/* -------------------------------------------
+ * LC-trie
+ * FIBと同じRIBから構築し, ptreeと照合した上でメモリとルックアップ性能を
+ * FIB (固定ストライドのtrie) と比較
+ * ------------------------------------------- */
+#define LCTRIE_VERIFY_TRIALS 0x400000ULL
+
+static double
+_lctrie_lookup_rate (struct lctrie *t, uint64_t trials)
+{
+  uint32_t s = 0x9E3779B9u; /* same address stream as _lookup_rate */
+  uint8_t rand_net_u8[4];
+  uintptr_t sink = 0;
+  double t1, elapsed;
+
+  t1 = now_seconds ();
+  for (uint64_t i = 0; i < trials; i++)
+    {
+      s ^= s << 13;
+      s ^= s >> 17;
+      s ^= s << 5;
+      uint32_to_ipv4_bytes_hton (s, rand_net_u8);
+      sink ^= (uintptr_t)lctrie_lookup (t, rand_net_u8);
+    }
+  elapsed = now_seconds () - t1;
+
+  (void)sink;
+  return (elapsed > 0.0) ? (double)trials / elapsed : 0.0;
+}
+
+static int
+_run_lctrie (struct rib_tree *rib_tree, struct fib_tree *fib_tree,
+             struct ptree *ptree)
+{
+  struct lctrie *t;
+  struct node_count_arg count;
+  uint64_t checks, errors, fib_bytes, lc_bytes;
+  double t1, elapsed, qps[2];
+  int b;
+
+  t = lctrie_new (NULL);
+  if (! t)
+    return -1;
+  t1 = now_seconds ();
+  if (lctrie_build (t, rib_tree, LCTRIE_FILL_FACTOR) != 0)
+    {
+      lctrie_free (t);
+      return -1;
+    }
+  elapsed = now_seconds () - t1;
+
+  errors = _verify_lookup ("LC-trie", fib_engine_lctrie.lookup, t, rib_tree,
+                           ptree, LCTRIE_VERIFY_TRIALS, &checks);
+
+  memset (&count, 0, sizeof (count));
+  fib_traverse (fib_tree, _count_node_callback, &count);
+  fib_bytes = sizeof (struct fib_tree)
+              + count.internal_nodes * sizeof (struct fib_node);
+  lc_bytes = lctrie_mem_size (t);
+  qps[0] = _lookup_rate (fib_tree, AGGREGATE_TRIALS);
+  qps[1] = _lctrie_lookup_rate (t, AGGREGATE_TRIALS);
+
+  printf ("============================================\n");
+  printf ("LC-trie (fill factor %.2f, built in %.6f sec):\n", t->fill_factor,
+          elapsed);
+  printf ("  entries:    %u (base %u, prefix %u)\n", t->num_entries - 1,
+          t->num_base, t->num_entries - 1 - t->num_base);
+  printf ("  nodes:      %u (internal %u, leaves %u, empty %u)\n",
+          t->num_nodes, t->num_internal, t->num_nodes - t->num_internal,
+          t->num_empty);
+  printf ("  branch:    ");
+  for (b = 1; b <= LCTRIE_MAX_BRANCH; b++)
+    if (t->branches[b])
+      printf (" %d:%" PRIu64, b, t->branches[b]);
+  printf ("\n");
+  printf ("  depth:      max %d, address-weighted avg %.3f levels\n",
+          t->max_depth, t->avg_depth);
+  printf ("  memory:     %" PRIu64 " -> %" PRIu64 " bytes (%.2f%%)\n",
+          fib_bytes, lc_bytes,
+          fib_bytes ? (double)lc_bytes / fib_bytes * 100.0 : 0.0);
+  printf ("  lookup:     %.6fM -> %.6fM lookups/sec (x%.3f)\n",
+          qps[0] / 1e6, qps[1] / 1e6, qps[0] > 0.0 ? qps[1] / qps[0] : 0.0);
+  printf ("  verify:     %" PRIu64 " addresses against ptree, %" PRIu64
+          " errors\n",
+          checks, errors);
+  printf ("============================================\n");
+
+  lctrie_free (t);
+  return errors ? -1 : 0;
+}
+
+/* -------------------------------------------
+ * Tree Bitmap
+ * FIBと並べて保持し, ptreeと照合した上でメモリとルックアップ性能を比較.
+ * 更新コストの比較はupdate replayで行う.
+ * ------------------------------------------- */
+#define TBM_VERIFY_TRIALS 0x400000ULL
+
+static double
+_tbm_lookup_rate (struct tbm_tree *t, uint64_t trials)
+{
+  uint32_t s = 0x9E3779B9u; /* same address stream as _lookup_rate */
+  uint8_t rand_net_u8[4];
+  uintptr_t sink = 0;
+  double t1, elapsed;
+
+  t1 = now_seconds ();
+  for (uint64_t i = 0; i < trials; i++)
+    {
+      s ^= s << 13;
+      s ^= s >> 17;
+      s ^= s << 5;
+      uint32_to_ipv4_bytes_hton (s, rand_net_u8);
+      sink ^= (uintptr_t)tbm_route_lookup (t, rand_net_u8);
+    }
+  elapsed = now_seconds () - t1;
+
+  (void)sink;
+  return (elapsed > 0.0) ? (double)trials / elapsed : 0.0;
+}
+
+static int
+_run_treebitmap (struct tbm_tree *tbm, struct rib_tree *rib_tree,
+                 struct fib_tree *fib_tree, struct ptree *ptree)
+{
+  struct node_count_arg count;
+  uint64_t checks, errors, fib_bytes, tbm_bytes;
+  double qps[2];
+
+  errors = _verify_lookup ("Tree Bitmap", fib_engine_treebitmap.lookup, tbm,
+                           rib_tree, ptree, TBM_VERIFY_TRIALS, &checks);
+
+  memset (&count, 0, sizeof (count));
+  fib_traverse (fib_tree, _count_node_callback, &count);
+  fib_bytes = sizeof (struct fib_tree)
+              + count.internal_nodes * sizeof (struct fib_node);
+  tbm_bytes = tbm_mem_size (tbm);
+  qps[0] = _lookup_rate (fib_tree, AGGREGATE_TRIALS);
+  qps[1] = _tbm_lookup_rate (tbm, AGGREGATE_TRIALS);
+
+  printf ("============================================\n");
+  printf ("Tree Bitmap (stride %d, %zu bytes/node):\n", TBM_STRIDE,
+          sizeof (struct tbm_node));
+  printf ("  prefixes:   %" PRIu64 ", nodes %" PRIu64 "\n",
+          tbm->num_prefixes, tbm->num_nodes + 1);
+  printf ("  memory:     %" PRIu64 " -> %" PRIu64 " bytes (%.2f%%)\n",
+          fib_bytes, tbm_bytes,
+          fib_bytes ? (double)tbm_bytes / fib_bytes * 100.0 : 0.0);
+  printf ("  lookup:     %.6fM -> %.6fM lookups/sec (x%.3f)\n",
+          qps[0] / 1e6, qps[1] / 1e6, qps[0] > 0.0 ? qps[1] / qps[0] : 0.0);
+  printf ("  verify:     %" PRIu64 " addresses against ptree, %" PRIu64
+          " errors\n",
+          checks, errors);
+  printf ("============================================\n");
+
+  return errors ? -1 : 0;
+}
+
+/* -------------------------------------------
+ * SAIL
+ * FIBと同じRIBから構築し, ptreeと照合した上でメモリとルックアップ性能を
+ * 比較. ランダムなアドレスに加え, レベル32まで引くアドレス (最悪の場合)
+ * でも比較する.
+ * ------------------------------------------- */
+#define SAIL_VERIFY_TRIALS 0x400000ULL
+#define SAIL_DEEP_ADDRS    0x10000
+
+/* sail_lookup is inlined: keep the lookups from being optimized out */
+static volatile uintptr_t _sail_sink;
+
+static double
+_sail_lookup_rate (struct sail *t, uint64_t trials)
+{
+  uint32_t s = 0x9E3779B9u; /* same address stream as _lookup_rate */
+  uint8_t rand_net_u8[4];
+  uintptr_t sink = 0;
+  double t1, elapsed;
+
+  t1 = now_seconds ();
+  for (uint64_t i = 0; i < trials; i++)
+    {
+      s ^= s << 13;
+      s ^= s >> 17;
+      s ^= s << 5;
+      uint32_to_ipv4_bytes_hton (s, rand_net_u8);
+      sink ^= (uintptr_t)sail_lookup (t, rand_net_u8);
+    }
+  elapsed = now_seconds () - t1;
+
+  _sail_sink = sink;
+  return (elapsed > 0.0) ? (double)trials / elapsed : 0.0;
+}
+
+/*
+ * lookup rates of the FIB and SAIL on addresses that reach level 32.
+ * returns the number of such /24s, 0 if there is none.
+ */
+static uint32_t
+_sail_deep_lookup_rate (struct sail *t, struct fib_tree *fib_tree,
+                        uint64_t trials, double qps[2])
+{
+  uint32_t *pivots, *addrs, num_pivots = 0, i, j, e, s = 12345;
+  uintptr_t sink = 0;
+  double t1;
+
+  pivots = malloc ((t->num_c32 ? t->num_c32 : 1) * sizeof (uint32_t));
+  addrs = malloc (SAIL_DEEP_ADDRS * sizeof (uint32_t));
+  if (! pivots || ! addrs)
+    {
+      free (pivots);
+      free (addrs);
+      return 0;
+    }
+
+  /* the /24s pushed to level 32 */
+  for (i = 0; i < (1 << 16); i++)
+    {
+      e = t->l16[i];
+      if (! (e & SAIL_CHUNK))
+        continue;
+      for (j = 0; j < SAIL_CHUNK_SZ; j++)
+        if (t->l24[(e & ~SAIL_CHUNK) * SAIL_CHUNK_SZ + j] & SAIL_CHUNK)
+          pivots[num_pivots++] = (i << 16) | (j << 8);
+    }
+  if (num_pivots == 0)
+    {
+      free (pivots);
+      free (addrs);
+      return 0;
+    }
+  for (i = 0; i < SAIL_DEEP_ADDRS; i++)
+    {
+      s ^= s << 13;
+      s ^= s >> 17;
+      s ^= s << 5;
+      addrs[i] = htonl (pivots[s % num_pivots] | (s >> 24));
+    }
+
+  t1 = now_seconds ();
+  for (uint64_t k = 0; k < trials; k++)
+    sink ^= (uintptr_t)fib_route_lookup (
+        fib_tree, (uint8_t *)&addrs[k & (SAIL_DEEP_ADDRS - 1)]);
+  qps[0] = trials / (now_seconds () - t1);
+  t1 = now_seconds ();
+  for (uint64_t k = 0; k < trials; k++)
+    sink ^= (uintptr_t)sail_lookup (
+        t, (uint8_t *)&addrs[k & (SAIL_DEEP_ADDRS - 1)]);
+  qps[1] = trials / (now_seconds () - t1);
+
+  _sail_sink = sink;
+  free (pivots);
+  free (addrs);
+  return num_pivots;
+}
+
+static int
+_run_sail (struct rib_tree *rib_tree, struct fib_tree *fib_tree,
+           struct ptree *ptree)
+{
+  struct sail *t;
+  struct node_count_arg count;
+  uint64_t checks, errors, fib_bytes, sail_bytes, share[3] = { 0, 0, 0 };
+  uint32_t i, deep;
+  double t1, elapsed, qps[2], deep_qps[2];
+
+  t = sail_new (NULL);
+  if (! t)
+    return -1;
+  t1 = now_seconds ();
+  if (sail_build (t, rib_tree) != 0)
+    {
+      sail_free (t);
+      return -1;
+    }
+  elapsed = now_seconds () - t1;
+
+  errors = _verify_lookup ("SAIL", fib_engine_sail.lookup, t, rib_tree, ptree,
+                           SAIL_VERIFY_TRIALS, &checks);
+
+  /* addresses answered at each level */
+  for (i = 0; i < (1 << 16); i++)
+    if (! (t->l16[i] & SAIL_CHUNK))
+      share[0] += 1 << 16;
+  for (i = 0; i < t->num_c24 * SAIL_CHUNK_SZ; i++)
+    if (! (t->l24[i] & SAIL_CHUNK))
+      share[1] += 1 << 8;
+  share[2] = (uint64_t)t->num_c32 * SAIL_CHUNK_SZ;
+
+  memset (&count, 0, sizeof (count));
+  fib_traverse (fib_tree, _count_node_callback, &count);
+  fib_bytes = sizeof (struct fib_tree)
+              + count.internal_nodes * sizeof (struct fib_node);
+  sail_bytes = sail_mem_size (t);
+  qps[0] = _lookup_rate (fib_tree, AGGREGATE_TRIALS);
+  qps[1] = _sail_lookup_rate (t, AGGREGATE_TRIALS);
+  deep = _sail_deep_lookup_rate (t, fib_tree, AGGREGATE_TRIALS, deep_qps);
+
+  printf ("============================================\n");
+  printf ("SAIL (levels 16/24/32, built in %.6f sec):\n", elapsed);
+  printf ("  prefixes:   %u\n", t->num_prefixes);
+  printf ("  chunks:     level 24 %u, level 32 %u\n", t->num_c24, t->num_c32);
+  printf ("  answered:   level 16 %.2f%%, level 24 %.2f%%, level 32 %.4f%% "
+          "of the address space\n",
+          share[0] / 42949672.96, share[1] / 42949672.96,
+          share[2] / 42949672.96);
+  printf ("  memory:     %" PRIu64 " -> %" PRIu64 " bytes (%.2f%%)\n",
+          fib_bytes, sail_bytes,
+          fib_bytes ? (double)sail_bytes / fib_bytes * 100.0 : 0.0);
+  printf ("  lookup:     %.6fM -> %.6fM lookups/sec (x%.3f)\n",
+          qps[0] / 1e6, qps[1] / 1e6, qps[0] > 0.0 ? qps[1] / qps[0] : 0.0);
+  if (deep)
+    printf ("  level 32:   %.6fM -> %.6fM lookups/sec (x%.3f, %u /24s)\n",
+            deep_qps[0] / 1e6, deep_qps[1] / 1e6,
+            deep_qps[0] > 0.0 ? deep_qps[1] / deep_qps[0] : 0.0, deep);
+  printf ("  verify:     %" PRIu64 " addresses against ptree, %" PRIu64
+          " errors\n",
+          checks, errors);
+  printf ("============================================\n");
+
+  sail_free (t);
+  return errors ? -1 : 0;
+}
+
+/* -------------------------------------------
+ * DXR
+ * FIBと同じRIBから区間表を構築し, ptreeと照合した上でメモリと
+ * ルックアップ性能をFIB (16-ary trie) と比較
+ * ------------------------------------------- */
+#define DXR_VERIFY_TRIALS 0x400000ULL
+
+/* dxr_lookup is inlined: keep the lookups from being optimized out */
+static volatile uintptr_t _dxr_sink;
+
+static double
+_dxr_lookup_rate (struct dxr *t, uint64_t trials)
+{
+  uint32_t s = 0x9E3779B9u; /* same address stream as _lookup_rate */
+  uint8_t rand_net_u8[4];
+  uintptr_t sink = 0;
+  double t1, elapsed;
+
+  t1 = now_seconds ();
+  for (uint64_t i = 0; i < trials; i++)
+    {
+      s ^= s << 13;
+      s ^= s >> 17;
+      s ^= s << 5;
+      uint32_to_ipv4_bytes_hton (s, rand_net_u8);
+      sink ^= (uintptr_t)dxr_lookup (t, rand_net_u8);
+    }
+  elapsed = now_seconds () - t1;
+
+  _dxr_sink = sink;
+  return (elapsed > 0.0) ? (double)trials / elapsed : 0.0;
+}
+
+static int
+_run_dxr (struct rib_tree *rib_tree, struct fib_tree *fib_tree,
+          struct ptree *ptree)
+{
+  struct dxr *t;
+  struct node_count_arg count;
+  uint64_t checks, errors, fib_bytes, dxr_bytes;
+  uint32_t ranged;
+  double t1, elapsed, qps[2];
+
+  t = dxr_new (NULL);
+  if (! t)
+    return -1;
+  t1 = now_seconds ();
+  if (dxr_build (t, rib_tree) != 0)
+    {
+      dxr_free (t);
+      return -1;
+    }
+  elapsed = now_seconds () - t1;
+
+  errors = _verify_lookup ("DXR", fib_engine_dxr.lookup, t, rib_tree, ptree,
+                           DXR_VERIFY_TRIALS, &checks);
+
+  memset (&count, 0, sizeof (count));
+  fib_traverse (fib_tree, _count_node_callback, &count);
+  fib_bytes = sizeof (struct fib_tree)
+              + count.internal_nodes * sizeof (struct fib_node);
+  dxr_bytes = dxr_mem_size (t);
+  qps[0] = _lookup_rate (fib_tree, AGGREGATE_TRIALS);
+  qps[1] = _dxr_lookup_rate (t, AGGREGATE_TRIALS);
+  ranged = t->num_long + t->num_short;
+
+  printf ("============================================\n");
+  printf ("DXR (direct %d bits, built in %.6f sec):\n", DXR_DIRECT_BITS,
+          elapsed);
+  printf ("  prefixes:   %u -> %u intervals, %u nexthops\n", t->num_prefixes,
+          t->num_intervals, t->num_nh - 1);
+  printf ("  chunks:     %u single, %u long, %u short (%u xl), %u shared\n",
+          t->num_leaf, t->num_long, t->num_short, t->num_xl, t->num_shared);
+  printf ("  ranges:     avg %.2f per ranged chunk, %u words\n",
+          ranged ? (double)t->sum_ranges / ranged : 0.0, t->num_range);
+  printf ("  memory:     %" PRIu64 " -> %" PRIu64 " bytes (%.2f%%)\n",
+          fib_bytes, dxr_bytes,
+          fib_bytes ? (double)dxr_bytes / fib_bytes * 100.0 : 0.0);
+  printf ("  lookup:     %.6fM -> %.6fM lookups/sec (x%.3f)\n",
+          qps[0] / 1e6, qps[1] / 1e6, qps[0] > 0.0 ? qps[1] / qps[0] : 0.0);
+  printf ("  verify:     %" PRIu64 " addresses against ptree, %" PRIu64
+          " errors\n",
+          checks, errors);
+  printf ("============================================\n");
+
+  dxr_free (t);
+  return errors ? -1 : 0;
+}
+
+/* -------------------------------------------
+ * Cross-structure benchmark
+ * ルート表を1度だけ読み込み, 各ルックアップ構造 (FIBエンジン, RIBのradix,
+ * ptree) を同じアドレス列, 同じスレッド数で計測し, 表とJSONで出力する.
+ * - アドレス列: IPv4は一様乱数 (性能テストと同じ), IPv6はRIBの
+ *   プレフィックスからランダムに選び, ホスト部を乱数で埋める.
+ * - レイテンシ: BENCH_BATCH個ずつ引いた時間から求めた1個あたりの値.
+ * - radixとptreeはルート表の読み込み時に構築済みなので構築時間はなし.
+ * ------------------------------------------- */
+#define BENCH_ADDRS       (1 << 20) // power of 2
+#define BENCH_BATCH       64
+#define BENCH_MAX_TARGETS 16
+
+struct bench_target
+{
+  const char *name;
+  void *data;
+  void (*lookup_bulk) (void *data, const uint8_t *const *keys, int *ids,
+                       int n);
+  double build_sec; // < 0: built while loading the routes
+  uint64_t mem_size;
+  struct fib_engine engine; // FIB engines only
+  /* results */
+  double qps;
+  uint64_t *latency; // ns per batch
+  uint64_t num_latency;
+};
+
+struct bench_thread_arg
+{
+  struct bench_target *target;
+  uint8_t (*addrs)[16];
+  uint64_t offset;
+  uint64_t count; // multiple of BENCH_BATCH
+  uint64_t *latency;
+  uintptr_t sink;
+};
+
+static int _bench_family;
+
+static void
+_radix_lookup_bulk (void *data, const uint8_t *const *keys, int *ids, int n)
+{
+  struct rib_node *node;
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      node = rib_route_lookup ((struct rib_tree *)data, keys[i]);
+      ids[i] = node ? node->route_idx[0] : -1;
+    }
+}
+
+/* ptree has no nexthop id: 0 for a match */
+static void
+_ptree_lookup_bulk (void *data, const uint8_t *const *keys, int *ids, int n)
+{
+  int i, keylen = _bench_family == AF_INET ? 32 : 128;
+
+  for (i = 0; i < n; i++)
+    ids[i] = ptree_search ((char *)keys[i], keylen, (struct ptree *)data)
+                 ? 0
+                 : -1;
+}
+
+static uint64_t
+_ptree_mem_size (struct ptree *ptree)
+{
+  struct ptree_node *x;
+  uint64_t bytes = sizeof (struct ptree);
+
+  for (x = ptree_head (ptree); x; x = ptree_next (x))
+    bytes += sizeof (struct ptree_node) + PTREE_KEY_SIZE (x->keylen);
+  return bytes;
+}
+
+struct bench_prefixes
+{
+  uint8_t (*key)[16];
+  int *keylen;
+  uint64_t num;
+};
+
+static int
+_bench_prefix_callback (struct rib_node *n, void *arg)
+{
+  struct bench_prefixes *p = (struct bench_prefixes *)arg;
+
+  memset (p->key[p->num], 0, 16);
+  memcpy (p->key[p->num], n->key, KEY_SIZE (n->keylen));
+  p->keylen[p->num++] = n->keylen;
+  return 0;
+}
+
+static uint8_t (*_bench_addrs (struct rib_tree *rib_tree, int family))[16]
+{
+  struct bench_prefixes p;
+  uint8_t (*addrs)[16];
+  uint64_t i;
+  int b;
+
+  addrs = malloc (BENCH_ADDRS * sizeof (*addrs));
+  if (! addrs)
+    return NULL;
+  if (family == AF_INET)
+    {
+      for (i = 0; i < BENCH_ADDRS; i++)
+        uint32_to_ipv4_bytes_hton (xorshift32 (), addrs[i]);
+      return addrs;
+    }
+
+  memset (&p, 0, sizeof (p));
+  p.key = malloc (rib_tree->num_prefixes * sizeof (*p.key));
+  p.keylen = malloc (rib_tree->num_prefixes * sizeof (int));
+  if (! p.key || ! p.keylen || rib_tree->num_prefixes == 0)
+    {
+      free (p.key);
+      free (p.keylen);
+      free (addrs);
+      return NULL;
+    }
+  rib_traverse (rib_tree, _bench_prefix_callback, &p);
+  if (p.num == 0)
+    {
+      free (p.key);
+      free (p.keylen);
+      free (addrs);
+      return NULL;
+    }
+  for (i = 0; i < BENCH_ADDRS; i++)
+    {
+      uint64_t r = xorshift32 () % p.num;
+
+      for (b = 0; b < 16; b++)
+        addrs[i][b] = (uint8_t)xorshift32 ();
+      for (b = 0; b < p.keylen[r]; b++)
+        if (p.key[r][b >> 3] & (0x80 >> (b & 7)))
+          addrs[i][b >> 3] |= 0x80 >> (b & 7);
+        else
+          addrs[i][b >> 3] &= ~(0x80 >> (b & 7));
+    }
+  free (p.key);
+  free (p.keylen);
+  return addrs;
+}
+
+static void *
+_bench_thread (void *arg)
+{
+  struct bench_thread_arg *a = (struct bench_thread_arg *)arg;
+  const uint8_t *keys[BENCH_BATCH];
+  int ids[BENCH_BATCH];
+  uint64_t i, pos, t1;
+  int j;
+
+  pos = a->offset;
+  for (i = 0; i < a->count / BENCH_BATCH; i++)
+    {
+      for (j = 0; j < BENCH_BATCH; j++)
+        keys[j] = a->addrs[(pos + j) & (BENCH_ADDRS - 1)];
+      pos += BENCH_BATCH;
+
+      t1 = now_nanoseconds ();
+      a->target->lookup_bulk (a->target->data, keys, ids, BENCH_BATCH);
+      a->latency[i] = now_nanoseconds () - t1;
+
+      for (j = 0; j < BENCH_BATCH; j++)
+        a->sink ^= (uintptr_t)ids[j];
+    }
+  return NULL;
+}
+
+/* every thread looks up count addresses from its own offset of the stream */
+static int
+_bench_run (struct bench_target *target, uint8_t (*addrs)[16],
+            uint64_t lookups, int nthreads)
+{
+  pthread_t threads[nthreads];
+  struct bench_thread_arg args[nthreads];
+  uint64_t per_thread, batches;
+  double t1, elapsed;
+  int i;
+
+  per_thread = lookups / nthreads / BENCH_BATCH * BENCH_BATCH;
+  batches = per_thread / BENCH_BATCH;
+  target->num_latency = batches * nthreads;
+  target->latency = malloc ((target->num_latency ? target->num_latency : 1)
+                            * sizeof (uint64_t));
+  if (! target->latency)
+    return -1;
+
+  t1 = now_seconds ();
+  for (i = 0; i < nthreads; i++)
+    {
+      args[i] = (struct bench_thread_arg){
+        target, addrs, (uint64_t)BENCH_ADDRS / nthreads * i, per_thread,
+        target->latency + batches * i, 0
+      };
+      if (pthread_create (&threads[i], NULL, _bench_thread, &args[i]) != 0)
+        {
+          fprintf (stderr, "ERROR: cannot create benchmark thread\n");
+          while (i-- > 0)
+            pthread_join (threads[i], NULL);
+          return -1;
+        }
+    }
+  for (i = 0; i < nthreads; i++)
+    pthread_join (threads[i], NULL);
+  elapsed = now_seconds () - t1;
+
+  target->qps = elapsed > 0.0 ? (double)per_thread * nthreads / elapsed : 0.0;
+  qsort (target->latency, target->num_latency, sizeof (uint64_t),
+         _compare_u64);
+  return 0;
+}
+
+/* percentile of the latency per lookup, in nanoseconds */
+static double
+_bench_latency (const struct bench_target *target, int permille)
+{
+  if (target->num_latency == 0)
+    return 0.0;
+  return (double)target->latency[target->num_latency * permille / 1000
+                                 - (permille == 1000)]
+         / BENCH_BATCH;
+}
+
+/* names: comma separated, NULL: all */
+static int
+_bench_selected (const char *names, const char *name)
+{
+  size_t len = strlen (name);
+  const char *p;
+
+  if (! names)
+    return 1;
+  for (p = names; (p = strstr (p, name)) != NULL; p += len)
+    if ((p == names || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+      return 1;
+  return 0;
+}
+
+static void
+_bench_write_json (FILE *fp, const char *route_file, int family,
+                   struct rib_tree *rib_tree, int nthreads, uint64_t lookups,
+                   struct bench_target *targets, int num_targets)
+{
+  int i;
+
+  fprintf (fp, "{\n  \"route_file\": \"%s\",\n", route_file);
+  fprintf (fp, "  \"family\": %d,\n", family == AF_INET ? 4 : 6);
+  fprintf (fp, "  \"prefixes\": %" PRIu64 ",\n", rib_tree->num_prefixes);
+  fprintf (fp, "  \"threads\": %d,\n", nthreads);
+  fprintf (fp, "  \"lookups\": %" PRIu64 ",\n", lookups);
+  fprintf (fp, "  \"batch\": %d,\n", BENCH_BATCH);
+  fprintf (fp, "  \"structures\": [");
+  for (i = 0; i < num_targets; i++)
+    {
+      struct bench_target *t = &targets[i];
+
+      fprintf (fp, "%s\n    {\"name\": \"%s\", ", i ? "," : "", t->name);
+      if (t->build_sec < 0.0)
+        fprintf (fp, "\"build_sec\": null, ");
+      else
+        fprintf (fp, "\"build_sec\": %.6f, ", t->build_sec);
+      fprintf (fp, "\"memory_bytes\": %" PRIu64 ", ", t->mem_size);
+      fprintf (fp, "\"lookups_per_sec\": %.0f,\n", t->qps);
+      fprintf (fp, "     \"latency_ns\": {\"p50\": %.2f, \"p90\": %.2f, "
+                   "\"p99\": %.2f, \"p99.9\": %.2f, \"max\": %.2f}}",
+               _bench_latency (t, 500), _bench_latency (t, 900),
+               _bench_latency (t, 990), _bench_latency (t, 999),
+               _bench_latency (t, 1000));
+    }
+  fprintf (fp, "\n  ]\n}\n");
+}
+
+static int
+_run_bench (const char *route_file, struct rib_tree *rib_tree,
+            struct ptree *ptree, int family, const char *names, int nthreads,
+            uint64_t lookups, const char *json_path)
+{
+  struct bench_target targets[BENCH_MAX_TARGETS];
+  uint8_t (*addrs)[16];
+  int i, num_targets = 0, ret = 0;
+  double t1;
+  FILE *fp;
+
+  _bench_family = family;
+  addrs = _bench_addrs (rib_tree, family);
+  if (! addrs)
+    {
+      fprintf (stderr, "ERROR: cannot make the address stream\n");
+      return -1;
+    }
+
+  /* the structures: FIB engines, then the RIB radix and ptree */
+  memset (targets, 0, sizeof (targets));
+  for (i = 0; fib_engines[i]; i++)
+    {
+      struct bench_target *t = &targets[num_targets];
+
+      if (! _bench_selected (names, fib_engines[i]->name)
+          || (family == AF_INET6 && ! fib_engines[i]->ipv6))
+        continue;
+      t1 = now_seconds ();
+      if (fib_engine_build (&t->engine, fib_engines[i], rib_tree) != 0)
+        {
+          ret = -1;
+          goto out;
+        }
+      t->build_sec = now_seconds () - t1;
+      t->name = fib_engines[i]->name;
+      t->data = t->engine.data;
+      t->lookup_bulk = fib_engines[i]->lookup_bulk;
+      t->mem_size = fib_engines[i]->mem_size (t->data);
+      num_targets++;
+    }
+  if (_bench_selected (names, "radix"))
+    targets[num_targets++] = (struct bench_target){
+      .name = "radix", .data = rib_tree, .lookup_bulk = _radix_lookup_bulk,
+      .build_sec = -1.0, .mem_size = rib_tree->mem_size
+    };
+  if (_bench_selected (names, "ptree"))
+    targets[num_targets++] = (struct bench_target){
+      .name = "ptree", .data = ptree, .lookup_bulk = _ptree_lookup_bulk,
+      .build_sec = -1.0, .mem_size = _ptree_mem_size (ptree)
+    };
+  if (num_targets == 0)
+    {
+      fprintf (stderr, "ERROR: no structure to benchmark\n");
+      ret = -1;
+      goto out;
+    }
+
+  for (i = 0; i < num_targets; i++)
+    {
+      printf ("benchmarking %s...\n", targets[i].name);
+      if (_bench_run (&targets[i], addrs, lookups, nthreads) != 0)
+        {
+          ret = -1;
+          goto out;
+        }
+    }
+
+  printf ("============================================\n");
+  printf ("benchmark: %s, %" PRIu64 " prefixes, %d threads, %" PRIu64
+          " lookups\n",
+          route_file, rib_tree->num_prefixes, nthreads, lookups);
+  printf ("latency per lookup (nsec) over batches of %d\n", BENCH_BATCH);
+  printf ("%-11s %10s %12s %10s %8s %8s %8s %8s %8s\n", "structure",
+          "build(s)", "memory(B)", "Mlookup/s", "p50", "p90", "p99",
+          "p99.9", "max");
+  for (i = 0; i < num_targets; i++)
+    {
+      struct bench_target *t = &targets[i];
+
+      printf ("%-11s ", t->name);
+      if (t->build_sec < 0.0)
+        printf ("%10s ", "-");
+      else
+        printf ("%10.6f ", t->build_sec);
+      printf ("%12" PRIu64 " %10.3f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+              t->mem_size, t->qps / 1e6, _bench_latency (t, 500),
+              _bench_latency (t, 900), _bench_latency (t, 990),
+              _bench_latency (t, 999), _bench_latency (t, 1000));
+    }
+  printf ("============================================\n");
+
+  if (json_path)
+    {
+      fp = fopen (json_path, "w");
+      if (! fp)
+        {
+          fprintf (stderr, "ERROR: cannot open %s\n", json_path);
+          ret = -1;
+          goto out;
+        }
+      _bench_write_json (fp, route_file, family, rib_tree, nthreads, lookups,
+                         targets, num_targets);
+      fclose (fp);
+      printf ("results written to %s\n", json_path);
+    }
+
+out:
+  for (i = 0; i < BENCH_MAX_TARGETS; i++)
+    {
+      if (targets[i].engine.data)
+        fib_engine_free (&targets[i].engine);
+      free (targets[i].latency);
+    }
+  free (addrs);
+  return ret;
+}
+
+/* -------------------------------------------
+ * RIB bulk load
+ * 読み込んだRIBの経路 (プレフィックスと選択されたnexthop id) を
+ * ランダムな順に並べ, rib_route_add で1つずつ追加した場合 (ランダム順,
+ * ソート済みの順) と rib_bulk_load (ソートを含む) の時間を比べ,
+ * できた木が同じ形であることを確かめる.
+ * ------------------------------------------- */
+struct _bulk_export_arg
+{
+  struct rib_bulk_entry *routes;
+  int num;
+};
+
+static int
+_bulk_export (struct rib_node *n, void *arg)
+{
+  struct _bulk_export_arg *x = (struct _bulk_export_arg *) arg;
+  struct rib_bulk_entry *e = &x->routes[x->num++];
+
+  memset (e->key, 0, sizeof (e->key));
+  memcpy (e->key, n->key, KEY_SIZE (n->keylen));
+  e->keylen = n->keylen;
+  e->route_idx = n->route_idx[0];
+  return 0;
+}
+
+/*
+ * 1 iff the trees have the same nodes and selected routes.
+ * the stack holds pairs of nodes, at most one pending pair per depth.
+ */
+static int
+_rib_same_tree (struct rib_node *a, struct rib_node *b)
+{
+  struct rib_node *stack[2 * RIB_STACK_SIZE];
+  int sp = 0;
+
+  stack[sp++] = a;
+  stack[sp++] = b;
+  while (sp > 0)
+    {
+      b = stack[--sp];
+      a = stack[--sp];
+      if (! a || ! b)
+        {
+          if (a != b)
+            return 0;
+          continue;
+        }
+      if (a->keylen != b->keylen || a->valid != b->valid
+          || (a->valid && a->route_idx[0] != b->route_idx[0])
+          || memcmp (a->key, b->key, KEY_SIZE (a->keylen)) != 0)
+        return 0;
+      if (sp + 4 > 2 * RIB_STACK_SIZE)
+        {
+          fprintf (stderr, "ERROR: RIB deeper than %d levels\n",
+                   RIB_STACK_SIZE);
+          return 0;
+        }
+      stack[sp++] = a->right;
+      stack[sp++] = b->right;
+      stack[sp++] = a->left;
+      stack[sp++] = b->left;
+    }
+  return 1;
+}
+
+static double
+_bulk_insert_each (struct rib_tree *t, const struct rib_bulk_entry *routes,
+                   int num)
+{
+  double t1;
+  int i;
+
+  t1 = now_seconds ();
+  for (i = 0; i < num; i++)
+    if (rib_route_add (t, routes[i].key, routes[i].keylen,
+                       routes[i].route_idx)
+        < 0)
+      return -1.0;
+  return now_seconds () - t1;
+}
+
+static int
+_run_rib_bulk_load (struct rib_tree *rib_tree)
+{
+  struct _bulk_export_arg x;
+  struct rib_bulk_entry *input = NULL, *sorted = NULL, tmp;
+  struct rib_tree *each = NULL, *each_sorted = NULL, *bulk = NULL;
+  double sec_each, sec_sorted, sec_bulk, t1;
+  int i, j, num, ret = -1;
+
+  num = (int) rib_tree->num_prefixes;
+  if (num == 0)
+    return 0;
+  x.routes = input = malloc (num * sizeof (struct rib_bulk_entry));
+  sorted = malloc (num * sizeof (struct rib_bulk_entry));
+  each = rib_new (NULL);
+  each_sorted = rib_new (NULL);
+  bulk = rib_new (NULL);
+  if (! input || ! sorted || ! each || ! each_sorted || ! bulk)
+    {
+      fprintf (stderr, "ERROR: cannot allocate the bulk load test\n");
+      goto out;
+    }
+  each->family = each_sorted->family = bulk->family = rib_tree->family;
+
+  /* routes in random order */
+  x.num = 0;
+  rib_traverse (rib_tree, _bulk_export, &x);
+  for (i = num - 1; i > 0; i--)
+    {
+      j = xorshift32 () % (i + 1);
+      tmp = input[i];
+      input[i] = input[j];
+      input[j] = tmp;
+    }
+  memcpy (sorted, input, num * sizeof (struct rib_bulk_entry));
+
+  sec_each = _bulk_insert_each (each, input, num);
+  t1 = now_seconds ();
+  if (rib_bulk_load (bulk, sorted, num) != 0)
+    {
+      fprintf (stderr, "ERROR: rib_bulk_load failed\n");
+      goto out;
+    }
+  sec_bulk = now_seconds () - t1;
+  sec_sorted = _bulk_insert_each (each_sorted, sorted, num);
+  if (sec_each < 0 || sec_sorted < 0)
+    {
+      fprintf (stderr, "ERROR: rib_route_add failed\n");
+      goto out;
+    }
+
+  printf ("============================================\n");
+  printf ("RIB bulk load: %d prefixes\n", num);
+  printf ("  rib_route_add (random order): %.6f sec (%.3fM routes/sec)\n",
+          sec_each, sec_each > 0 ? num / sec_each / 1e6 : 0.0);
+  printf ("  rib_route_add (sorted order): %.6f sec (%.3fM routes/sec)\n",
+          sec_sorted, sec_sorted > 0 ? num / sec_sorted / 1e6 : 0.0);
+  printf ("  rib_bulk_load (with sort):    %.6f sec (%.3fM routes/sec), "
+          "x%.2f of random order\n",
+          sec_bulk, sec_bulk > 0 ? num / sec_bulk / 1e6 : 0.0,
+          sec_bulk > 0 ? sec_each / sec_bulk : 0.0);
+  printf ("  nodes: %" PRIu64 " (one by one: %" PRIu64 "), block %zu bytes "
+          "(one by one: %" PRIu64 " bytes)\n",
+          bulk->num_nodes, each->num_nodes, bulk->bulk_size, each->mem_size);
+
+  if (bulk->num_prefixes != each->num_prefixes
+      || bulk->num_nodes != each->num_nodes
+      || ! _rib_same_tree (bulk->root, each->root)
+      || ! _rib_same_tree (bulk->root, rib_tree->root))
+    {
+      printf ("  *** FAILED: the bulk loaded RIB differs ***\n");
+      printf ("============================================\n");
+      goto out;
+    }
+  printf ("  the trees are the same\n");
+  printf ("============================================\n");
+  ret = 0;
+
+out:
+  rib_free (each);
+  rib_free (each_sorted);
+  rib_free (bulk);
+  free (input);
+  free (sorted);
+  return ret;
+}
+
+/* -------------------------------------------
+ * Update stream replay
+ * ファイル形式: "<A|W> <cidr> <next-hop-ip>"
+ * 例: "A 10.0.0.0/8 192.0.2.1" (announce), "W 10.0.0.0/8 192.0.2.1" (withdraw)
+ * ------------------------------------------- */
+#define REPLAY_LOOKUP_BATCH 256
+#define REPLAY_BASELINE_SEC 1.0
+
+struct route_update
+{
+  int withdraw;
+  int plen;
+  int route_idx;
+  uint8_t key[16];
+  struct rib_path path; // source, peer, distance, metric
+  int match_nexthop;    // withdraw only if the nexthop matches
+};
+
+static const char *_source_names[RIB_SOURCE_MAX] = {
+  [RIB_SOURCE_CONNECTED] = "connected",
+  [RIB_SOURCE_STATIC] = "static",
+  [RIB_SOURCE_IGP] = "igp",
+  [RIB_SOURCE_BGP] = "bgp",
+};
+
+/*
+ * parse the optional fields "[<source> [<peer> [<metric> [<distance>]]]]".
+ * peer is an IPv4 address or a number.
+ */
+static int
+_parse_path (int nfields, const char *src_buf, const char *peer_buf,
+             const char *metric_buf, const char *dist_buf,
+             struct rib_path *path)
+{
+  struct in_addr peer;
+  char *end;
+  int i;
+
+  memset (path, 0, sizeof (struct rib_path));
+  path->source = RIB_SOURCE_STATIC;
+  if (nfields >= 4)
+    {
+      for (i = 0; i < RIB_SOURCE_MAX; i++)
+        if (strcmp (src_buf, _source_names[i]) == 0)
+          break;
+      if (i == RIB_SOURCE_MAX)
+        return -1;
+      path->source = i;
+    }
+  path->distance = rib_source_distance (path->source);
+
+  if (nfields >= 5)
+    {
+      if (inet_pton (AF_INET, peer_buf, &peer) == 1)
+        path->peer = ntohl (peer.s_addr);
+      else
+        {
+          path->peer = strtoul (peer_buf, &end, 0);
+          if (*end != '\0')
+            return -1;
+        }
+    }
+  if (nfields >= 6)
+    {
+      path->metric = strtoul (metric_buf, &end, 0);
+      if (*end != '\0')
+        return -1;
+    }
+  if (nfields >= 7)
+    {
+      path->distance = strtol (dist_buf, &end, 0);
+      if (*end != '\0' || path->distance < 0)
+        return -1;
+    }
+  return 0;
+}
+
+struct replay_lookup_arg
+{
+  struct fib_tree *fib_tree;
+  pthread_rwlock_t *lock;
+  volatile int *stop;
+  uint32_t seed;
+  uint64_t lookups;
+};
+
+/* release the nexthop references held by the updates */
+static void
+_free_updates (struct route_update *updates, int num_updates)
+{
+  int i;
+
+  for (i = 0; i < num_updates; i++)
+    route_table_unref (&route_table, updates[i].route_idx);
+  free (updates);
+}
+
+static int
+_load_updates (const char *path, int family, struct route_update **updates,
+               int *num_updates)
+{
+  FILE *fp;
+  struct route_update *u, *array = NULL;
+  char line[LINE_BUF_SIZE];
+  char op_buf[IP_BUF_SIZE];
+  char cidr_buf[IP_BUF_SIZE];
+  char nh_buf[IP_BUF_SIZE];
+  char src_buf[IP_BUF_SIZE];
+  char peer_buf[IP_BUF_SIZE];
+  char metric_buf[IP_BUF_SIZE];
+  char dist_buf[IP_BUF_SIZE];
+  uint8_t nh_net_u8[16];
+  int n = 0, size = 0, nfields;
+
+  printf ("Loading updates from file: %s\n", path);
+  fp = fopen (path, "r");
+  if (! fp)
+    {
+      fprintf (stderr, "ERROR: cannot open update file: %s\n", path);
+      return -1;
+    }
+
+  while (fgets (line, sizeof (line), fp))
+    {
+      nfields = sscanf (line, "%63s %63s %63s %63s %63s %63s %63s", op_buf,
+                        cidr_buf, nh_buf, src_buf, peer_buf, metric_buf,
+                        dist_buf);
+      if (nfields < 3
+          || (strcmp (op_buf, "A") != 0 && strcmp (op_buf, "W") != 0))
+        {
+          fprintf (stderr,
+                   "WARN: skip invalid line (need: \"<A|W> <cidr> "
+                   "<nexthop> [<source> [<peer> [<metric> [<distance>]]]]\"): "
+                   "%s",
+                   line);
+          continue;
+        }
+
+      if (n == size)
+        {
+          size = size ? size * 2 : 1024;
+          u = realloc (array, size * sizeof (struct route_update));
+          if (! u)
+            {
+              fprintf (stderr, "ERROR: cannot allocate update array\n");
+              _free_updates (array, n);
+              fclose (fp);
+              return -1;
+            }
+          array = u;
+        }
+
+      u = &array[n];
+      memset (u, 0, sizeof (struct route_update));
+      u->withdraw = (op_buf[0] == 'W');
+      u->plen = inet_net_pton (family, cidr_buf, u->key, sizeof (u->key));
+      if (u->plen < 0)
+        {
+          fprintf (stderr, "WARN: invalid CIDR \"%s\" (skip)\n", cidr_buf);
+          continue;
+        }
+
+      memset (nh_net_u8, 0, sizeof (nh_net_u8));
+      if (! inet_pton (family, nh_buf, nh_net_u8))
+        {
+          fprintf (stderr, "WARN: invalid next-hop \"%s\" (skip)\n", nh_buf);
+          continue;
+        }
+
+      if (_parse_path (nfields, src_buf, peer_buf, metric_buf, dist_buf,
+                       &u->path) != 0)
+        {
+          fprintf (stderr, "WARN: invalid source/peer/metric/distance "
+                           "(skip): %s",
+                   line);
+          continue;
+        }
+      /* legacy lines without a source withdraw the given nexthop only */
+      u->match_nexthop = (nfields < 4);
+
+      u->route_idx = route_table_add_entry (&route_table, family, nh_net_u8, 0);
+      if (u->route_idx < 0)
+        {
+          fprintf (stderr, "ERROR: route table is full\n");
+          _free_updates (array, n);
+          fclose (fp);
+          return -1;
+        }
+      n++;
+    }
+
+  printf ("Total %d updates loaded\n", n);
+  fclose (fp);
+  *updates = array;
+  *num_updates = n;
+  return 0;
+}
+
+/*
+ * apply one update to the RIB, and to the FIB only if the best path has
+ * changed. returns 1 if ignored, 2 if the best path is unchanged
+ */
+static int
+_apply_update (struct rib_tree *rib_tree, struct fib_tree *fib_tree,
+               const struct route_update *u, uint64_t *fib_ns)
+{
+  struct rib_path path = u->path;
+  uint64_t t1;
+  int changed, ret;
+
+  path.route_idx = u->route_idx;
+  if (u->withdraw)
+    {
+      if (! u->match_nexthop)
+        path.route_idx = -1;
+      if (rib_path_withdraw (rib_tree, u->key, u->plen, &path, &changed)
+          != 0)
+        return 1; // unknown route
+    }
+  else
+    {
+      if (rib_path_update (rib_tree, u->key, u->plen, &path, &changed) != 0)
+        return -1;
+    }
+
+  if (! changed)
+    return 2; // non-best path, FIB untouched
+
+  t1 = now_nanoseconds ();
+  ret = update_fib_from_rib (rib_tree, fib_tree, u->key, u->plen);
+  *fib_ns = now_nanoseconds () - t1;
+  return ret != 0 ? -1 : 0;
+}
+
+/* print percentiles of latencies in nsec (sorted in place) */
+static void
+_print_latency (const char *name, uint64_t *latency, int n)
+{
+  uint64_t sum = 0;
+  int i;
+
+  if (n == 0)
+    return;
+  qsort (latency, n, sizeof (uint64_t), _compare_u64);
+  for (i = 0; i < n; i++)
+    sum += latency[i];
+  printf ("%s (usec): p50 %.3f | p90 %.3f | p99 %.3f | p99.9 %.3f | "
+          "max %.3f | avg %.3f\n",
+          name, latency[(uint64_t)n * 50 / 100] / 1e3,
+          latency[(uint64_t)n * 90 / 100] / 1e3,
+          latency[(uint64_t)n * 99 / 100] / 1e3,
+          latency[(uint64_t)n * 999 / 1000] / 1e3, latency[n - 1] / 1e3,
+          (double)sum / n / 1e3);
+}
+
+/* keep the ground truth in sync with the best path in the RIB */
+static void
+_sync_ptree (struct ptree *ptree, struct rib_tree *rib_tree,
+             const struct route_update *u)
+{
+  struct ptree_node *x;
+  struct rib_node *n;
+
+  n = rib_route_lookup_exact (rib_tree, u->key, u->plen);
+  if (n && n->valid)
+    ptree_add ((char *)u->key, u->plen,
+               route_table_nexthop (&route_table, nhg_primary (n->route_idx[0])),
+               ptree);
+  else
+    {
+      x = ptree_search_exact ((char *)u->key, u->plen, ptree);
+      if (x)
+        x->data = NULL;
+    }
+}
+
+static void *
+_replay_lookup_thread (void *arg)
+{
+  struct replay_lookup_arg *a = (struct replay_lookup_arg *)arg;
+  uint32_t s = a->seed;
+  uint8_t rand_net_u8[4];
+  uintptr_t sink = 0;
+  int i;
+
+  while (! *a->stop)
+    {
+      pthread_rwlock_rdlock (a->lock);
+      for (i = 0; i < REPLAY_LOOKUP_BATCH; i++)
+        {
+          s ^= s << 13;
+          s ^= s >> 17;
+          s ^= s << 5;
+          uint32_to_ipv4_bytes_hton (s, rand_net_u8);
+          sink ^= (uintptr_t)fib_route_lookup (a->fib_tree, rand_net_u8);
+        }
+      pthread_rwlock_unlock (a->lock);
+      a->lookups += REPLAY_LOOKUP_BATCH;
+    }
+
+  return (void *)sink;
+}
+
+static int
+_start_lookup_threads (pthread_t *threads, struct replay_lookup_arg *args,
+                       int nthreads, struct fib_tree *fib_tree,
+                       pthread_rwlock_t *lock, volatile int *stop)
+{
+  int i;
+
+  *stop = 0;
+  for (i = 0; i < nthreads; i++)
+    {
+      args[i].fib_tree = fib_tree;
+      args[i].lock = lock;
+      args[i].stop = stop;
+      args[i].seed = 0x9E3779B9u * (i + 1);
+      args[i].lookups = 0;
+      if (pthread_create (&threads[i], NULL, _replay_lookup_thread,
+                          &args[i]) != 0)
+        {
+          *stop = 1;
+          while (i-- > 0)
+            pthread_join (threads[i], NULL);
+          return -1;
+        }
+    }
+  return 0;
+}
+
+static uint64_t
+_stop_lookup_threads (pthread_t *threads, struct replay_lookup_arg *args,
+                      int nthreads, volatile int *stop)
+{
+  uint64_t lookups = 0;
+  int i;
+
+  *stop = 1;
+  for (i = 0; i < nthreads; i++)
+    {
+      pthread_join (threads[i], NULL);
+      lookups += args[i].lookups;
+    }
+  return lookups;
+}
+
+static int
+_run_update_replay (struct rib_tree *rib_tree, struct fib_tree *fib_tree,
+                    struct tbm_tree *tbm, struct ptree *ptree,
+                    const char *path, int family, int nthreads)
+{
+  struct route_update *updates = NULL;
+  struct replay_lookup_arg *args = NULL;
+  pthread_t *threads = NULL;
+  pthread_rwlockattr_t attr;
+  pthread_rwlock_t lock;
+  volatile int stop = 1;
+  uint64_t *latency = NULL;
+  uint64_t *fib_latency = NULL, *tbm_latency = NULL;
+  uint64_t t1, t2, lookups, compacted;
+  double elapsed, base_qps = 0.0, churn_qps = 0.0;
+  int i, ret, num_updates = 0, replayed = 0, ignored = 0, unchanged = 0;
+  int num_fib_updates = 0;
+  int entries, groups;
+
+  entries = route_table_count (&route_table);
+  groups = nhg_count ();
+  if (_load_updates (path, family, &updates, &num_updates) != 0)
+    return -1;
+  if (num_updates == 0)
+    {
+      _free_updates (updates, num_updates);
+      return 0;
+    }
+
+  latency = malloc (num_updates * sizeof (uint64_t));
+  fib_latency = malloc (num_updates * sizeof (uint64_t));
+  tbm_latency = malloc (num_updates * sizeof (uint64_t));
+  threads = calloc (nthreads + 1, sizeof (pthread_t));
+  args = calloc (nthreads + 1, sizeof (struct replay_lookup_arg));
+  if (! latency || ! fib_latency || ! tbm_latency || ! threads || ! args)
+    {
+      fprintf (stderr, "ERROR: cannot allocate replay buffers\n");
+      _free_updates (updates, num_updates);
+      free (latency);
+      free (fib_latency);
+      free (tbm_latency);
+      free (threads);
+      free (args);
+      return -1;
+    }
+
+  /* prefer the writer so that lookup threads cannot starve the updates */
+  pthread_rwlockattr_init (&attr);
+  pthread_rwlockattr_setkind_np (&attr,
+                                 PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init (&lock, &attr);
+  pthread_rwlockattr_destroy (&attr);
+
+  printf ("============================================\n");
+  printf ("update replay: %d updates, %d lookup threads\n", num_updates,
+          nthreads);
+
+  /* baseline lookup throughput without churn */
+  if (nthreads > 0)
+    {
+      if (_start_lookup_threads (threads, args, nthreads, fib_tree, &lock,
+                                 &stop) != 0)
+        {
+          ret = -1;
+          goto out;
+        }
+      t1 = now_nanoseconds ();
+      do
+        {
+          struct timespec ts = { 0, 10000000 }; // 10ms
+          nanosleep (&ts, NULL);
+          t2 = now_nanoseconds ();
+        }
+      while ((double)(t2 - t1) / 1e9 < REPLAY_BASELINE_SEC);
+      lookups = _stop_lookup_threads (threads, args, nthreads, &stop);
+      elapsed = (double)(now_nanoseconds () - t1) / 1e9;
+      base_qps = (double)lookups / elapsed;
+    }
+
+  /* replay updates while the lookup threads keep running */
+  if (nthreads > 0 && _start_lookup_threads (threads, args, nthreads,
+                                             fib_tree, &lock, &stop) != 0)
+    {
+      ret = -1;
+      goto out;
+    }
+
+  ret = 0;
+  compacted = fib_tree->compacted;
+  t1 = now_nanoseconds ();
+  for (i = 0; i < num_updates; i++)
+    {
+      uint64_t u1, u2;
+
+      u1 = now_nanoseconds ();
+      pthread_rwlock_wrlock (&lock);
+      ret = _apply_update (rib_tree, fib_tree, &updates[i],
+                           &fib_latency[num_fib_updates]);
+      pthread_rwlock_unlock (&lock);
+      u2 = now_nanoseconds ();
+
+      /* the same change to the Tree Bitmap, timed on its own */
+      if (ret == 0 && tbm)
+        {
+          uint64_t b1 = now_nanoseconds ();
+          if (tbm_update_from_rib (tbm, rib_tree, updates[i].key,
+                                   updates[i].plen)
+              != 0)
+            ret = -1;
+          tbm_latency[num_fib_updates] = now_nanoseconds () - b1;
+        }
+      if (ret == 0)
+        num_fib_updates++;
+
+      if (ret < 0)
+        {
+          fprintf (stderr, "ERROR: failed to apply update #%d\n", i + 1);
+          break;
+        }
+      if (ret == 1)
+        ignored++;
+      else if (ret == 2)
+        unchanged++;
+      latency[replayed++] = u2 - u1;
+    }
+  t2 = now_nanoseconds ();
+  elapsed = (double)(t2 - t1) / 1e9;
+
+  if (nthreads > 0)
+    {
+      lookups = _stop_lookup_threads (threads, args, nthreads, &stop);
+      churn_qps = (elapsed > 0.0) ? (double)lookups / elapsed : 0.0;
+    }
+
+  if (ret < 0)
+    goto out;
+  if (ret > 0)
+    ret = 0; // the last update was ignored (1) or not best (2): not errors
+
+  for (i = 0; i < num_updates; i++)
+    _sync_ptree (ptree, rib_tree, &updates[i]);
+  _free_updates (updates, num_updates);
+  updates = NULL;
+  num_updates = 0;
+
+  qsort (latency, replayed, sizeof (uint64_t), _compare_u64);
+
+  printf ("replayed: %d updates (%d ignored) in %.6f sec\n", replayed,
+          ignored, elapsed);
+  printf ("best path changed: %d updates (%d without FIB update)\n",
+          replayed - ignored - unchanged, unchanged);
+  printf ("nexthops: %d -> %d route entries, %d -> %d groups\n", entries,
+          route_table_count (&route_table), groups, nhg_count ());
+  printf ("update per second: %.3fK updates/sec\n",
+          (elapsed > 0.0) ? (double)replayed / elapsed / 1e3 : 0.0);
+  printf ("update latency (usec): p50 %.3f | p90 %.3f | p99 %.3f | "
+          "p99.9 %.3f | max %.3f\n",
+          latency[(uint64_t)replayed * 50 / 100] / 1e3,
+          latency[(uint64_t)replayed * 90 / 100] / 1e3,
+          latency[(uint64_t)replayed * 99 / 100] / 1e3,
+          latency[(uint64_t)replayed * 999 / 1000] / 1e3,
+          latency[replayed - 1] / 1e3);
+  if (fib_tree->compact)
+    printf ("compaction: %" PRIu64 " nodes removed\n",
+            fib_tree->compacted - compacted);
+  if (tbm)
+    {
+      _print_latency ("FIB update latency", fib_latency, num_fib_updates);
+      _print_latency ("Tree Bitmap update latency", tbm_latency,
+                      num_fib_updates);
+    }
+  if (nthreads > 0 && churn_qps == 0.0)
+    printf ("lookup throughput drop: n/a (replay too short to measure)\n");
+  else if (nthreads > 0)
+    {
+      printf ("lookup per second (idle):  %.6fM lookups/sec\n",
+              base_qps / 1e6);
+      printf ("lookup per second (churn): %.6fM lookups/sec\n",
+              churn_qps / 1e6);
+      printf ("lookup throughput drop: %.2f%%\n",
+              (base_qps > 0.0) ? (1.0 - churn_qps / base_qps) * 100.0 : 0.0);
+    }
+  printf ("============================================\n");
+
+out:
+  pthread_rwlock_destroy (&lock);
+  _free_updates (updates, num_updates);
+  free (latency);
+  free (fib_latency);
+  free (tbm_latency);
+  free (threads);
+  free (args);
+  return ret;
+}
+
+/* -------------------------------------------
+ * Nexthop hash benchmark
+ * route_tableのハッシュ関数を比較する: ハッシュ速度と, 同じnexthop集合で
+ * 作ったテーブルの平均/最大probe長.
+ * ------------------------------------------- */
+#define HASH_BENCH_HASHES  (1 << 24)
+#define HASH_BENCH_SEQ     65536 // synthetic set: consecutive addresses
+
+static void
+_hash_benchmark_set (const char *name, uint8_t (*keys)[16], int num_keys,
+                     int family)
+{
+  struct route_table t;
+  struct route_table_stats st;
+  uint64_t t1, ns, n, rounds;
+  uint32_t sink = 0;
+  int type, i;
+
+  printf ("%s: %d nexthops\n", name, num_keys);
+  rounds = (HASH_BENCH_HASHES + num_keys - 1) / num_keys;
+  for (type = ROUTE_HASH_DEFAULT + 1; type < ROUTE_HASH_TYPE_MAX; type++)
+    {
+      if (! route_table_hash_supported (type))
+        {
+          printf ("  %-8s: not supported on this CPU\n",
+                  route_table_hash_name (type));
+          continue;
+        }
+
+      t1 = now_nanoseconds ();
+      for (n = 0; n < rounds; n++)
+        for (i = 0; i < num_keys; i++)
+          sink += route_table_hash (type, keys[i], 0);
+      ns = now_nanoseconds () - t1;
+
+      memset (&t, 0, sizeof (t));
+      route_table_set_hash (&t, type);
+      for (i = 0; i < num_keys; i++)
+        route_table_add_entry (&t, family, keys[i], 0);
+      route_table_get_stats (&t, &st);
+      route_table_free (&t);
+
+      printf ("  %-8s: %8.2f M hashes/sec (%5.2f ns/hash), "
+              "probe length avg %.3f max %u (load factor %.2f)\n",
+              route_table_hash_name (type),
+              ns ? (double)(rounds * num_keys) / ((double)ns / 1e9) / 1e6
+                 : 0.0,
+              (double)ns / (rounds * num_keys), st.avg_probe, st.max_probe,
+              st.load_factor);
+    }
+  (void)sink;
+}
+
+static int
+_run_hash_benchmark (const char *path, int family)
+{
+  FILE *fp;
+  char line[LINE_BUF_SIZE];
+  char tok_buf[IP_BUF_SIZE];
+  uint8_t (*keys)[16] = NULL, (*p)[16];
+  uint8_t nh[16];
+  int num_keys = 0, size = 0, pos, len, i, addr_len;
+  uint32_t base;
+  struct route_table seen;
+
+  fp = fopen (path, "r");
+  if (! fp)
+    {
+      fprintf (stderr, "ERROR: cannot open route file: %s\n", path);
+      return -1;
+    }
+
+  /* distinct nexthops of the route file (every column after the prefix) */
+  memset (&seen, 0, sizeof (seen));
+  while (fgets (line, sizeof (line), fp))
+    {
+      if (sscanf (line, "%63s%n", tok_buf, &pos) != 1)
+        continue;
+      while (sscanf (line + pos, "%63s%n", tok_buf, &len) == 1)
+        {
+          pos += len;
+          memset (nh, 0, sizeof (nh));
+          if (! inet_pton (family, tok_buf, nh))
+            continue;
+          i = route_table_add_entry (&seen, family, nh, 0);
+          if (i < 0 || route_table_entry (&seen, i)->ref_count > 1)
+            continue;
+          if (num_keys == size)
+            {
+              size = size ? size * 2 : 1024;
+              p = realloc (keys, size * sizeof (*keys));
+              if (! p)
+                {
+                  fprintf (stderr, "ERROR: cannot allocate nexthop keys\n");
+                  free (keys);
+                  route_table_free (&seen);
+                  fclose (fp);
+                  return -1;
+                }
+              keys = p;
+            }
+          memcpy (keys[num_keys++], nh, 16);
+        }
+    }
+  route_table_free (&seen);
+  fclose (fp);
+
+  if (num_keys == 0)
+    {
+      fprintf (stderr, "ERROR: no nexthop in %s\n", path);
+      free (keys);
+      return -1;
+    }
+
+  printf ("============================================\n");
+  printf ("nexthop hash benchmark\n");
+  _hash_benchmark_set (path, keys, num_keys, family);
+
+  /*
+   * consecutive addresses after the first nexthop, as in a large nexthop
+   * subnet: structured keys that differ only in the low bytes.
+   */
+  p = malloc (HASH_BENCH_SEQ * sizeof (*keys));
+  if (p)
+    {
+      addr_len = (family == AF_INET6) ? 16 : 4;
+      memcpy (&base, keys[0] + addr_len - 4, 4);
+      base = ntohl (base);
+      for (i = 0; i < HASH_BENCH_SEQ; i++)
+        {
+          uint32_t a = htonl (base + i);
+          memcpy (p[i], keys[0], 16);
+          memcpy (p[i] + addr_len - 4, &a, 4);
+        }
+      _hash_benchmark_set ("consecutive addresses", p, HASH_BENCH_SEQ,
+                           family);
+      free (p);
+    }
+  printf ("============================================\n");
+
+  free (keys);
+  return 0;
+}
+
+/* -------------------------------------------
+ * Ring benchmark
+ * queue.c, spsc_ring, mpmc_ring で void * を受け渡す速度を比べる.
+ * - 1スレッド: RING_BENCH_BURST個入れて取り出すのを繰り返す (競合なし).
+ * - スレッド間: 生産者が 1..items を分担して入れ, 消費者が取り出した値の
+ *   和と個数を確かめる. 満杯/空の時は再試行する (yield).
+ * ------------------------------------------- */
+#define RING_BENCH_SIZE  1024
+#define RING_BENCH_BURST 32
+
+static volatile uintptr_t _ring_sink;
+
+struct _ring_bench_arg
+{
+  struct spsc_ring *spsc;
+  struct mpmc_ring *mpmc;
+  uint64_t first; // producers: values first .. first + num - 1
+  uint64_t num;
+  uint32_t burst;
+  uint64_t total;
+  uint64_t *consumed; // shared by the consumers
+  int *stop;          // set if a thread could not be created
+  uint64_t sum;
+  uint64_t count;
+};
+
+static void *
+_ring_bench_producer (void *arg)
+{
+  struct _ring_bench_arg *a = (struct _ring_bench_arg *) arg;
+  void *buf[RING_BENCH_BURST];
+  uint64_t i = 0;
+  uint32_t n, k, j;
+
+  while (i < a->num)
+    {
+      n = a->num - i < a->burst ? (uint32_t) (a->num - i) : a->burst;
+      for (j = 0; j < n; j++)
+        buf[j] = (void *) (uintptr_t) (a->first + i + j);
+      for (j = 0; j < n; j += k)
+        {
+          k = a->spsc ? spsc_ring_enqueue_burst (a->spsc, buf + j, n - j)
+                      : mpmc_ring_enqueue_burst (a->mpmc, buf + j, n - j);
+          if (k > 0)
+            continue;
+          /* the ring stays full without consumers */
+          if (__atomic_load_n (a->stop, __ATOMIC_ACQUIRE))
+            return NULL;
+          sched_yield ();
+        }
+      i += n;
+    }
+  return NULL;
+}
+
+static void *
+_ring_bench_consumer (void *arg)
+{
+  struct _ring_bench_arg *a = (struct _ring_bench_arg *) arg;
+  void *buf[RING_BENCH_BURST];
+  uint32_t n, j;
+
+  while (__atomic_load_n (a->consumed, __ATOMIC_RELAXED) < a->total)
+    {
+      n = a->spsc ? spsc_ring_dequeue_burst (a->spsc, buf, a->burst)
+                  : mpmc_ring_dequeue_burst (a->mpmc, buf, a->burst);
+      if (n == 0)
+        {
+          /* the ring stays empty without producers */
+          if (__atomic_load_n (a->stop, __ATOMIC_ACQUIRE))
+            return NULL;
+          sched_yield ();
+          continue;
+        }
+      for (j = 0; j < n; j++)
+        a->sum += (uintptr_t) buf[j];
+      a->count += n;
+      __atomic_add_fetch (a->consumed, n, __ATOMIC_RELAXED);
+    }
+  return NULL;
+}
+
+static void
+_ring_bench_print (const char *name, uint64_t items, uint64_t ns)
+{
+  printf ("  %-28s: %8.2f M items/sec (%6.2f ns/item)\n", name,
+          ns ? (double) items / ((double) ns / 1e9) / 1e6 : 0.0,
+          items ? (double) ns / items : 0.0);
+}
+
+/* nprod producers and ncons consumers over one ring */
+static int
+_ring_bench_threads (const char *name, int mpmc, int nprod, int ncons,
+                     uint32_t burst, uint64_t items)
+{
+  struct spsc_ring spsc;
+  struct mpmc_ring ring;
+  struct _ring_bench_arg *args;
+  pthread_t *threads;
+  uint64_t consumed = 0, sum = 0, count = 0, t0, ns;
+  int i, n = 0, ret = 0, stop = 0;
+
+  args = calloc (nprod + ncons, sizeof (struct _ring_bench_arg));
+  threads = calloc (nprod + ncons, sizeof (pthread_t));
+  if (! args || ! threads
+      || (mpmc ? mpmc_ring_init (&ring, RING_BENCH_SIZE)
+               : spsc_ring_init (&spsc, RING_BENCH_SIZE))
+             != 0)
+    {
+      fprintf (stderr, "ERROR: cannot allocate the ring benchmark\n");
+      free (args);
+      free (threads);
+      return -1;
+    }
+
+  for (i = 0; i < nprod + ncons; i++)
+    {
+      args[i].spsc = mpmc ? NULL : &spsc;
+      args[i].mpmc = mpmc ? &ring : NULL;
+      args[i].burst = burst;
+      args[i].total = items;
+      args[i].consumed = &consumed;
+      args[i].stop = &stop;
+      if (i < nprod)
+        {
+          args[i].first = 1 + items / nprod * i;
+          args[i].num = i + 1 < nprod ? items / nprod
+                                      : items - items / nprod * i;
+        }
+    }
+
+  t0 = now_nanoseconds ();
+  for (i = 0; i < nprod + ncons; i++, n++)
+    if (pthread_create (&threads[i], NULL,
+                        i < nprod ? _ring_bench_producer
+                                  : _ring_bench_consumer,
+                        &args[i])
+        != 0)
+      {
+        fprintf (stderr, "ERROR: cannot create a ring benchmark thread\n");
+        ret = -1;
+        break;
+      }
+  /* a missing thread would leave the others waiting */
+  if (ret < 0)
+    __atomic_store_n (&stop, 1, __ATOMIC_RELEASE);
+  for (i = 0; i < n; i++)
+    pthread_join (threads[i], NULL);
+  ns = now_nanoseconds () - t0;
+
+  for (i = nprod; i < nprod + ncons; i++)
+    {
+      sum += args[i].sum;
+      count += args[i].count;
+    }
+  if (ret == 0)
+    {
+      _ring_bench_print (name, items, ns);
+      if (count != items || sum != items * (items + 1) / 2)
+        {
+          fprintf (stderr,
+                   "ERROR: %s: %" PRIu64 " items (sum %" PRIu64
+                   "), expected %" PRIu64 "\n",
+                   name, count, sum, items);
+          ret = -1;
+        }
+    }
+
+  if (mpmc)
+    mpmc_ring_free (&ring);
+  else
+    spsc_ring_free (&spsc);
+  free (args);
+  free (threads);
+  return ret;
+}
+
+/* enqueue and dequeue RING_BENCH_BURST at a time on one thread */
+static void
+_ring_bench_single (uint64_t items)
+{
+  struct queue *q;
+  struct spsc_ring spsc;
+  struct mpmc_ring mpmc;
+  void *buf[RING_BENCH_BURST];
+  uintptr_t sink = 0;
+  uint64_t i, t0;
+  int j;
+
+  q = queue_create ();
+  t0 = now_nanoseconds ();
+  for (i = 0; i < items; i += RING_BENCH_BURST)
+    {
+      for (j = 0; j < RING_BENCH_BURST; j++)
+        queue_enqueue (q, (void *) (uintptr_t) (i + j + 1));
+      for (j = 0; j < RING_BENCH_BURST; j++)
+        sink += (uintptr_t) queue_dequeue (q);
+    }
+  _ring_bench_print ("queue.c", i, now_nanoseconds () - t0);
+  queue_delete (q);
+
+  if (spsc_ring_init (&spsc, RING_BENCH_SIZE) == 0)
+    {
+      t0 = now_nanoseconds ();
+      for (i = 0; i < items; i += RING_BENCH_BURST)
+        {
+          for (j = 0; j < RING_BENCH_BURST; j++)
+            spsc_ring_enqueue (&spsc, (void *) (uintptr_t) (i + j + 1));
+          for (j = 0; j < RING_BENCH_BURST; j++)
+            sink += (uintptr_t) spsc_ring_dequeue (&spsc);
+        }
+      _ring_bench_print ("spsc", i, now_nanoseconds () - t0);
+      spsc_ring_free (&spsc);
+    }
+
+  if (mpmc_ring_init (&mpmc, RING_BENCH_SIZE) == 0)
+    {
+      t0 = now_nanoseconds ();
+      for (i = 0; i < items; i += RING_BENCH_BURST)
+        {
+          for (j = 0; j < RING_BENCH_BURST; j++)
+            mpmc_ring_enqueue (&mpmc, (void *) (uintptr_t) (i + j + 1));
+          for (j = 0; j < RING_BENCH_BURST; j++)
+            sink += (uintptr_t) mpmc_ring_dequeue (&mpmc);
+        }
+      _ring_bench_print ("mpmc", i, now_nanoseconds () - t0);
+
+      t0 = now_nanoseconds ();
+      for (i = 0; i < items; i += RING_BENCH_BURST)
+        {
+          for (j = 0; j < RING_BENCH_BURST; j++)
+            buf[j] = (void *) (uintptr_t) (i + j + 1);
+          mpmc_ring_enqueue_burst (&mpmc, buf, RING_BENCH_BURST);
+          mpmc_ring_dequeue_burst (&mpmc, buf, RING_BENCH_BURST);
+          sink += (uintptr_t) buf[0];
+        }
+      _ring_bench_print ("mpmc (burst)", i, now_nanoseconds () - t0);
+      mpmc_ring_free (&mpmc);
+    }
+  _ring_sink = sink;
+}
+
+static int
+_run_ring_benchmark (int nthreads, uint64_t items)
+{
+  char name[64];
+  int ret = 0;
+
+  printf ("============================================\n");
+  printf ("ring benchmark: %" PRIu64 " items, ring of %d, burst %d\n", items,
+          RING_BENCH_SIZE, RING_BENCH_BURST);
+  printf ("single thread (burst in, burst out):\n");
+  _ring_bench_single (items);
+
+  printf ("between threads:\n");
+  ret |= _ring_bench_threads ("spsc 1:1", 0, 1, 1, 1, items);
+  ret |= _ring_bench_threads ("spsc 1:1 (burst)", 0, 1, 1, RING_BENCH_BURST,
+                              items);
+  snprintf (name, sizeof (name), "mpmc %d:%d", nthreads, nthreads);
+  ret |= _ring_bench_threads (name, 1, nthreads, nthreads, 1, items);
+  snprintf (name, sizeof (name), "mpmc %d:%d (burst)", nthreads, nthreads);
+  ret |= _ring_bench_threads (name, 1, nthreads, nthreads, RING_BENCH_BURST,
+                              items);
+  printf ("============================================\n");
+  return ret;
+}
+
+/* -------------------------------------------
+ * Wrapper functions for test.h
+ * ------------------------------------------- */
+int
+test_load_routes (const char *routes_filename, int family, int table_id,
+                  struct rib_tree **rib_tree, struct ptree **ptree)
+{
+  return _load_routes (routes_filename, family, table_id, rib_tree, ptree);
+}
+
+int
+test_hash_benchmark (const char *routes_filename, int family)
+{
+  return _run_hash_benchmark (routes_filename, family);
+}
+
+int
+test_performance (struct fib_engine *e, int family, int flow)
+{
+  const uint64_t trials = 0x10000000ULL;
+
+  if (family == AF_INET)
+    return _benchmark_lookup_performance (e, trials, flow);
+  else
+    return -1; // IPv4 only
+}
+
+int
+test_performance_skewed (struct fib_engine *e, int family, double alpha,
+                         uint32_t cache_entries)
+{
+  const uint64_t trials = 1ULL << 24;
+
+  if (family == AF_INET)
+    return _benchmark_skewed_performance (e, trials, alpha, cache_entries);
+  else
+    return -1; // IPv4 only
+}
+
+int
+test_lookup (struct fib_engine *e, const char *lookup_addrs_filename,
+             int family)
+{
+  return _run_lookup (e, lookup_addrs_filename, family);
+}
+
+int
+test_lookup_all (struct fib_engine *e, struct ptree *ptree, int family)
+{
+  if (family == AF_INET)
+    return _run_lookup_all (e, ptree);
+  else
+    return -1; // IPv4 only
+}
+
+int
+test_fib_stats (struct fib_tree *fib_tree, struct rib_tree *rib_tree,
+                const char *json_filename)
+{
+  if (! fib_tree || ! fib_tree->root)
+    {
+      printf ("FIB tree is empty\n");
+      return 0;
+    }
+  return _run_fib_stats (fib_tree, rib_tree, json_filename);
+}
+
+int
+test_aggregate (struct rib_tree *rib_tree, struct rib_tree *aggr_tree,
+                int family)
+{
+  return _run_aggregation (rib_tree, aggr_tree, family);
+}
+
+int
+test_lctrie (struct rib_tree *rib_tree, struct fib_tree *fib_tree,
+             struct ptree *ptree, int family)
+{
+  if (family == AF_INET)
+    return _run_lctrie (rib_tree, fib_tree, ptree);
+  else
+    return -1; // IPv4 only
+}
+
+int
+test_rib_bulk_load (struct rib_tree *rib_tree)
+{
+  return _run_rib_bulk_load (rib_tree);
+}
+
+int
+test_sail (struct rib_tree *rib_tree, struct fib_tree *fib_tree,
+           struct ptree *ptree, int family)
+{
+  if (family == AF_INET)
+    return _run_sail (rib_tree, fib_tree, ptree);
+  else
+    return -1; // IPv4 only
+}
+
+int
+test_dxr (struct rib_tree *rib_tree, struct fib_tree *fib_tree,
+          struct ptree *ptree, int family)
+{
+  if (family == AF_INET)
+    return _run_dxr (rib_tree, fib_tree, ptree);
+  else
+    return -1; // IPv4 only
+}
+
+int
+test_treebitmap (struct tbm_tree *tbm, struct rib_tree *rib_tree,
+                 struct fib_tree *fib_tree, struct ptree *ptree, int family)
+{
+  if (family == AF_INET)
+    return _run_treebitmap (tbm, rib_tree, fib_tree, ptree);
+  else
+    return -1; // IPv4 only
+}
+
+int
+test_update_replay (struct rib_tree *rib_tree, struct fib_tree *fib_tree,
+                    struct tbm_tree *tbm, struct ptree *ptree,
+                    const char *update_filename, int family, int nthreads)
+{
+  if (family == AF_INET)
+    return _run_update_replay (rib_tree, fib_tree, tbm, ptree,
+                               update_filename, family, nthreads);
+  else
+    return -1; // IPv4 only (lookup threads)
+}
+
+int
+test_bench (const char *route_file, struct rib_tree *rib_tree,
+            struct ptree *ptree, int family, const char *names, int nthreads,
+            uint64_t lookups, const char *json_filename)
+{
+  if (nthreads < 1 || lookups < BENCH_BATCH)
+    return -1;
+  return _run_bench (route_file, rib_tree, ptree, family, names, nthreads,
+                     lookups, json_filename);
+}
+
+int
+test_ring_benchmark (int nthreads, uint64_t items)
+{
+  if (nthreads < 1 || items < RING_BENCH_BURST)
+    return -1;
+  return _run_ring_benchmark (nthreads, items);
 }
@@ -3,12 +3,40 @@
 
 #include "fib.h"
 #include "ptree.h"
+#include "treebitmap.h"
+#include "engine.h"
 
-int test_load_routes(const char *routes_filename, int family,
+int test_load_routes(const char *routes_filename, int family, int table_id,
                      struct rib_tree **rib_tree, struct ptree **ptree);
-int test_performance (struct fib_tree *t, int family);
-int test_lookup (struct fib_tree *t, const char *lookup_addrs_filename, int family);
-int test_lookup_all (struct fib_tree *fib_tree, struct ptree *ptree, int family);
+int test_performance (struct fib_engine *e, int family, int flow);
+int test_performance_skewed (struct fib_engine *e, int family, double alpha,
+                             uint32_t cache_entries);
+int test_hash_benchmark (const char *routes_filename, int family);
+int test_lookup (struct fib_engine *e, const char *lookup_addrs_filename,
+                 int family);
+int test_lookup_all (struct fib_engine *e, struct ptree *ptree, int family);
 void test_count_fib_nodes (struct fib_tree *t);
+int test_fib_stats (struct fib_tree *fib_tree, struct rib_tree *rib_tree,
+                    const char *json_filename);
+int test_aggregate (struct rib_tree *rib_tree, struct rib_tree *aggr_tree,
+                    int family);
+int test_lctrie (struct rib_tree *rib_tree, struct fib_tree *fib_tree,
+                 struct ptree *ptree, int family);
+int test_rib_bulk_load (struct rib_tree *rib_tree);
+int test_sail (struct rib_tree *rib_tree, struct fib_tree *fib_tree,
+               struct ptree *ptree, int family);
+int test_dxr (struct rib_tree *rib_tree, struct fib_tree *fib_tree,
+              struct ptree *ptree, int family);
+int test_treebitmap (struct tbm_tree *tbm, struct rib_tree *rib_tree,
+                     struct fib_tree *fib_tree, struct ptree *ptree,
+                     int family);
+int test_bench (const char *route_file, struct rib_tree *rib_tree,
+                struct ptree *ptree, int family, const char *names,
+                int nthreads, uint64_t lookups, const char *json_filename);
+int test_ring_benchmark (int nthreads, uint64_t items);
+int test_update_replay (struct rib_tree *rib_tree, struct fib_tree *fib_tree,
+                        struct tbm_tree *tbm, struct ptree *ptree,
+                        const char *update_filename, int family,
+                        int nthreads);
 
 #endif /* TEST_H */
\ No newline at end of file
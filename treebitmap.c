@@ -0,0 +1,307 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "treebitmap.h"
+#include "radix.h"
+#include "nexthop_group.h"
+
+/* key: address, s: start bit, n: number of bits (番兵バイト確保前提) */
+static inline uint32_t
+_bits (const uint8_t *key, int s, int n)
+{
+  int byte_idx = s >> 3;
+  int bit_offset = s & 7;
+
+  if (n == 0)
+    return 0;
+  return (((key[byte_idx] << 8) | (key[byte_idx + 1])) >>
+          (16 - (bit_offset + n))) & ((1 << n) - 1);
+}
+
+/* internal bits of the prefixes in the node that match the STRIDE bits */
+static inline uint32_t
+_match_mask (uint32_t bits)
+{
+  uint32_t m = 0;
+  int l;
+
+  for (l = 0; l < TBM_STRIDE; l++)
+    m |= 1U << ((1 << l) - 1 + (bits >> (TBM_STRIDE - l)));
+  return m;
+}
+
+/* number of set bits below bit b */
+static inline int
+_rank (uint32_t bitmap, int b)
+{
+  return __builtin_popcount (bitmap & ((1U << b) - 1));
+}
+
+/* 18 bytes: the node at depth 128 reads two bytes past the key */
+static inline void
+_key_safe (uint8_t *key_safe, const uint8_t *key, int keylen)
+{
+  memset (key_safe, 0, 18);
+  memcpy (key_safe, key, KEY_SIZE (keylen));
+}
+
+struct tbm_tree *
+tbm_new (struct tbm_tree *t)
+{
+  if (! t)
+    {
+      t = malloc (sizeof (struct tbm_tree));
+      if (! t)
+        return NULL;
+    }
+  memset (t, 0, sizeof (struct tbm_tree));
+  return t;
+}
+
+struct tbm_frame
+{
+  struct tbm_node *node;
+  int idx; // next child to visit
+};
+
+void
+tbm_free (struct tbm_tree *t)
+{
+  struct tbm_frame stack[TBM_MAX_LEVEL + 1];
+  struct tbm_node *n;
+  int i, sp = 0;
+
+  if (! t)
+    return;
+
+  stack[sp++] = (struct tbm_frame){ &t->root, 0 };
+  while (sp > 0)
+    {
+      struct tbm_frame *f = &stack[sp - 1];
+
+      n = f->node;
+      if (f->idx < __builtin_popcount (n->external))
+        {
+          stack[sp++] = (struct tbm_frame){ &n->children[f->idx++], 0 };
+          continue;
+        }
+
+      for (i = 0; i < __builtin_popcount (n->internal); i++)
+        nhg_unref (n->results[i]);
+      free (n->results);
+      free (n->children);
+      sp--;
+    }
+  free (t);
+}
+
+uint64_t
+tbm_mem_size (const struct tbm_tree *t)
+{
+  return sizeof (struct tbm_tree) + t->num_nodes * sizeof (struct tbm_node)
+         + t->num_prefixes * sizeof (int);
+}
+
+/* open a slot at idx in an array of n elements */
+static void *
+_array_insert (void *array, int n, int idx, size_t size)
+{
+  uint8_t *a;
+
+  a = realloc (array, (n + 1) * size);
+  if (! a)
+    return NULL;
+  memmove (a + (idx + 1) * size, a + idx * size, (n - idx) * size);
+  return a;
+}
+
+/* close the slot at idx in an array of n elements */
+static void *
+_array_remove (void *array, int n, int idx, size_t size)
+{
+  uint8_t *a = array;
+
+  memmove (a + idx * size, a + (idx + 1) * size, (n - idx - 1) * size);
+  if (n == 1)
+    {
+      free (a);
+      return NULL;
+    }
+  a = realloc (a, (n - 1) * size);
+  return a ? (void *) a : array; // shrinking cannot really fail
+}
+
+/* add or replace a prefix: touches the arrays of a single node */
+int
+tbm_route_add (struct tbm_tree *t, const uint8_t *key, int keylen, int id)
+{
+  struct tbm_node *n, *children;
+  uint8_t key_safe[18];
+  uint32_t bits;
+  int depth, idx, pos, len, *results;
+
+  _key_safe (key_safe, key, keylen);
+
+  n = &t->root;
+  for (depth = 0; keylen - depth >= TBM_STRIDE; depth += TBM_STRIDE)
+    {
+      bits = _bits (key_safe, depth, TBM_STRIDE);
+      idx = _rank (n->external, bits);
+      if (! (n->external & (1U << bits)))
+        {
+          children = _array_insert (n->children,
+                                    __builtin_popcount (n->external), idx,
+                                    sizeof (struct tbm_node));
+          if (! children)
+            return -1; // failed, not enough memory
+          memset (&children[idx], 0, sizeof (struct tbm_node));
+          n->children = children;
+          n->external |= 1U << bits;
+          t->num_nodes++;
+        }
+      n = &n->children[idx];
+    }
+
+  len = keylen - depth;
+  pos = (1 << len) - 1 + _bits (key_safe, depth, len);
+  idx = _rank (n->internal, pos);
+  nhg_ref (id);
+  if (n->internal & (1U << pos))
+    {
+      nhg_unref (n->results[idx]);
+      n->results[idx] = id;
+      return 0;
+    }
+
+  results = _array_insert (n->results, __builtin_popcount (n->internal), idx,
+                           sizeof (int));
+  if (! results)
+    {
+      nhg_unref (id);
+      return -1;
+    }
+  results[idx] = id;
+  n->results = results;
+  n->internal |= 1U << pos;
+  t->num_prefixes++;
+  return 0;
+}
+
+/* remove a prefix, and the nodes left empty. -1: no such prefix */
+int
+tbm_route_delete (struct tbm_tree *t, const uint8_t *key, int keylen)
+{
+  struct tbm_node *path[TBM_MAX_LEVEL];
+  uint32_t path_bits[TBM_MAX_LEVEL];
+  struct tbm_node *n, *parent;
+  uint8_t key_safe[18];
+  uint32_t bits;
+  int depth, idx, pos, len, npath = 0;
+
+  _key_safe (key_safe, key, keylen);
+
+  n = &t->root;
+  for (depth = 0; keylen - depth >= TBM_STRIDE; depth += TBM_STRIDE)
+    {
+      bits = _bits (key_safe, depth, TBM_STRIDE);
+      if (! (n->external & (1U << bits)))
+        return -1;
+      path[npath] = n;
+      path_bits[npath++] = bits;
+      n = &n->children[_rank (n->external, bits)];
+    }
+
+  len = keylen - depth;
+  pos = (1 << len) - 1 + _bits (key_safe, depth, len);
+  if (! (n->internal & (1U << pos)))
+    return -1;
+  idx = _rank (n->internal, pos);
+  nhg_unref (n->results[idx]);
+  n->results = _array_remove (n->results, __builtin_popcount (n->internal),
+                              idx, sizeof (int));
+  n->internal &= ~(1U << pos);
+  t->num_prefixes--;
+
+  /* 空になったノードを下から削除 */
+  while (npath > 0 && ! n->internal && ! n->external)
+    {
+      parent = path[--npath];
+      bits = path_bits[npath];
+      parent->children = _array_remove (parent->children,
+                                        __builtin_popcount (parent->external),
+                                        _rank (parent->external, bits),
+                                        sizeof (struct tbm_node));
+      parent->external &= ~(1U << bits);
+      t->num_nodes--;
+      n = parent;
+    }
+  return 0;
+}
+
+/*
+ * 各ノードではビットマップのみを見て, 最長一致の位置を覚えておく.
+ * 結果の配列は最後に1回だけ読む.
+ */
+int
+tbm_route_lookup (struct tbm_tree *t, const uint8_t *key)
+{
+  const struct tbm_node *n = &t->root, *match = NULL;
+  uint8_t key_safe[18];
+  uint32_t bits, m;
+  int depth = 0, pos = 0, len = (t->family == AF_INET6) ? 16 : 4;
+
+  memcpy (key_safe, key, len);
+  key_safe[len] = key_safe[len + 1] = 0;
+
+  for (;;)
+    {
+      bits = _bits (key_safe, depth, TBM_STRIDE);
+      m = n->internal & _match_mask (bits);
+      if (m)
+        {
+          match = n;
+          pos = 31 - __builtin_clz (m); // the longest one
+        }
+      if (! (n->external & (1U << bits)))
+        break;
+      n = &n->children[_rank (n->external, bits)];
+      depth += TBM_STRIDE;
+    }
+
+  return match ? match->results[_rank (match->internal, pos)] : -1;
+}
+
+static int
+_add_to_tbm (struct rib_node *n, void *arg)
+{
+  struct tbm_tree *t = (struct tbm_tree *) arg;
+
+  return tbm_route_add (t, n->key, n->keylen, n->route_idx[0]);
+}
+
+int
+tbm_build (struct tbm_tree *t, struct rib_tree *rib_tree)
+{
+  t->family = rib_tree->family;
+  return rib_traverse (rib_tree, _add_to_tbm, t);
+}
+
+/*
+ * leaf pushingをしないので, RIBで変わったプレフィックス自身を
+ * 追加/置換/削除するだけでよい (より長いプレフィックスは影響を受けない).
+ */
+int
+tbm_update_from_rib (struct tbm_tree *t, struct rib_tree *rib_tree,
+                     const uint8_t *key, int keylen)
+{
+  struct rib_node *n;
+
+  n = rib_route_lookup_exact (rib_tree, key, keylen);
+  if (n && n->valid && n->num_routes != 0)
+    return tbm_route_add (t, key, keylen, n->route_idx[0]);
+  tbm_route_delete (t, key, keylen); // may not exist
+  return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef TREEBITMAP_H
+#define TREEBITMAP_H
+
+#include <stdint.h>
+
+#include "fib.h"
+
+/*
+ * Tree Bitmap (Eatherton et al.). IPv4/v6.
+ * leaf pushingをしないmultibit trie. 各ノードはTBM_STRIDEビット分を担当し,
+ * - internal: ノード内で終わるプレフィックス (長さ 0..STRIDE-1) のビットマップ.
+ *   長さl, 値vのプレフィックスはビット (1 << l) - 1 + v.
+ * - external: 子ノードの有無 (2^STRIDE ビット).
+ * 子ノードと結果 (nexthop id) はそれぞれビット順に連続した配列に置き,
+ * 位置はビットマップのpopcountで求める.
+ * プレフィックスは1つのノードの1ビットと1つの結果なので, 追加/削除は
+ * 1つのノードの配列 (最大 2^STRIDE 要素) の挿入/削除で済む.
+ */
+
+#define TBM_STRIDE     4
+#define TBM_BRANCH_SZ  (1 << TBM_STRIDE)
+#define TBM_MAX_LEVEL  (128 / TBM_STRIDE + 1)
+
+struct tbm_node
+{
+  uint32_t internal;
+  uint32_t external;
+  struct tbm_node *children; // popcount (external) nodes
+  int *results;              // popcount (internal) nexthop ids
+};
+
+struct tbm_tree
+{
+  int family;
+  struct tbm_node root;
+  uint64_t num_nodes;    // excluding the root
+  uint64_t num_prefixes;
+};
+
+struct tbm_tree *tbm_new (struct tbm_tree *t);
+void tbm_free (struct tbm_tree *t);
+uint64_t tbm_mem_size (const struct tbm_tree *t);
+
+int tbm_route_add (struct tbm_tree *t, const uint8_t *key, int keylen,
+                   int id);
+int tbm_route_delete (struct tbm_tree *t, const uint8_t *key, int keylen);
+/* returns the nexthop id, or -1 if there is no route */
+int tbm_route_lookup (struct tbm_tree *t, const uint8_t *key);
+
+/* build from the RIB, and follow a prefix changed in the RIB */
+int tbm_build (struct tbm_tree *t, struct rib_tree *rib_tree);
+int tbm_update_from_rib (struct tbm_tree *t, struct rib_tree *rib_tree,
+                         const uint8_t *key, int keylen);
+
+#endif /* TREEBITMAP_H */
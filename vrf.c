@@ -0,0 +1,299 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "vrf.h"
+#include "radix.h"
+#include "route_entry.h"
+#include "main.h"
+
+static struct vrf **_buckets = NULL;
+static uint32_t _num_buckets = 0;
+static int _num_tables = 0;
+
+static inline uint32_t
+_hash (int family, int table_id)
+{
+  uint32_t h = (uint32_t) table_id * 0x9e3779b1 ^ (uint32_t) family;
+
+  h ^= h >> 16;
+  return h & (_num_buckets - 1);
+}
+
+/* double the buckets and rehash the tables */
+static int
+_grow (void)
+{
+  struct vrf **old = _buckets, *v, *next;
+  uint32_t i, old_size = _num_buckets;
+  uint32_t size = old_size ? old_size * 2 : VRF_HASH_MIN_SIZE;
+
+  _buckets = calloc (size, sizeof (struct vrf *));
+  if (! _buckets)
+    {
+      _buckets = old;
+      return -1;
+    }
+  _num_buckets = size;
+  for (i = 0; i < old_size; i++)
+    for (v = old[i]; v; v = next)
+      {
+        next = v->hash_next;
+        v->hash_next = _buckets[_hash (v->family, v->table_id)];
+        _buckets[_hash (v->family, v->table_id)] = v;
+      }
+  free (old);
+  return 0;
+}
+
+struct vrf *
+vrf_lookup (int family, int table_id)
+{
+  struct vrf *v;
+
+  if (_num_buckets == 0)
+    return NULL;
+  for (v = _buckets[_hash (family, table_id)]; v; v = v->hash_next)
+    if (v->family == family && v->table_id == table_id)
+      return v;
+  return NULL;
+}
+
+/* returns the table, creating it if it does not exist */
+struct vrf *
+vrf_get (int family, int table_id)
+{
+  struct vrf *v;
+  uint32_t h;
+
+  v = vrf_lookup (family, table_id);
+  if (v)
+    return v;
+
+  if ((uint32_t) _num_tables >= _num_buckets && _grow () != 0)
+    return NULL;
+
+  v = malloc (sizeof (struct vrf));
+  if (! v)
+    return NULL;
+  v->rib = rib_new (NULL);
+  if (! v->rib)
+    {
+      free (v);
+      return NULL;
+    }
+  v->rib->family = family;
+  v->rib->table_id = table_id;
+  v->family = family;
+  v->table_id = table_id;
+  v->fib = NULL;
+
+  h = _hash (family, table_id);
+  v->hash_next = _buckets[h];
+  _buckets[h] = v;
+  _num_tables++;
+  return v;
+}
+
+static void
+_free_vrf (struct vrf *v)
+{
+  if (v->fib)
+    fib_free (v->fib);
+  rib_free (v->rib);
+  free (v);
+}
+
+int
+vrf_delete (int family, int table_id)
+{
+  struct vrf **vp, *v;
+
+  if (_num_buckets == 0)
+    return -1;
+  for (vp = &_buckets[_hash (family, table_id)]; (v = *vp) != NULL;
+       vp = &v->hash_next)
+    if (v->family == family && v->table_id == table_id)
+      {
+        *vp = v->hash_next;
+        _free_vrf (v);
+        _num_tables--;
+        return 0;
+      }
+  return -1;
+}
+
+int
+vrf_count (void)
+{
+  return _num_tables;
+}
+
+int
+vrf_build_fib (struct vrf *v)
+{
+  if (v->fib)
+    fib_free (v->fib);
+  v->fib = fib_new (NULL);
+  if (! v->fib)
+    return -1;
+  return rebuild_fib_from_rib (v->rib, v->fib);
+}
+
+static int
+_build_fib_if_missing (struct vrf *v, void *arg)
+{
+  (void) arg;
+  if (v->fib)
+    return 0;
+  return vrf_build_fib (v);
+}
+
+int
+vrf_build_fibs (void)
+{
+  return vrf_traverse (_build_fib_if_missing, NULL);
+}
+
+int
+vrf_route_lookup (int family, int table_id, const uint8_t *key)
+{
+  struct vrf *v = vrf_lookup (family, table_id);
+
+  if (! v || ! v->fib)
+    return -1;
+  return fib_route_lookup (v->fib, key);
+}
+
+int
+vrf_traverse (vrf_traverse_callback callback, void *arg)
+{
+  struct vrf *v, *next;
+  uint32_t i;
+
+  for (i = 0; i < _num_buckets; i++)
+    for (v = _buckets[i]; v; v = next)
+      {
+        next = v->hash_next; // the callback may delete the table
+        if (callback (v, arg) != 0)
+          return -1;
+      }
+  return 0;
+}
+
+static int
+_count_fib_node (fib_slot_t s, const uint8_t *key, int depth, void *arg)
+{
+  (void) key;
+  (void) depth;
+  if (! FIB_SLOT_IS_LEAF (s))
+    (*(uint64_t *) arg)++;
+  return 0;
+}
+
+void
+vrf_get_stats (const struct vrf *v, struct vrf_stats *st)
+{
+  memset (st, 0, sizeof (struct vrf_stats));
+  st->num_prefixes = v->rib->num_prefixes;
+  st->num_paths = v->rib->num_paths;
+  st->rib_nodes = v->rib->num_nodes;
+  st->rib_mem_size = sizeof (struct vrf) + sizeof (struct rib_tree)
+                     + v->rib->mem_size;
+  if (v->fib)
+    {
+      fib_traverse (v->fib, _count_fib_node, &st->fib_nodes);
+      st->fib_mem_size = sizeof (struct fib_tree)
+                         + st->fib_nodes * sizeof (struct fib_node);
+    }
+}
+
+static int
+_collect (struct vrf *v, void *arg)
+{
+  struct vrf ***p = (struct vrf ***) arg;
+
+  *(*p)++ = v;
+  return 0;
+}
+
+static int
+_compare_vrf (const void *a, const void *b)
+{
+  const struct vrf *x = *(const struct vrf *const *) a;
+  const struct vrf *y = *(const struct vrf *const *) b;
+
+  if (x->family != y->family)
+    return x->family < y->family ? -1 : 1;
+  if (x->table_id != y->table_id)
+    return x->table_id < y->table_id ? -1 : 1;
+  return 0;
+}
+
+/* per-table statistics, in (family, table_id) order */
+void
+vrf_print_stats (void)
+{
+  struct vrf **tables, **p;
+  struct vrf_stats st, total;
+  int i;
+
+  tables = malloc ((_num_tables ? _num_tables : 1) * sizeof (struct vrf *));
+  if (! tables)
+    {
+      fprintf (stderr, "ERROR: cannot allocate table list\n");
+      return;
+    }
+  p = tables;
+  vrf_traverse (_collect, &p);
+  qsort (tables, _num_tables, sizeof (struct vrf *), _compare_vrf);
+
+  memset (&total, 0, sizeof (total));
+  printf ("============================================\n");
+  printf ("routing tables: %d\n", _num_tables);
+  for (i = 0; i < _num_tables; i++)
+    {
+      vrf_get_stats (tables[i], &st);
+      printf ("  table %-6d %s: %" PRIu64 " prefixes, %" PRIu64
+              " paths, RIB %" PRIu64 " nodes %" PRIu64 " bytes, FIB %" PRIu64
+              " nodes %" PRIu64 " bytes\n",
+              tables[i]->table_id,
+              tables[i]->family == AF_INET6 ? "IPv6" : "IPv4",
+              st.num_prefixes, st.num_paths, st.rib_nodes, st.rib_mem_size,
+              st.fib_nodes, st.fib_mem_size);
+      total.num_prefixes += st.num_prefixes;
+      total.num_paths += st.num_paths;
+      total.rib_mem_size += st.rib_mem_size;
+      total.fib_mem_size += st.fib_mem_size;
+    }
+  printf ("  total: %" PRIu64 " prefixes, %" PRIu64 " paths, RIB %" PRIu64
+          " bytes, FIB %" PRIu64 " bytes, registry %" PRIu64 " bytes\n",
+          total.num_prefixes, total.num_paths, total.rib_mem_size,
+          total.fib_mem_size,
+          (uint64_t) _num_buckets * sizeof (struct vrf *));
+  printf ("  shared: ");
+  route_table_print_stats (&route_table);
+  printf ("============================================\n");
+  free (tables);
+}
+
+void
+vrf_free_all (void)
+{
+  struct vrf *v, *next;
+  uint32_t i;
+
+  for (i = 0; i < _num_buckets; i++)
+    for (v = _buckets[i]; v; v = next)
+      {
+        next = v->hash_next;
+        _free_vrf (v);
+      }
+  free (_buckets);
+  _buckets = NULL;
+  _num_buckets = 0;
+  _num_tables = 0;
+}
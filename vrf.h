@@ -0,0 +1,56 @@
+#ifndef VRF_H
+#define VRF_H
+
+#include <stdint.h>
+
+#include "fib.h"
+
+/*
+ * Routing tables (VRF).
+ * テーブルは (family, table_id) をキーとするハッシュで管理する. 各テーブルは
+ * 自身のRIBとFIBを持ち, nexthop (route_table) とnexthop groupは全テーブルで
+ * 共有する. テーブルは使われた時に作成し, 経路のないテーブルのコストは
+ * struct vrf と空のRIB/FIBのヘッダのみ.
+ */
+
+#define VRF_HASH_MIN_SIZE 16 // power of 2, doubled when tables > buckets
+
+struct vrf
+{
+  int family;
+  int table_id;
+  struct rib_tree *rib;
+  struct fib_tree *fib; // NULL until built
+  struct vrf *hash_next;
+};
+
+struct vrf_stats
+{
+  uint64_t num_prefixes;
+  uint64_t num_paths;
+  uint64_t rib_nodes;
+  uint64_t rib_mem_size; // bytes
+  uint64_t fib_nodes;
+  uint64_t fib_mem_size; // bytes
+};
+
+struct vrf *vrf_lookup (int family, int table_id);
+struct vrf *vrf_get (int family, int table_id);
+int vrf_delete (int family, int table_id);
+int vrf_count (void);
+
+/* build the FIB of the table, or of every table without one */
+int vrf_build_fib (struct vrf *v);
+int vrf_build_fibs (void);
+
+/* longest prefix match in the FIB of the table, -1 if no route */
+int vrf_route_lookup (int family, int table_id, const uint8_t *key);
+
+typedef int (*vrf_traverse_callback) (struct vrf *v, void *arg);
+int vrf_traverse (vrf_traverse_callback callback, void *arg);
+
+void vrf_get_stats (const struct vrf *v, struct vrf_stats *st);
+void vrf_print_stats (void);
+void vrf_free_all (void);
+
+#endif /* VRF_H */